@@ -0,0 +1,399 @@
+#include "Capture.h"
+#include "zstd/zstd.h"
+
+static logging::Channel Logger("Capture");
+
+static const char kCaptureMagic[8] = { 'S', 'P', 'H', 'X', 'C', 'A', 'P', '1' };
+
+// Faster levels keep the writer thread ahead of the peers feeding it
+static const int kCaptureCompressionLevel = 1;
+
+
+//-----------------------------------------------------------------------------
+// CaptureWriter
+
+CaptureWriter::~CaptureWriter()
+{
+    Close();
+}
+
+bool CaptureWriter::Open(const std::string& path)
+{
+    Close();
+
+    File = fopen(path.c_str(), "wb");
+    if (!File)
+    {
+        Logger.Warning("Unable to open capture file ", path);
+        return false;
+    }
+
+    if (fwrite(kCaptureMagic, 1, sizeof(kCaptureMagic), File) != sizeof(kCaptureMagic))
+    {
+        Logger.Warning("Unable to write capture file ", path);
+        fclose(File);
+        File = nullptr;
+        return false;
+    }
+
+    {
+        Locker locker(WriteLock);
+
+        StartUsec = GetTimeUsec();
+        Block.reserve(kCaptureBlockBytes);
+        Block.clear();
+        FullBlocks.clear();
+        DroppedRecords = 0;
+        Opened = true;
+    }
+
+    Terminated = false;
+    Thread = std::make_unique<std::thread>(&CaptureWriter::Loop, this);
+
+    Logger.Info("Capturing inbound traffic to ", path);
+    return true;
+}
+
+void CaptureWriter::Close()
+{
+    {
+        Locker locker(WriteLock);
+        Opened = false;
+    }
+
+    if (Thread)
+    {
+        Terminated = true;
+        {
+            std::lock_guard<std::mutex> locker(WakeLock);
+            Condition.notify_all();
+        }
+
+        try
+        {
+            Thread->join();
+        }
+        catch (std::system_error& /*err*/)
+        {
+        }
+    }
+    Thread = nullptr;
+
+    if (!File)
+        return;
+
+    // The writer thread is gone, so the last block can skip the queue limit
+    {
+        Locker locker(WriteLock);
+        if (!Block.empty())
+            FullBlocks.push_back(std::move(Block));
+        Block.clear();
+    }
+    writeFullBlocks();
+
+    if (File)
+    {
+        fclose(File);
+        File = nullptr;
+    }
+}
+
+u32 CaptureWriter::AddSource()
+{
+    return NextSource++;
+}
+
+void CaptureWriter::Write(u32 source, CaptureType type, const u8* data, int bytes)
+{
+    if (bytes < 0 || bytes > kCaptureRecordMaxBytes)
+    {
+        DEBUG_BREAK; return;
+    }
+
+    const u64 nowUsec = GetTimeUsec();
+    bool sealed = false;
+
+    {
+        Locker locker(WriteLock);
+
+        if (!Opened)
+            return;
+
+        // The open block could not be queued: The writer has fallen behind
+        if (Block.size() >= (size_t)kCaptureBlockBytes)
+        {
+            ++DroppedRecords;
+            return;
+        }
+
+        const u64 timeUsec = nowUsec - StartUsec;
+        const u8 typeByte = (u8)type;
+        const u32 recordBytes = (u32)bytes;
+
+        u8 header[kCaptureRecordHeaderBytes];
+        memcpy(header, &timeUsec, 8);
+        memcpy(header + 8, &source, 4);
+        memcpy(header + 12, &typeByte, 1);
+        memcpy(header + 13, &recordBytes, 4);
+
+        if (Block.empty())
+            BlockStartUsec = nowUsec;
+        Block.insert(Block.end(), header, header + sizeof(header));
+        Block.insert(Block.end(), data, data + bytes);
+
+        if (Block.size() >= (size_t)kCaptureBlockBytes)
+        {
+            sealBlock();
+            sealed = true;
+        }
+    }
+
+    if (sealed)
+    {
+        std::lock_guard<std::mutex> locker(WakeLock);
+        Condition.notify_all();
+    }
+}
+
+void CaptureWriter::sealBlock()
+{
+    if (Block.empty() || FullBlocks.size() >= (size_t)kCaptureQueueBlocks)
+        return;
+
+    FullBlocks.push_back(std::move(Block));
+
+    if (!FreeBlocks.empty())
+    {
+        Block = std::move(FreeBlocks.back());
+        FreeBlocks.pop_back();
+    }
+    else
+    {
+        Block = std::vector<u8>();
+        Block.reserve(kCaptureBlockBytes);
+    }
+}
+
+void CaptureWriter::Loop()
+{
+    SetThreadName("CaptureWriter");
+
+    while (!Terminated)
+    {
+        // Write blocks that are getting old, so a process that is killed
+        // loses little
+        {
+            Locker locker(WriteLock);
+            if (!Block.empty() && (s64)(GetTimeUsec() - BlockStartUsec) >= kCaptureBlockMsec * 1000)
+                sealBlock();
+        }
+
+        if (!writeFullBlocks())
+        {
+            std::unique_lock<std::mutex> locker(WakeLock);
+            if (!Terminated)
+                Condition.wait_for(locker, std::chrono::milliseconds(kCaptureBlockMsec / 4));
+        }
+    }
+
+    writeFullBlocks();
+}
+
+bool CaptureWriter::writeFullBlocks()
+{
+    std::vector<std::vector<u8>> blocks;
+    u64 droppedRecords;
+
+    {
+        Locker locker(WriteLock);
+        blocks.swap(FullBlocks);
+        droppedRecords = DroppedRecords;
+        DroppedRecords = 0;
+    }
+
+    if (droppedRecords > 0)
+        Logger.Warning("Capture dropped ", droppedRecords, " records: Writing could not keep up");
+
+    if (blocks.empty())
+        return false;
+
+    for (auto& block : blocks)
+    {
+        if (File && !writeBlock(block))
+        {
+            Logger.Warning("Capture write failed: Stopping capture");
+            fclose(File);
+            File = nullptr;
+
+            Locker locker(WriteLock);
+            Opened = false;
+        }
+    }
+
+    // Hand the buffers back for reuse
+    Locker locker(WriteLock);
+    for (auto& block : blocks)
+    {
+        if (FreeBlocks.size() >= (size_t)kCaptureQueueBlocks)
+            break;
+        block.clear();
+        FreeBlocks.push_back(std::move(block));
+    }
+    return true;
+}
+
+bool CaptureWriter::writeBlock(const std::vector<u8>& block)
+{
+    Compressed.resize(8 + ZSTD_compressBound(block.size()));
+
+    const size_t compressedBytes = ZSTD_compress(&Compressed[8], Compressed.size() - 8,
+        block.data(), block.size(), kCaptureCompressionLevel);
+    if (ZSTD_isError(compressedBytes))
+    {
+        // Skip the block but keep capturing
+        Logger.Warning("Capture compression failed, err=", ZSTD_getErrorName(compressedBytes));
+        DEBUG_BREAK; return true;
+    }
+
+    const u32 compressedField = (u32)compressedBytes;
+    const u32 rawField = (u32)block.size();
+    memcpy(&Compressed[0], &compressedField, 4);
+    memcpy(&Compressed[4], &rawField, 4);
+
+    const size_t writeBytes = 8 + compressedBytes;
+    return fwrite(Compressed.data(), 1, writeBytes, File) == writeBytes && fflush(File) == 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// CaptureReader
+
+CaptureReader::~CaptureReader()
+{
+    Close();
+}
+
+bool CaptureReader::Open(const std::string& path)
+{
+    Close();
+
+    File = fopen(path.c_str(), "rb");
+    if (!File)
+    {
+        Logger.Warning("Unable to open capture file ", path);
+        return false;
+    }
+
+    char magic[sizeof(kCaptureMagic)];
+    if (fread(magic, 1, sizeof(magic), File) != sizeof(magic) ||
+        memcmp(magic, kCaptureMagic, sizeof(magic)) != 0)
+    {
+        Logger.Warning("Not a capture file: ", path);
+        Close();
+        return false;
+    }
+
+    Block.clear();
+    BlockOffset = 0;
+    return true;
+}
+
+void CaptureReader::Close()
+{
+    if (File)
+    {
+        fclose(File);
+        File = nullptr;
+    }
+}
+
+bool CaptureReader::readBlock()
+{
+    u8 sizes[8];
+    if (!File || fread(sizes, 1, sizeof(sizes), File) != sizeof(sizes))
+        return false;
+
+    u32 compressedBytes, rawBytes;
+    memcpy(&compressedBytes, sizes, 4);
+    memcpy(&rawBytes, sizes + 4, 4);
+
+    // Sizes come from the file, so bound them before allocating
+    if (rawBytes > (u32)kCaptureBlockMaxBytes || compressedBytes > ZSTD_compressBound(kCaptureBlockMaxBytes))
+    {
+        Logger.Warning("Damaged capture block");
+        return false;
+    }
+
+    Compressed.resize(compressedBytes);
+    Block.resize(rawBytes);
+    BlockOffset = 0;
+
+    if (fread(Compressed.data(), 1, compressedBytes, File) != compressedBytes)
+    {
+        Logger.Warning("Capture file ends in the middle of a block");
+        return false;
+    }
+
+    const size_t result = ZSTD_decompress(Block.data(), Block.size(), Compressed.data(), compressedBytes);
+    if (ZSTD_isError(result) || result != rawBytes)
+    {
+        Logger.Warning("Damaged capture block");
+        return false;
+    }
+
+    return true;
+}
+
+bool CaptureReader::Read(CaptureRecord& record)
+{
+    if (BlockOffset >= Block.size() && !readBlock())
+        return false;
+
+    if (Block.size() - BlockOffset < (size_t)kCaptureRecordHeaderBytes)
+    {
+        Logger.Warning("Damaged capture record");
+        return false;
+    }
+
+    const u8* header = &Block[BlockOffset];
+    u8 typeByte;
+    u32 recordBytes;
+    memcpy(&record.TimeUsec, header, 8);
+    memcpy(&record.Source, header + 8, 4);
+    memcpy(&typeByte, header + 12, 1);
+    memcpy(&recordBytes, header + 13, 4);
+    BlockOffset += kCaptureRecordHeaderBytes;
+
+    if (typeByte >= (u8)CaptureType::Count || recordBytes > Block.size() - BlockOffset)
+    {
+        Logger.Warning("Damaged capture record");
+        return false;
+    }
+
+    record.Type = (CaptureType)typeByte;
+    record.Data = Block.data() + BlockOffset;
+    record.Bytes = (int)recordBytes;
+    BlockOffset += recordBytes;
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// ReplayPeer
+
+ReplayPeer::ReplayPeer()
+{
+    StatePool = std::make_shared<TCPStatePool>(false);
+}
+
+void ReplayPeer::Replay(u64 nowMsec, const CaptureRecord& record)
+{
+    if (record.Type == CaptureType::UDP)
+        OnUDPPlaintext(nowMsec, record.Data, record.Bytes);
+    else
+    {
+        Stream stream;
+        stream.WrapRead(record.Data, record.Bytes);
+        OnTCPData(stream);
+    }
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "SphynxCommon.h"
+#include <condition_variable>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// Capture
+//
+// Records decrypted inbound traffic so that it can be replayed offline: UDP
+// datagrams as OnUDPData() decrypted them, and TCP data as each frame
+// decompressed to.  Records are gathered into blocks and each block is
+// written as one zstd frame, so a capture cut short loses at most a block.
+// Peers only copy records into the open block: A writer thread compresses
+// and writes full blocks, so the receive path never waits on zstd or disk.
+//
+// File, in host byte order:
+//   "SPHXCAP1"
+//   Blocks: [u32 compressed bytes] [u32 raw bytes] [zstd frame]
+//   Records in a block:
+//     [u64 usec since start] [u32 source] [u8 type] [u32 bytes] [data]
+//
+// Each peer recording into the same writer gets its own source number, so
+// one file can hold a whole server.
+
+enum class CaptureType : u8
+{
+    UDP,
+    TCP,
+
+    Count
+};
+
+// Raw bytes gathered before a block is compressed and written
+static const int kCaptureBlockBytes = 256000;
+
+// A block is also written once its first record is this old, so a process
+// that is killed loses little
+static const int kCaptureBlockMsec = 1000; // 1 second
+
+// Full blocks waiting for the writer thread.  Past this, records are dropped
+// rather than growing memory without bound
+static const int kCaptureQueueBlocks = 8;
+
+static const int kCaptureRecordHeaderBytes = 8 + 4 + 1 + 4;
+
+// Largest record data: A decompressed TCP frame or a UDP datagram
+static const int kCaptureRecordMaxBytes = kTCPPackingBufferSizeBytes > kUDPDatagramMax ?
+    kTCPPackingBufferSizeBytes : kUDPDatagramMax;
+
+// A block is written once it reaches kCaptureBlockBytes, so it runs over by
+// at most one record.  Readers reject larger blocks
+static const int kCaptureBlockMaxBytes = kCaptureBlockBytes + kCaptureRecordHeaderBytes + kCaptureRecordMaxBytes;
+
+struct CaptureRecord
+{
+    u64 TimeUsec = 0;
+    u32 Source = 0;
+    CaptureType Type = CaptureType::UDP;
+
+    // Valid until the next CaptureReader::Read()
+    const u8* Data = nullptr;
+    int Bytes = 0;
+};
+
+
+//-----------------------------------------------------------------------------
+// CaptureWriter
+
+class CaptureWriter
+{
+public:
+    CaptureWriter() {}
+    ~CaptureWriter();
+
+    // No copies, please.
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    bool Open(const std::string& path);
+
+    // Write what is buffered and close the file
+    void Close();
+
+    // Returns a new source number for a peer
+    u32 AddSource();
+
+    // Safe to call from any thread.  Copies the record and returns
+    void Write(u32 source, CaptureType type, const u8* data, int bytes);
+
+protected:
+    // Open block and queue of full blocks
+    Lock WriteLock;
+    bool Opened = false;
+    u64 StartUsec = 0;
+    u64 BlockStartUsec = 0;
+    std::atomic<u32> NextSource{ 0 };
+    std::vector<u8> Block;
+    std::vector<std::vector<u8>> FullBlocks;
+    std::vector<std::vector<u8>> FreeBlocks;
+    u64 DroppedRecords = 0;
+
+    // Writer thread.  Only it touches the file while open
+    std::mutex WakeLock;
+    std::condition_variable Condition;
+    std::unique_ptr<std::thread> Thread;
+    std::atomic_bool Terminated{ true };
+    FILE* File = nullptr;
+    std::vector<u8> Compressed;
+
+    void Loop();
+
+    // Must hold WriteLock
+    void sealBlock();
+
+    // Compress and write full blocks.  Returns false if there were none
+    bool writeFullBlocks();
+
+    // Called on the writer thread
+    bool writeBlock(const std::vector<u8>& block);
+};
+
+
+//-----------------------------------------------------------------------------
+// CaptureReader
+
+class CaptureReader
+{
+public:
+    CaptureReader() {}
+    ~CaptureReader();
+
+    // No copies, please.
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    bool Open(const std::string& path);
+    void Close();
+
+    // Returns false at the end of the capture or at a damaged block
+    bool Read(CaptureRecord& record);
+
+protected:
+    FILE* File = nullptr;
+
+    std::vector<u8> Block;
+    std::vector<u8> Compressed;
+    size_t BlockOffset = 0;
+
+    bool readBlock();
+};
+
+
+//-----------------------------------------------------------------------------
+// ReplayPeer
+//
+// Peer without sockets for feeding captured traffic back through the call
+// router.  Handlers are set on Router as for a live peer.  Calls it sends
+// are packed and compressed as usual, then dropped.
+
+class ReplayPeer : public SphynxPeer
+{
+public:
+    ReplayPeer();
+
+    // Route one record as if it had just arrived
+    void Replay(u64 nowMsec, const CaptureRecord& record);
+};
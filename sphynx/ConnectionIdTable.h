@@ -0,0 +1,201 @@
+#pragma once
+
+#include "Tools.h"
+#include "EpochReclaimer.h"
+#include <deque>
+#include <memory>
+
+
+//-----------------------------------------------------------------------------
+// ConnectionIdTable<T>
+//
+// Hands out 32-bit ids that index straight into a table of std::shared_ptr<T>
+// and resolves them without locks, so datagrams that carry an id skip the
+// endpoint hash lookup.
+//
+// An id is a 20-bit slot index plus a 12-bit generation, so ids of removed
+// entries stop resolving when the slot is reused.  Freed slots are reused in
+// FIFO order to make generation wrap-around unlikely.  Id 0 is never issued.
+//
+// Slots live in chunks that are allocated on demand and kept until the table
+// is destroyed, so readers only need reclamation for the entries themselves.
+
+template<typename T>
+class ConnectionIdTable
+{
+public:
+    static const u32 kIndexBits = 20;
+    static const u32 kIndexMask = (1 << kIndexBits) - 1;
+    static const u32 kGenerationMask = (1 << (32 - kIndexBits)) - 1;
+
+    ConnectionIdTable()
+    {
+        for (auto& chunk : Chunks)
+            chunk = nullptr;
+    }
+
+    ~ConnectionIdTable()
+    {
+        Reclaimer.ReclaimAll();
+
+        for (auto& chunkPtr : Chunks)
+        {
+            Chunk* chunk = chunkPtr.load();
+            if (!chunk)
+                continue;
+            for (auto& slot : chunk->Slots)
+                delete slot.load();
+            delete chunk;
+        }
+    }
+
+    // No copies, please.
+    ConnectionIdTable(const ConnectionIdTable&) = delete;
+    ConnectionIdTable& operator=(const ConnectionIdTable&) = delete;
+
+    // Returns the new id, or 0 if the table is full
+    u32 Insert(const std::shared_ptr<T>& value)
+    {
+        Locker locker(WriteLock);
+
+        u32 index;
+        if (!FreeIndices.empty())
+        {
+            index = FreeIndices.front();
+            FreeIndices.pop_front();
+        }
+        else if (NextIndex <= kIndexMask)
+            index = NextIndex++;
+        else
+            return 0;
+
+        Chunk* chunk = Chunks[index >> kChunkBits].load(std::memory_order_relaxed);
+        if (!chunk)
+        {
+            chunk = new Chunk;
+            Chunks[index >> kChunkBits].store(chunk, std::memory_order_release);
+        }
+
+        const u32 slot = index & kChunkMask;
+
+        // Generation 0 is skipped so that id 0 is never issued
+        u32 generation = (chunk->Generations[slot] + 1) & kGenerationMask;
+        if (generation == 0)
+            generation = 1;
+        chunk->Generations[slot] = static_cast<u16>(generation);
+
+        const u32 id = (generation << kIndexBits) | index;
+        chunk->Slots[slot].store(new Entry(id, value), std::memory_order_release);
+        ++Count;
+        return id;
+    }
+
+    // Returns false if the id is stale
+    bool Remove(u32 id)
+    {
+        Entry* removed;
+        {
+            Locker locker(WriteLock);
+
+            const u32 index = id & kIndexMask;
+            Chunk* chunk = Chunks[index >> kChunkBits].load(std::memory_order_relaxed);
+            if (!chunk)
+                return false;
+
+            auto& slot = chunk->Slots[index & kChunkMask];
+            removed = slot.load(std::memory_order_relaxed);
+            if (!removed || removed->Id != id)
+                return false;
+
+            slot.store(nullptr, std::memory_order_release);
+            FreeIndices.push_back(index);
+            --Count;
+        }
+
+        Reclaimer.Retire([removed]() { delete removed; });
+        return true;
+    }
+
+    // Calls f(T*) with the value for the id and returns true, or returns
+    // false if the id is stale.  f() must not hold on to the pointer
+    template<typename F>
+    bool Find(u32 id, F&& f)
+    {
+        const int reader = Reclaimer.TryEnter();
+        if (reader < 0)
+        {
+            // Too many threads for the reader slots: Hold off writers instead
+            Locker locker(WriteLock);
+            return findAndCall(id, f);
+        }
+
+        const bool found = findAndCall(id, f);
+        Reclaimer.Leave(reader);
+        return found;
+    }
+
+    int GetCount() const
+    {
+        return Count;
+    }
+
+protected:
+    static const u32 kChunkBits = 10;
+    static const u32 kChunkSize = 1 << kChunkBits;
+    static const u32 kChunkMask = kChunkSize - 1;
+    static const u32 kChunkCount = 1 << (kIndexBits - kChunkBits);
+
+    struct Entry
+    {
+        Entry(u32 id, const std::shared_ptr<T>& value)
+            : Id(id)
+            , Value(value)
+        {
+        }
+
+        const u32 Id;
+        const std::shared_ptr<T> Value;
+    };
+
+    struct Chunk
+    {
+        Chunk()
+        {
+            for (u32 i = 0; i < kChunkSize; ++i)
+            {
+                Slots[i].store(nullptr, std::memory_order_relaxed);
+                Generations[i] = 0;
+            }
+        }
+
+        std::atomic<Entry*> Slots[kChunkSize];
+
+        // Last generation issued for each slot.  Writer only
+        u16 Generations[kChunkSize];
+    };
+
+    std::atomic<Chunk*> Chunks[kChunkCount];
+    EpochReclaimer Reclaimer;
+
+    Lock WriteLock;
+    std::deque<u32> FreeIndices;
+    u32 NextIndex = 0;
+    std::atomic_int Count{ 0 };
+
+    template<typename F>
+    bool findAndCall(u32 id, F& f)
+    {
+        const u32 index = id & kIndexMask;
+
+        Chunk* chunk = Chunks[index >> kChunkBits].load(std::memory_order_acquire);
+        if (!chunk)
+            return false;
+
+        Entry* entry = chunk->Slots[index & kChunkMask].load(std::memory_order_acquire);
+        if (!entry || entry->Id != id)
+            return false;
+
+        f(entry->Value.get());
+        return true;
+    }
+};
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "SphynxCommon.h"
+#include "EpochReclaimer.h"
+
+uint32_t hash_ip_addr(const asio::ip::udp::endpoint& addr);
+
+
+//-----------------------------------------------------------------------------
+// EndpointKey
+//
+// Compact form of a UDP endpoint: The 128-bit address, with IPv4 addresses
+// stored in IPv4-mapped IPv6 form, plus the port.
+
+struct EndpointKey
+{
+    u64 Address[2] = { 0, 0 };
+    u16 Port = 0;
+
+    EndpointKey() {}
+    explicit EndpointKey(const asio::ip::udp::endpoint& addr);
+
+    bool operator==(const EndpointKey& other) const
+    {
+        return Address[0] == other.Address[0] &&
+               Address[1] == other.Address[1] &&
+               Port == other.Port;
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+// EndpointMap<T>
+//
+// Concurrent map from UDP endpoint to std::shared_ptr<T>, tuned for a hot
+// read path (every received datagram) and rare writes (handshakes and
+// disconnects).
+//
+// The table is open-addressed with linear probing over atomic pointers to
+// immutable entries.  Readers run inside an EpochReclaimer section, do not
+// take locks, and do not touch the shared_ptr reference count.  Writers are
+// serialized by a lock, replace removed entries with a tombstone, and build
+// a new table when the load factor gets too high.  Removed entries and old
+// tables are freed once no reader can still see them.
+
+template<typename T>
+class EndpointMap
+{
+public:
+    EndpointMap()
+    {
+        CurrentTable = new Table(kMinCapacity);
+    }
+
+    ~EndpointMap()
+    {
+        Clear();
+        Reclaimer.ReclaimAll();
+        delete CurrentTable.load();
+    }
+
+    // No copies, please.
+    EndpointMap(const EndpointMap&) = delete;
+    EndpointMap& operator=(const EndpointMap&) = delete;
+
+    // Calls f(T*) with the value for the address and returns true, or
+    // returns false if there is none.  The value stays alive until f()
+    // returns, so f() must not hold on to the pointer afterwards
+    template<typename F>
+    bool Find(const asio::ip::udp::endpoint& addr, F&& f)
+    {
+        const EndpointKey key(addr);
+        const u32 hash = hash_ip_addr(addr);
+
+        const int reader = Reclaimer.TryEnter();
+        if (reader < 0)
+        {
+            // Too many threads for the reader slots: Hold off writers instead
+            Locker locker(WriteLock);
+            return findAndCall(key, hash, f);
+        }
+
+        const bool found = findAndCall(key, hash, f);
+        Reclaimer.Leave(reader);
+        return found;
+    }
+
+    // Returns false if the address is already in the map
+    bool Insert(const asio::ip::udp::endpoint& addr, const std::shared_ptr<T>& value)
+    {
+        const EndpointKey key(addr);
+        const u32 hash = hash_ip_addr(addr);
+
+        Table* old = nullptr;
+        bool inserted;
+        {
+            Locker locker(WriteLock);
+
+            Table* table = CurrentTable.load(std::memory_order_relaxed);
+
+            // Keep live entries plus tombstones under half the capacity
+            if ((table->Used + 1) * 2 > table->Capacity)
+            {
+                old = table;
+                table = rebuild(old);
+            }
+
+            inserted = insert(table, key, hash, value);
+        }
+
+        if (old)
+            Reclaimer.Retire([old]() { delete old; });
+        return inserted;
+    }
+
+    // Returns false if the address was not in the map
+    bool Remove(const asio::ip::udp::endpoint& addr)
+    {
+        const EndpointKey key(addr);
+        const u32 hash = hash_ip_addr(addr);
+
+        Entry* removed = nullptr;
+        {
+            Locker locker(WriteLock);
+
+            Table* table = CurrentTable.load(std::memory_order_relaxed);
+            for (u32 i = hash & table->Mask;; i = (i + 1) & table->Mask)
+            {
+                Entry* entry = table->Slots[i].load(std::memory_order_relaxed);
+                if (!entry)
+                    return false;
+                if (entry != Tombstone() && entry->Hash == hash && entry->Key == key)
+                {
+                    // Tombstone keeps probe chains through this slot intact
+                    table->Slots[i].store(Tombstone(), std::memory_order_release);
+                    removed = entry;
+                    --Count;
+                    break;
+                }
+            }
+        }
+
+        Reclaimer.Retire([removed]() { delete removed; });
+        return true;
+    }
+
+    // Remove everything
+    void Clear()
+    {
+        Table* old;
+        {
+            Locker locker(WriteLock);
+            old = CurrentTable.exchange(new Table(kMinCapacity), std::memory_order_acq_rel);
+            Count = 0;
+        }
+
+        Reclaimer.Retire([old]()
+        {
+            for (u32 i = 0; i < old->Capacity; ++i)
+            {
+                Entry* entry = old->Slots[i].load(std::memory_order_relaxed);
+                if (entry && entry != Tombstone())
+                    delete entry;
+            }
+            delete old;
+        });
+    }
+
+    int GetCount() const
+    {
+        return Count;
+    }
+
+protected:
+    static const u32 kMinCapacity = 64;
+
+    struct Entry
+    {
+        Entry(const EndpointKey& key, u32 hash, const std::shared_ptr<T>& value)
+            : Hash(hash)
+            , Key(key)
+            , Value(value)
+        {
+        }
+
+        const u32 Hash;
+        const EndpointKey Key;
+        const std::shared_ptr<T> Value;
+    };
+
+    struct Table
+    {
+        explicit Table(u32 capacity)
+            : Capacity(capacity)
+            , Mask(capacity - 1)
+            , Slots(new std::atomic<Entry*>[capacity])
+        {
+            for (u32 i = 0; i < capacity; ++i)
+                Slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        const u32 Capacity;
+        const u32 Mask;
+        std::unique_ptr<std::atomic<Entry*>[]> Slots;
+
+        // Slots that are not empty: Live entries plus tombstones.  Writer only
+        u32 Used = 0;
+    };
+
+    Lock WriteLock;
+    std::atomic<Table*> CurrentTable;
+    std::atomic_int Count{ 0 };
+    EpochReclaimer Reclaimer;
+
+    static Entry* Tombstone()
+    {
+        static char marker;
+        return reinterpret_cast<Entry*>(&marker);
+    }
+
+    template<typename F>
+    bool findAndCall(const EndpointKey& key, u32 hash, F& f)
+    {
+        Table* table = CurrentTable.load(std::memory_order_acquire);
+
+        for (u32 i = hash & table->Mask;; i = (i + 1) & table->Mask)
+        {
+            Entry* entry = table->Slots[i].load(std::memory_order_acquire);
+            if (!entry)
+                return false;
+            if (entry != Tombstone() && entry->Hash == hash && entry->Key == key)
+            {
+                f(entry->Value.get());
+                return true;
+            }
+        }
+    }
+
+    // Writer: Returns false if the key is already present
+    bool insert(Table* table, const EndpointKey& key, u32 hash, const std::shared_ptr<T>& value)
+    {
+        int freeSlot = -1;
+        for (u32 i = hash & table->Mask;; i = (i + 1) & table->Mask)
+        {
+            Entry* entry = table->Slots[i].load(std::memory_order_relaxed);
+            if (!entry)
+            {
+                if (freeSlot < 0)
+                {
+                    freeSlot = static_cast<int>(i);
+                    ++table->Used;
+                }
+                break;
+            }
+            if (entry == Tombstone())
+            {
+                if (freeSlot < 0)
+                    freeSlot = static_cast<int>(i);
+                continue;
+            }
+            if (entry->Hash == hash && entry->Key == key)
+                return false;
+        }
+
+        Entry* entry = new Entry(key, hash, value);
+        table->Slots[freeSlot].store(entry, std::memory_order_release);
+        ++Count;
+        return true;
+    }
+
+    // Writer: Copy live entries into a new table sized for them and publish
+    // it.  Entries are shared, not copied.  Caller retires the old table
+    Table* rebuild(Table* old)
+    {
+        const u32 live = static_cast<u32>(Count.load(std::memory_order_relaxed));
+
+        u32 capacity = kMinCapacity;
+        while (capacity < (live + 1) * 4)
+            capacity *= 2;
+
+        Table* table = new Table(capacity);
+        for (u32 i = 0; i < old->Capacity; ++i)
+        {
+            Entry* entry = old->Slots[i].load(std::memory_order_relaxed);
+            if (!entry || entry == Tombstone())
+                continue;
+
+            u32 j = entry->Hash & table->Mask;
+            while (table->Slots[j].load(std::memory_order_relaxed))
+                j = (j + 1) & table->Mask;
+            table->Slots[j].store(entry, std::memory_order_relaxed);
+            ++table->Used;
+        }
+
+        // Readers still on the old table see the same entries
+        CurrentTable.store(table, std::memory_order_release);
+        return table;
+    }
+};
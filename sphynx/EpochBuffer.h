@@ -0,0 +1,181 @@
+#pragma once
+
+#include "Tools.h"
+#include <atomic>
+#include <type_traits> // std::is_trivially_copyable
+
+
+//-----------------------------------------------------------------------------
+// StateEpoch
+//
+// Counter that is advanced once per tick.  Readers of an EpochBuffer pass in
+// the epoch they started in and see the state as of the start of that epoch,
+// so every reader during a tick sees the same consistent set of values no
+// matter how often writers publish in the meantime.
+
+class StateEpoch
+{
+public:
+    StateEpoch()
+    {
+        Epoch = 1;
+    }
+
+    u64 Get() const
+    {
+        return Epoch.load(std::memory_order_acquire);
+    }
+
+    // Returns the new epoch
+    u64 Advance()
+    {
+        return Epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+    }
+
+private:
+    std::atomic<u64> Epoch;
+};
+
+
+//-----------------------------------------------------------------------------
+// EpochBuffer<T>
+//
+// Triple-buffered state for one entity with a single logical writer and any
+// number of readers on other threads.
+//
+// Writers publish into a back slot stamped with the current epoch, and
+// readers take the newest slot published before their epoch.  A slot being
+// written is never one that readers of the current epoch need, so reads do
+// not take locks and only retry if a reader is still running after its
+// epoch has been overtaken by two more publishes.
+//
+// T is copied with plain loads/stores and checked with a sequence counter
+// afterwards, so it must be trivially copyable.
+
+template<typename T>
+class EpochBuffer
+{
+public:
+#ifndef ANDROID
+    static_assert(std::is_trivially_copyable<T>::value, "EpochBuffer can only hold trivially copyable types.");
+#endif
+
+    EpochBuffer()
+    {
+        Latest = -1;
+        for (auto& slot : Slots)
+        {
+            slot.Sequence = 0;
+            slot.Epoch = 0;
+        }
+    }
+
+    // No copies, please.
+    EpochBuffer(const EpochBuffer&) = delete;
+    EpochBuffer& operator=(const EpochBuffer&) = delete;
+
+    // Publish a new value during the given epoch
+    void Publish(const T& value, u64 epoch)
+    {
+        // Writers are serialized, but in practice there is only one per entity
+        Locker locker(WriteLock);
+
+        int target = Latest.load(std::memory_order_relaxed);
+
+        if (target >= 0)
+        {
+            const u64 latestEpoch = Slots[target].Epoch.load(std::memory_order_relaxed);
+
+            // Epochs never go backwards for a single entity
+            if (epoch < latestEpoch)
+                epoch = latestEpoch;
+
+            // If the latest slot was published before this epoch then readers
+            // of this epoch are using it: Write to the older of the other two.
+            // Otherwise overwrite the latest slot, which readers ignore.
+            if (latestEpoch < epoch)
+            {
+                const int a = (target + 1) % kSlotCount;
+                const int b = (target + 2) % kSlotCount;
+                target = Slots[a].Epoch.load(std::memory_order_relaxed) <=
+                         Slots[b].Epoch.load(std::memory_order_relaxed) ? a : b;
+            }
+        }
+        else
+            target = 0;
+
+        Slot& slot = Slots[target];
+        const u32 sequence = slot.Sequence.load(std::memory_order_relaxed);
+
+        slot.Sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.Value = value;
+        slot.Epoch.store(epoch, std::memory_order_relaxed);
+
+        slot.Sequence.store(sequence + 2, std::memory_order_release);
+        Latest.store(target, std::memory_order_release);
+    }
+
+    // Read the newest value published before the given epoch.
+    // Returns false if nothing was published before then
+    bool Read(T& value, u64 epoch) const
+    {
+        for (;;)
+        {
+            const int latest = Latest.load(std::memory_order_acquire);
+            if (latest < 0)
+                return false;
+
+            // Pick the newest slot stamped before the epoch
+            int best = -1;
+            u64 bestEpoch = 0;
+            for (int i = 0; i < kSlotCount; ++i)
+            {
+                const u64 slotEpoch = Slots[i].Epoch.load(std::memory_order_relaxed);
+                if (slotEpoch != 0 && slotEpoch < epoch && (best < 0 || slotEpoch > bestEpoch))
+                {
+                    best = i;
+                    bestEpoch = slotEpoch;
+                }
+            }
+            if (best < 0)
+                return false;
+
+            const Slot& slot = Slots[best];
+
+            const u32 sequence = slot.Sequence.load(std::memory_order_acquire);
+            if (sequence & 1)
+                continue; // Being written
+
+            value = slot.Value;
+            const u64 readEpoch = slot.Epoch.load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.Sequence.load(std::memory_order_relaxed) == sequence && readEpoch == bestEpoch)
+                return true;
+
+            // The slot was reused while we were reading it: Try again
+        }
+    }
+
+    // Read the most recently published value, ignoring epochs
+    bool ReadLatest(T& value) const
+    {
+        return Read(value, ~(u64)0);
+    }
+
+private:
+    static const int kSlotCount = 3;
+
+    struct Slot
+    {
+        std::atomic<u32> Sequence;  // Odd while being written
+        std::atomic<u64> Epoch;     // Epoch it was published in, or 0 if empty
+        T Value;
+    };
+
+    Slot Slots[kSlotCount];
+    std::atomic<int> Latest; // Most recently published slot, or -1 if none
+    Lock WriteLock;
+};
@@ -0,0 +1,102 @@
+#include "EpochReclaimer.h"
+
+
+//-----------------------------------------------------------------------------
+// EpochReclaimer
+
+EpochReclaimer::EpochReclaimer()
+{
+    GlobalEpoch = 1;
+    for (auto& reader : Readers)
+        reader.Epoch = 0;
+}
+
+EpochReclaimer::~EpochReclaimer()
+{
+    ReclaimAll();
+}
+
+int EpochReclaimer::GetThreadReaderIndex()
+{
+    static std::atomic<int> NextReaderIndex(0);
+    static thread_local int ReaderIndex = -2;
+
+    if (ReaderIndex == -2)
+    {
+        const int index = NextReaderIndex++;
+        ReaderIndex = index < kMaxReaders ? index : -1;
+    }
+
+    return ReaderIndex;
+}
+
+void EpochReclaimer::Retire(std::function<void()> free)
+{
+    // Readers that enter after this see the new epoch and cannot reach the
+    // object, so only readers at this epoch or older can hold it
+    const u64 epoch = GlobalEpoch.fetch_add(1, std::memory_order_seq_cst);
+
+    {
+        Locker locker(RetiredLock);
+        RetiredObject retired;
+        retired.Epoch = epoch;
+        retired.Free = std::move(free);
+        Retired.push_back(std::move(retired));
+    }
+
+    Reclaim();
+}
+
+u64 EpochReclaimer::getOldestReaderEpoch() const
+{
+    // Pairs with the fence in TryEnter()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    u64 oldest = ~(u64)0;
+    for (const auto& reader : Readers)
+    {
+        const u64 epoch = reader.Epoch.load(std::memory_order_acquire);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
+}
+
+void EpochReclaimer::Reclaim()
+{
+    std::vector<RetiredObject> freeable;
+    {
+        Locker locker(RetiredLock);
+        if (Retired.empty())
+            return;
+
+        const u64 oldest = getOldestReaderEpoch();
+
+        // Keep objects that a reader still active might hold
+        size_t kept = 0;
+        for (auto& retired : Retired)
+        {
+            if (retired.Epoch < oldest)
+                freeable.push_back(std::move(retired));
+            else
+                Retired[kept++] = std::move(retired);
+        }
+        Retired.resize(kept);
+    }
+
+    // Free outside the lock, since destructors may do anything
+    for (auto& retired : freeable)
+        retired.Free();
+}
+
+void EpochReclaimer::ReclaimAll()
+{
+    std::vector<RetiredObject> retired;
+    {
+        Locker locker(RetiredLock);
+        retired.swap(Retired);
+    }
+
+    for (auto& object : retired)
+        object.Free();
+}
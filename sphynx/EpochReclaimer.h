@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Tools.h"
+#include <atomic>
+#include <functional>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// EpochReclaimer
+//
+// Epoch-based reclamation for lock-free readers.
+//
+// Readers bracket each access with TryEnter()/Leave(), which only publishes
+// the current global epoch into a per-thread slot.  Writers unlink an object
+// so that new readers cannot reach it, then Retire() it.  The object is freed
+// once every reader that was active when it was retired has left.
+//
+// Retired objects are freed from Retire() and Reclaim(), so memory is only
+// given back when writers run.  Readers never wait.
+
+class EpochReclaimer
+{
+public:
+    // Reader slots per reclaimer.  Threads past this use the fallback path
+    static const int kMaxReaders = 64;
+
+    EpochReclaimer();
+    ~EpochReclaimer();
+
+    // No copies, please.
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    // Start a read-side section on this thread.  Returns the reader slot to
+    // pass to Leave(), or -1 if this thread has no slot, in which case the
+    // caller must exclude writers some other way.  Sections do not nest
+    int TryEnter()
+    {
+        const int reader = GetThreadReaderIndex();
+        if (reader < 0)
+            return -1;
+
+        Readers[reader].Epoch.store(GlobalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        // Publish the slot before reading any shared pointers
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return reader;
+    }
+
+    void Leave(int reader)
+    {
+        Readers[reader].Epoch.store(0, std::memory_order_release);
+    }
+
+    // Writer: Free the object with the given function once no reader can
+    // still be using it.  The object must already be unreachable
+    void Retire(std::function<void()> free);
+
+    // Writer: Free whatever is safe to free now
+    void Reclaim();
+
+    // Free everything right away.  Only safe when there are no readers
+    void ReclaimAll();
+
+    // Small index for the calling thread, shared by all reclaimers, or -1 if
+    // more than kMaxReaders threads have asked
+    static int GetThreadReaderIndex();
+
+protected:
+    struct ReaderSlot
+    {
+        // Epoch the reader entered in, or 0 if not reading
+        std::atomic<u64> Epoch;
+
+        // Keep readers off each other's cache lines
+        u8 Padding[64 - sizeof(std::atomic<u64>)];
+    };
+
+    struct RetiredObject
+    {
+        u64 Epoch;
+        std::function<void()> Free;
+    };
+
+    std::atomic<u64> GlobalEpoch;
+    ReaderSlot Readers[kMaxReaders];
+
+    // Guards Retired
+    Lock RetiredLock;
+    std::vector<RetiredObject> Retired;
+
+    u64 getOldestReaderEpoch() const;
+};
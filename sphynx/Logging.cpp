@@ -1,5 +1,7 @@
 #include "Logging.h"
 
+#include <cstdio> // snprintf
+
 #ifndef ANDROID
 #include <iostream>
 #endif
@@ -7,7 +9,7 @@
 namespace logging {
 
 
-std::atomic<Level> MinLevel = Level::Debug;
+std::atomic<Level> MinLevel(Level::Info);
 
 
 const char* LevelToString(Level level)
@@ -43,6 +45,214 @@ char LevelToChar(Level level)
 }
 
 
+//-----------------------------------------------------------------------------
+// RateLimit
+
+bool RateLimit::Allow(u64& suppressed)
+{
+    const u64 nowMsec = GetTimeMsec();
+
+    // Start a new one-second window.  Only the thread that wins the exchange
+    // resets the count
+    u64 startMsec = WindowStartMsec.load(std::memory_order_relaxed);
+    if ((s64)(nowMsec - startMsec) >= 1000 &&
+        WindowStartMsec.compare_exchange_strong(startMsec, nowMsec, std::memory_order_relaxed))
+    {
+        WindowCount.store(0, std::memory_order_relaxed);
+    }
+
+    if (WindowCount.fetch_add(1, std::memory_order_relaxed) >= PerSecond)
+    {
+        Suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    suppressed = Suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// LogRing
+//
+// Single-producer single-consumer ring of records.  The thread that owns it
+// pushes, and the OutputWorker drains.  Records are a 32-bit size and the
+// record bytes, padded to 8 bytes, and never wrap around the end: The rest
+// of the ring is skipped with a marker instead.
+
+class LogRing
+{
+public:
+    static const size_t kBytes = 65536; // Power of two
+    static const u32 kSkipMarker = ~(u32)0;
+
+    LogRing()
+        : Buffer(new u8[kBytes])
+    {
+    }
+
+    // Owner only.  Returns false if the record was dropped.  Sets halfFull
+    // when this record filled the ring past half
+    bool Push(const u8* record, size_t bytes, bool& halfFull)
+    {
+        const size_t recordBytes = (4 + bytes + 7) & ~(size_t)7;
+
+        const u64 head = Head.load(std::memory_order_relaxed);
+        const u64 tail = Tail.load(std::memory_order_acquire);
+
+        const size_t offset = (size_t)head & (kBytes - 1);
+        const size_t toEnd = kBytes - offset;
+        const size_t skipBytes = toEnd < recordBytes ? toEnd : 0;
+
+        if (skipBytes + recordBytes > kBytes - (size_t)(head - tail))
+        {
+            Overrun.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        u8* data = Buffer.get() + offset;
+        if (skipBytes > 0)
+        {
+            *(u32*)data = kSkipMarker;
+            data = Buffer.get();
+        }
+
+        *(u32*)data = (u32)bytes;
+        memcpy(data + 4, record, bytes);
+
+        const u64 newHead = head + skipBytes + recordBytes;
+        Head.store(newHead, std::memory_order_release);
+
+        // Only report crossing the mark, so a busy thread wakes the worker
+        // once per pass instead of on every call
+        halfFull = (head - tail) <= kBytes / 2 && (newHead - tail) > kBytes / 2;
+        return true;
+    }
+
+    // Worker only: Call f(record, bytes) for each queued record
+    template<typename F>
+    bool Drain(F&& f)
+    {
+        u64 tail = Tail.load(std::memory_order_relaxed);
+        const u64 head = Head.load(std::memory_order_acquire);
+        if (tail == head)
+            return false;
+
+        while (tail != head)
+        {
+            const size_t offset = (size_t)tail & (kBytes - 1);
+            const u8* data = Buffer.get() + offset;
+            const u32 bytes = *(const u32*)data;
+
+            if (bytes == kSkipMarker)
+            {
+                tail += kBytes - offset;
+                continue;
+            }
+
+            f(data + 4, (size_t)bytes);
+            tail += (4 + bytes + 7) & ~(size_t)7;
+        }
+
+        Tail.store(tail, std::memory_order_release);
+        return true;
+    }
+
+    // Records dropped because the ring was full
+    std::atomic<u64> Overrun{ 0 };
+
+    // Set when the owning thread exits
+    std::atomic_bool Abandoned{ false };
+
+private:
+    std::unique_ptr<u8[]> Buffer;
+    std::atomic<u64> Head{ 0 };
+    std::atomic<u64> Tail{ 0 };
+};
+
+// Registers the calling thread's ring on first use and abandons it on exit
+struct ThreadLogRing
+{
+    std::shared_ptr<LogRing> Ring;
+
+    // Staging area for the record being written
+    u8 Record[LogRecordWriter::kMaxBytes];
+
+    LogRing* Get()
+    {
+        if (!Ring)
+        {
+            Ring = std::make_shared<LogRing>();
+            OutputWorker::GetInstance().AddRing(Ring);
+        }
+        return Ring.get();
+    }
+
+    ~ThreadLogRing()
+    {
+        if (Ring)
+            Ring->Abandoned = true;
+    }
+};
+
+static thread_local ThreadLogRing ThreadRing;
+
+
+//-----------------------------------------------------------------------------
+// LogRecordWriter
+
+LogRecordWriter::LogRecordWriter(const char* channel, Level level, const LogFormat* format)
+{
+    Buffer = ThreadRing.Record;
+
+    LogRecordHeader header;
+    header.Format = format;
+    header.ChannelName = channel;
+    header.LogLevel = level;
+    memcpy(Buffer, &header, sizeof(header));
+    Used = sizeof(header);
+}
+
+void LogRecordWriter::WriteBytes(const void* data, size_t bytes)
+{
+    // Fixed-size arguments always fit: Strings leave room for them
+    if (Used + bytes > kMaxBytes)
+    {
+        DEBUG_BREAK; return;
+    }
+    memcpy(Buffer + Used, data, bytes);
+    Used += bytes;
+}
+
+void LogRecordWriter::WriteString(const char* str, size_t length)
+{
+    // Leave room for the length and for fixed-size arguments after it
+    static const size_t kReserveBytes = 4 + 256;
+
+    const size_t room = Used + kReserveBytes < kMaxBytes ? kMaxBytes - Used - kReserveBytes : 0;
+    if (length > room)
+        length = room;
+
+    const u32 length32 = (u32)length;
+    memcpy(Buffer + Used, &length32, 4);
+    memcpy(Buffer + Used + 4, str, length);
+    Used += 4 + length;
+}
+
+void LogRecordWriter::Submit()
+{
+    bool halfFull = false;
+    ThreadRing.Get()->Push(Buffer, Used, halfFull);
+
+    // Otherwise the worker picks it up on its next pass
+    if (halfFull)
+        OutputWorker::GetInstance().Wake();
+}
+
+
+//-----------------------------------------------------------------------------
+// OutputWorker
+
 OutputWorker& OutputWorker::GetInstance()
 {
     static OutputWorker worker;
@@ -63,13 +273,16 @@ OutputWorker::OutputWorker()
     std::atexit(AtExitWrapper);
 }
 
+OutputWorker::~OutputWorker()
+{
+    // The static instance is destroyed before the atexit() handler runs
+    Stop();
+}
+
 void OutputWorker::Start()
 {
     Stop();
 
-    QueuePublic.clear();
-    QueuePrivate.clear();
-    Overrun = 0;
     Terminated = false;
     Thread = std::make_unique<std::thread>(&OutputWorker::Loop, this);
 }
@@ -79,7 +292,7 @@ void OutputWorker::Stop()
     if (Thread)
     {
         Terminated = true;
-        Condition.notify_all();
+        Wake();
 
         try
         {
@@ -92,18 +305,14 @@ void OutputWorker::Stop()
     Thread = nullptr;
 }
 
-void OutputWorker::Write(LogStringBuffer& buffer)
+void OutputWorker::AddRing(const std::shared_ptr<LogRing>& ring)
 {
-    std::string str = buffer.LogStream.str();
-
-    {
-        std::lock_guard<std::mutex> locker(QueueLock);
-        if (static_cast<int>(QueuePublic.size()) >= WorkQueueLimit)
-            Overrun++;
-        else
-            QueuePublic.emplace_back(buffer.LogLevel, buffer.ChannelName, str);
-    }
+    NewRings.Push(ring);
+}
 
+void OutputWorker::Wake()
+{
+    std::lock_guard<std::mutex> locker(WakeLock);
     Condition.notify_all();
 }
 
@@ -111,46 +320,246 @@ void OutputWorker::Loop()
 {
     while (!Terminated)
     {
-        int overrun;
+        if (!Drain())
         {
-            std::unique_lock<std::mutex> locker(QueueLock);
-            Condition.wait(locker);
-
-            std::swap(QueuePublic, QueuePrivate);
-            overrun = Overrun;
+            std::unique_lock<std::mutex> locker(WakeLock);
+            if (!Terminated)
+                Condition.wait_for(locker, std::chrono::milliseconds((int)kFlushIntervalMsec));
         }
+    }
+
+    // Write out whatever was logged before stopping
+    Drain();
+}
 
-        for (auto& log : QueuePrivate)
+bool OutputWorker::Drain()
+{
+    NewRings.Drain([this](std::shared_ptr<LogRing>& ring)
+    {
+        Rings.push_back(ring);
+    });
+
+    bool any = false;
+    u64 overrun = 0;
+
+    for (size_t i = 0; i < Rings.size();)
+    {
+        LogRing* ring = Rings[i].get();
+
+        // Check before draining, so records pushed just before exit are kept
+        const bool abandoned = ring->Abandoned;
+
+        any |= ring->Drain([this](const u8* record, size_t bytes)
         {
-            Log(log);
+            Format(record, bytes);
+        });
+        overrun += ring->Overrun.exchange(0, std::memory_order_relaxed);
+
+        if (abandoned)
+        {
+            Rings[i] = Rings.back();
+            Rings.pop_back();
         }
+        else
+            ++i;
+    }
 
-        QueuePrivate.clear();
+    if (overrun > 0)
+    {
+        Batch += "{W-Logging} Dropped ";
+        Batch += std::to_string(overrun);
+        Batch += " log messages: Logging faster than they can be written\n";
     }
+
+    Flush();
+
+    return any;
 }
 
-void OutputWorker::Log(QueuedMessage& message)
+void OutputWorker::Format(const u8* record, size_t bytes)
 {
-    std::stringstream ss;
-    ss << '{' << LevelToChar(message.LogLevel) << '-' << message.ChannelName << "} " << message.Message;
+    LogRecordHeader header;
+    if (bytes < sizeof(header))
+    {
+        DEBUG_BREAK; return;
+    }
+    memcpy(&header, record, sizeof(header));
+    const u8* data = record + sizeof(header);
+    const u8* end = record + bytes;
 
 #ifdef ANDROID
-    std::string fmtstr = ss.str();
-    __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "%s", fmtstr.c_str());
+    const size_t start = Batch.size();
 #else
-    ss << std::endl;
-    std::string fmtstr = ss.str();
-    std::cout << fmtstr;
+    Batch += '{';
+    Batch += LevelToChar(header.LogLevel);
+    Batch += '-';
+    Batch += header.ChannelName;
+    Batch += "} ";
+#endif
+
+    char text[32];
+
+    for (int i = 0; i < header.Format->Count; ++i)
+    {
+        switch (header.Format->Types[i])
+        {
+        case LogArgType::Bool:
+            Batch += *data ? "true" : "false";
+            data += 1;
+            break;
+        case LogArgType::Char:
+            Batch += (char)*data;
+            data += 1;
+            break;
+        case LogArgType::Signed:
+        {
+            s64 x;
+            memcpy(&x, data, 8);
+            Batch += std::to_string(x);
+            data += 8;
+            break;
+        }
+        case LogArgType::Unsigned:
+        {
+            u64 x;
+            memcpy(&x, data, 8);
+            Batch += std::to_string(x);
+            data += 8;
+            break;
+        }
+        case LogArgType::Float:
+        {
+            double x;
+            memcpy(&x, data, 8);
+            snprintf(text, sizeof(text), "%g", x);
+            Batch += text;
+            data += 8;
+            break;
+        }
+        case LogArgType::Pointer:
+        {
+            u64 x;
+            memcpy(&x, data, 8);
+            snprintf(text, sizeof(text), "0x%llx", (unsigned long long)x);
+            Batch += text;
+            data += 8;
+            break;
+        }
+        case LogArgType::String:
+        {
+            u32 length;
+            memcpy(&length, data, 4);
+            Batch.append((const char*)data + 4, length);
+            data += 4 + length;
+            break;
+        }
+        }
+
+        if (data > end)
+        {
+            DEBUG_BREAK; break;
+        }
+    }
+
+#ifdef ANDROID
+    __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "{%c-%s} %s",
+        LevelToChar(header.LogLevel), header.ChannelName, Batch.c_str() + start);
+    Batch.resize(start);
+#else
+    Batch += '\n';
+#endif
+}
+
+void OutputWorker::Flush()
+{
+    if (Batch.empty())
+        return;
+
+#ifndef ANDROID
+    std::cout.write(Batch.data(), Batch.size());
+    std::cout.flush();
     #ifdef _WIN32
-        ::OutputDebugStringA(fmtstr.c_str());
+        ::OutputDebugStringA(Batch.c_str());
     #endif
 #endif
+
+    Batch.clear();
 }
 
 
+//-----------------------------------------------------------------------------
+// Channel
+
+// Channels are statics, so the registry is created on first use
+struct ChannelRegistry
+{
+    Lock RegistryLock;
+    Channel* Head = nullptr;
+
+    // Levels set by name, applied to channels created later
+    std::vector<std::pair<std::string, Level>> Levels;
+};
+
+static ChannelRegistry& GetChannelRegistry()
+{
+    static ChannelRegistry registry;
+    return registry;
+}
+
+void SetChannelMinLevel(const char* name, Level level)
+{
+    ChannelRegistry& registry = GetChannelRegistry();
+    Locker locker(registry.RegistryLock);
+
+    bool found = false;
+    for (auto& entry : registry.Levels)
+    {
+        if (entry.first == name)
+        {
+            entry.second = level;
+            found = true;
+        }
+    }
+    if (!found)
+        registry.Levels.emplace_back(name, level);
+
+    for (Channel* channel = registry.Head; channel; channel = channel->NextChannel)
+    {
+        if (strcmp(channel->ChannelName, name) == 0)
+            channel->SetChannelMinLevel(level);
+    }
+}
+
 Channel::Channel(const char* name)
 {
     ChannelName = name;
+
+    ChannelRegistry& registry = GetChannelRegistry();
+    Locker locker(registry.RegistryLock);
+
+    for (auto& entry : registry.Levels)
+    {
+        if (entry.first == name)
+            ChannelMinLevel = entry.second;
+    }
+
+    NextChannel = registry.Head;
+    registry.Head = this;
+}
+
+Channel::~Channel()
+{
+    ChannelRegistry& registry = GetChannelRegistry();
+    Locker locker(registry.RegistryLock);
+
+    for (Channel** link = &registry.Head; *link; link = &(*link)->NextChannel)
+    {
+        if (*link == this)
+        {
+            *link = NextChannel;
+            break;
+        }
+    }
 }
 
 std::string Channel::GetPrefix() const
@@ -5,7 +5,12 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
-#include <list>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <type_traits>
+#include "MPSCQueue.h"
 
 namespace logging {
 
@@ -24,6 +29,24 @@ enum class Level
 const char* LevelToString(Level level);
 char LevelToChar(Level level);
 
+// Log calls below this level are compiled out.  By default Trace is stripped
+// from release builds.  Channel methods still evaluate their arguments, so
+// hot paths use the SPHYNX_TRACE() and SPHYNX_DEBUG() macros instead
+#ifndef SPHYNX_LOG_MIN_LEVEL
+    #ifdef NDEBUG
+        #define SPHYNX_LOG_MIN_LEVEL 1 /* Debug */
+    #else
+        #define SPHYNX_LOG_MIN_LEVEL 0 /* Trace */
+    #endif
+#endif
+
+FORCE_INLINE constexpr bool IsCompiledIn(Level level)
+{
+    return (int)level >= SPHYNX_LOG_MIN_LEVEL;
+}
+
+// Formats arguments that have no binary encoding, with operator<< or an
+// override of LogStringize()
 struct LogStringBuffer
 {
     const char* ChannelName;
@@ -44,15 +67,189 @@ FORCE_INLINE void LogStringize(LogStringBuffer& buffer, const T& first)
     buffer.LogStream << first;
 }
 
-// Overrides for various types we want to handle specially:
+
+//-----------------------------------------------------------------------------
+// Binary log records
+//
+// Log calls do not format anything.  They copy their arguments into a record
+// in a ring owned by the calling thread, and the OutputWorker formats the
+// records later.  Each record starts with a LogRecordHeader whose Format lists
+// the argument types, and the arguments follow as raw bytes.
+
+enum class LogArgType : u8
+{
+    Bool,       // u8
+    Char,       // char
+    Signed,     // s64
+    Unsigned,   // u64
+    Float,      // double
+    Pointer,    // u64
+    String,     // u32 length, then characters
+};
+
+// Format ID: The argument types of one kind of log call
+struct LogFormat
+{
+    const LogArgType* Types;
+    int Count;
+};
+
+template<LogArgType... Types>
+struct LogFormatOf
+{
+    static const LogArgType TypeList[sizeof...(Types) + 1]; // Never empty
+    static const LogFormat Format;
+};
+
+template<LogArgType... Types>
+const LogArgType LogFormatOf<Types...>::TypeList[sizeof...(Types) + 1] = { Types..., LogArgType::Bool };
+template<LogArgType... Types>
+const LogFormat LogFormatOf<Types...>::Format = { TypeList, (int)sizeof...(Types) };
+
+struct LogRecordHeader
+{
+    const LogFormat* Format;
+    const char* ChannelName;
+    Level LogLevel;
+};
+
+// Builds a record in a per-thread staging buffer.  Arguments that do not fit
+// in kMaxBytes are cut short
+class LogRecordWriter
+{
+public:
+    static const size_t kMaxBytes = 4096;
+
+    LogRecordWriter(const char* channel, Level level, const LogFormat* format);
+
+    void WriteBytes(const void* data, size_t bytes);
+    void WriteString(const char* str, size_t length);
+
+    // Hand the record to the calling thread's ring
+    void Submit();
+
+private:
+    u8* Buffer;
+    size_t Used;
+};
+
+template<typename T, typename Enable = void>
+struct LogArg
+{
+    static const LogArgType Type = LogArgType::String;
+
+    static void Write(LogRecordWriter& writer, const T& value)
+    {
+        LogStringBuffer buffer(nullptr, Level::Info);
+        LogStringize(buffer, value);
+        const std::string str = buffer.LogStream.str();
+        writer.WriteString(str.data(), str.size());
+    }
+};
 
 template<>
-FORCE_INLINE void LogStringize(LogStringBuffer& buffer, const bool& first)
+struct LogArg<bool>
 {
-    buffer.LogStream << (first ? "true" : "false");
-}
+    static const LogArgType Type = LogArgType::Bool;
+
+    static void Write(LogRecordWriter& writer, bool value)
+    {
+        const u8 byte = value ? 1 : 0;
+        writer.WriteBytes(&byte, 1);
+    }
+};
+
+template<typename T>
+struct LogArg<T, typename std::enable_if<std::is_same<T, char>::value ||
+    std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value>::type>
+{
+    static const LogArgType Type = LogArgType::Char;
+
+    static void Write(LogRecordWriter& writer, T value)
+    {
+        writer.WriteBytes(&value, 1);
+    }
+};
+
+template<typename T>
+struct LogArg<T, typename std::enable_if<(std::is_integral<T>::value && std::is_signed<T>::value &&
+    (sizeof(T) > 1)) || std::is_enum<T>::value>::type>
+{
+    static const LogArgType Type = LogArgType::Signed;
+
+    static void Write(LogRecordWriter& writer, T value)
+    {
+        const s64 x = (s64)value;
+        writer.WriteBytes(&x, sizeof(x));
+    }
+};
+
+template<typename T>
+struct LogArg<T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value &&
+    (sizeof(T) > 1) && !std::is_same<T, bool>::value>::type>
+{
+    static const LogArgType Type = LogArgType::Unsigned;
+
+    static void Write(LogRecordWriter& writer, T value)
+    {
+        const u64 x = (u64)value;
+        writer.WriteBytes(&x, sizeof(x));
+    }
+};
+
+template<typename T>
+struct LogArg<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+{
+    static const LogArgType Type = LogArgType::Float;
+
+    static void Write(LogRecordWriter& writer, T value)
+    {
+        const double x = (double)value;
+        writer.WriteBytes(&x, sizeof(x));
+    }
+};
 
+template<typename T>
+struct LogArg<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type>
+{
+    static const LogArgType Type = LogArgType::Pointer;
 
+    static void Write(LogRecordWriter& writer, const T* value)
+    {
+        const u64 x = (u64)(uintptr_t)value;
+        writer.WriteBytes(&x, sizeof(x));
+    }
+};
+
+template<typename T>
+struct LogArg<T*, typename std::enable_if<std::is_same<typename std::remove_cv<T>::type, char>::value>::type>
+{
+    static const LogArgType Type = LogArgType::String;
+
+    static void Write(LogRecordWriter& writer, const char* value)
+    {
+        if (!value)
+            value = "(null)";
+        writer.WriteString(value, strlen(value));
+    }
+};
+
+template<>
+struct LogArg<std::string>
+{
+    static const LogArgType Type = LogArgType::String;
+
+    static void Write(LogRecordWriter& writer, const std::string& value)
+    {
+        writer.WriteString(value.data(), value.size());
+    }
+};
+
+template<typename T>
+using LogArgOf = LogArg<typename std::decay<T>::type>;
+
+
+// Level for channels without their own.  Defaults to Info
 extern std::atomic<Level> MinLevel;
 
 FORCE_INLINE void SetMinLevel(Level level)
@@ -64,46 +261,86 @@ FORCE_INLINE Level GetMinLevel()
     return MinLevel.load(std::memory_order_relaxed);
 }
 
+// Set the level of every channel with this name, including ones created
+// later.  Level::Count goes back to following SetMinLevel()
+void SetChannelMinLevel(const char* name, Level level);
+
+
+//-----------------------------------------------------------------------------
+// RateLimit
+//
+// Caps how often one log site writes: At most N messages per second, after
+// which messages are only counted.  The next message let through reports how
+// many were suppressed.
+//
+//   static logging::RateLimit limit(10);
+//   Logger.LogLimited(limit, Level::Warning, "Send error: ", error.message());
+
+class RateLimit
+{
+public:
+    explicit RateLimit(int perSecond)
+        : PerSecond(perSecond)
+    {
+    }
+
+    // Returns false to suppress the message.  Otherwise sets suppressed to
+    // the number of messages suppressed since the last one
+    bool Allow(u64& suppressed);
+
+private:
+    const int PerSecond;
+    std::atomic<u64> WindowStartMsec{ 0 };
+    std::atomic<int> WindowCount{ 0 };
+    std::atomic<u64> Suppressed{ 0 };
+};
+
+
+// Per-thread ring of log records
+class LogRing;
 
 class OutputWorker
 {
     OutputWorker();
 
 public:
+    ~OutputWorker();
+
     static OutputWorker& GetInstance();
-    void Write(LogStringBuffer& buffer);
     void Start();
     void Stop();
 
-private:
-    struct QueuedMessage
-    {
-        Level LogLevel;
-        const char* ChannelName;
-        std::string Message;
+    // Called by a thread's first log call
+    void AddRing(const std::shared_ptr<LogRing>& ring);
 
-        QueuedMessage(Level level, const char* channel, std::string& message)
-            : LogLevel(level)
-            , ChannelName(channel)
-            , Message(message)
-        {
-        }
-    };
+    // Called when a ring is filling up
+    void Wake();
 
-    static const int WorkQueueLimit = 32;
+private:
+    // Formats pending records at least this often
+    static const int kFlushIntervalMsec = 10;
 
-    std::mutex QueueLock;
+    std::mutex WakeLock;
     std::condition_variable Condition;
-    std::list<QueuedMessage> QueuePublic;
-    std::list<QueuedMessage> QueuePrivate;
-    int Overrun = 0;
+
+    // Rings of threads that have logged.  New rings come in through a queue
+    // so producers never wait on the worker
+    MPSCQueue<std::shared_ptr<LogRing>> NewRings;
+    std::vector<std::shared_ptr<LogRing>> Rings;
+
+    // Formatted output of one pass over the rings
+    std::string Batch;
 
     std::unique_ptr<std::thread> Thread;
     std::atomic_bool Terminated;
 
     void Loop();
 
-    void Log(QueuedMessage& message);
+    // Format everything queued.  Returns false if there was nothing
+    bool Drain();
+
+    void Format(const u8* record, size_t bytes);
+    void Flush();
 };
 
 
@@ -111,49 +348,82 @@ class Channel
 {
 public:
     explicit Channel(const char* name);
+    ~Channel();
+
+    // No copies, please.
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
 
     std::string GetPrefix() const;
     void SetPrefix(const std::string& prefix);
 
+    // Level for this channel only.  Level::Count follows SetMinLevel()
+    void SetChannelMinLevel(Level level)
+    {
+        ChannelMinLevel.store(level, std::memory_order_relaxed);
+    }
+
+    FORCE_INLINE bool IsEnabled(Level level) const
+    {
+        Level minLevel = ChannelMinLevel.load(std::memory_order_relaxed);
+        if (minLevel == Level::Count)
+            minLevel = GetMinLevel();
+        return level >= minLevel;
+    }
+
     template<typename... Args>
     FORCE_INLINE void Log(Level level, Args&&... args) const
     {
-        if (level >= GetMinLevel())
+        if (IsCompiledIn(level) && IsEnabled(level))
+            log(level, std::forward<Args>(args)...);
+    }
+
+    // Log through a RateLimit shared by every call from one site
+    template<typename... Args>
+    FORCE_INLINE void LogLimited(RateLimit& limit, Level level, Args&&... args) const
+    {
+        u64 suppressed = 0;
+        if (!IsCompiledIn(level) || !IsEnabled(level) || !limit.Allow(suppressed))
+            return;
+
+        if (suppressed > 0)
+            log(level, std::forward<Args>(args)..., " (", suppressed, " more suppressed)");
+        else
             log(level, std::forward<Args>(args)...);
     }
 
     template<typename... Args>
     FORCE_INLINE void Error(Args&&... args) const
     {
-        if (Level::Error >= GetMinLevel())
+        if (IsCompiledIn(Level::Error) && IsEnabled(Level::Error))
             log(Level::Error, std::forward<Args>(args)...);
     }
 
     template<typename... Args>
     FORCE_INLINE void Warning(Args&&... args) const
     {
-        if (Level::Warning >= GetMinLevel())
+        if (IsCompiledIn(Level::Warning) && IsEnabled(Level::Warning))
             log(Level::Warning, std::forward<Args>(args)...);
     }
 
     template<typename... Args>
     FORCE_INLINE void Info(Args&&... args) const
     {
-        if (Level::Info >= GetMinLevel())
+        if (IsCompiledIn(Level::Info) && IsEnabled(Level::Info))
             log(Level::Info, std::forward<Args>(args)...);
     }
 
     template<typename... Args>
     FORCE_INLINE void Debug(Args&&... args) const
     {
-        if (Level::Debug >= GetMinLevel())
+        if (IsCompiledIn(Level::Debug) && IsEnabled(Level::Debug))
             log(Level::Debug, std::forward<Args>(args)...);
     }
 
     template<typename... Args>
     FORCE_INLINE void Trace(Args&&... args) const
     {
-        if (Level::Trace >= GetMinLevel())
+        if (IsCompiledIn(Level::Trace) && IsEnabled(Level::Trace))
             log(Level::Trace, std::forward<Args>(args)...);
     }
 
@@ -163,27 +433,50 @@ private:
     mutable Lock PrefixLock;
     std::string Prefix;
 
+    std::atomic<Level> ChannelMinLevel{ Level::Count };
+
+    // Registry of channels for SetChannelMinLevel()
+    friend void SetChannelMinLevel(const char* name, Level level);
+    Channel* NextChannel = nullptr;
+
     template<typename T>
-    FORCE_INLINE void writeLogBuffer(LogStringBuffer& buffer, T&& arg) const
+    FORCE_INLINE void writeLogRecord(LogRecordWriter& writer, T&& arg) const
     {
-        LogStringize(buffer, arg);
+        LogArgOf<T>::Write(writer, arg);
     }
 
     template<typename T, typename... Args>
-    FORCE_INLINE void writeLogBuffer(LogStringBuffer& buffer, T&& arg, Args&&... args) const
+    FORCE_INLINE void writeLogRecord(LogRecordWriter& writer, T&& arg, Args&&... args) const
     {
-        writeLogBuffer(buffer, arg);
-        writeLogBuffer(buffer, args...);
+        writeLogRecord(writer, arg);
+        writeLogRecord(writer, args...);
     }
 
     template<typename... Args>
     FORCE_INLINE void log(Level level, Args&&... args) const
     {
-        LogStringBuffer buffer(ChannelName, level);
-        writeLogBuffer(buffer, Prefix, args...);
-        OutputWorker::GetInstance().Write(buffer);
+        typedef LogFormatOf<LogArgType::String, LogArgOf<Args>::Type...> FormatT;
+
+        LogRecordWriter writer(ChannelName, level, &FormatT::Format);
+        writeLogRecord(writer, Prefix, args...);
+        writer.Submit();
     }
 };
 
 
 } // namespace logging
+
+
+//-----------------------------------------------------------------------------
+// Log macros
+//
+// Skip evaluating the arguments when the level is compiled out or disabled:
+//
+//   SPHYNX_TRACE(Logger, "Got data len=", stream.GetRemaining());
+
+#define SPHYNX_LOG_IF(logger, level, ...) do { \
+    if (logging::IsCompiledIn(level) && (logger).IsEnabled(level)) \
+        (logger).Log(level, __VA_ARGS__); } while(false)
+
+#define SPHYNX_TRACE(logger, ...) SPHYNX_LOG_IF(logger, logging::Level::Trace, __VA_ARGS__)
+#define SPHYNX_DEBUG(logger, ...) SPHYNX_LOG_IF(logger, logging::Level::Debug, __VA_ARGS__)
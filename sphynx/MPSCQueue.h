@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Tools.h"
+#include <atomic>
+#include <utility> // std::move
+
+
+//-----------------------------------------------------------------------------
+// MPSCQueue<T>
+//
+// Lock-free queue with any number of producers and a single consumer.
+//
+// Producers push onto an atomic stack with a single compare-exchange, and
+// the consumer takes the whole stack with one exchange and reverses it, so
+// items are delivered in the order they were pushed.  Each push allocates a
+// node, so this suits items that arrive occasionally, such as connections
+// handed to a worker.
+
+template<typename T>
+class MPSCQueue
+{
+public:
+    MPSCQueue()
+    {
+        Head = nullptr;
+    }
+
+    ~MPSCQueue()
+    {
+        Node* node = Head.exchange(nullptr);
+        while (node)
+        {
+            Node* next = node->Next;
+            delete node;
+            node = next;
+        }
+    }
+
+    // No copies, please.
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    // Safe to call from any thread
+    void Push(T value)
+    {
+        Node* node = new Node(std::move(value));
+
+        node->Next = Head.load(std::memory_order_relaxed);
+        while (!Head.compare_exchange_weak(node->Next, node,
+            std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Consumer only: Call f(T&) for each queued item in push order.
+    // Returns the number of items
+    template<typename F>
+    unsigned Drain(F&& f)
+    {
+        Node* node = Head.exchange(nullptr, std::memory_order_acquire);
+
+        // Stack order is newest first, so reverse it
+        Node* oldest = nullptr;
+        while (node)
+        {
+            Node* next = node->Next;
+            node->Next = oldest;
+            oldest = node;
+            node = next;
+        }
+
+        unsigned count = 0;
+        while (oldest)
+        {
+            Node* next = oldest->Next;
+            f(oldest->Value);
+            delete oldest;
+            oldest = next;
+            ++count;
+        }
+        return count;
+    }
+
+    bool IsEmpty() const
+    {
+        return Head.load(std::memory_order_relaxed) == nullptr;
+    }
+
+protected:
+    struct Node
+    {
+        explicit Node(T&& value)
+            : Value(std::move(value))
+        {
+        }
+
+        T Value;
+        Node* Next = nullptr;
+    };
+
+    std::atomic<Node*> Head;
+};
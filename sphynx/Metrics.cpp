@@ -0,0 +1,372 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+
+int GetMetricShardIndex()
+{
+    static std::atomic<int> NextShardIndex(0);
+    static thread_local int ShardIndex = -1;
+
+    if (ShardIndex < 0)
+        ShardIndex = NextShardIndex++ % kMetricShards;
+
+    return ShardIndex;
+}
+
+void* AllocateMetric(size_t bytes)
+{
+    static const size_t kAlignment = 64;
+#if defined(_WIN32)
+    void* address = _aligned_malloc(bytes, kAlignment);
+#else
+    void* address = nullptr;
+    if (posix_memalign(&address, kAlignment, bytes) != 0)
+        address = nullptr;
+#endif
+    if (!address)
+        throw std::bad_alloc();
+    return address;
+}
+
+void FreeMetric(void* address)
+{
+#if defined(_WIN32)
+    _aligned_free(address);
+#else
+    free(address);
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// MetricCounter
+
+u64 MetricCounter::Read() const
+{
+    u64 total = 0;
+    for (const Shard& shard : Shards)
+        total += shard.Value.load(std::memory_order_relaxed);
+    return total;
+}
+
+
+//-----------------------------------------------------------------------------
+// MetricHistogram
+
+MetricHistogram::Shard::Shard()
+{
+    for (auto& bucket : Buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    Sum.store(0, std::memory_order_relaxed);
+}
+
+u64 MetricHistogram::GetBucketUpperBound(int bucket)
+{
+    if (bucket < (1 << kSubBucketBits))
+        return (u64)bucket;
+
+    const int shift = (bucket >> kSubBucketBits) - 1;
+    const u64 subBucket = (u64)(bucket & ((1 << kSubBucketBits) - 1));
+    const u64 lower = (((u64)1 << kSubBucketBits) + subBucket) << shift;
+    return lower + ((u64)1 << shift) - 1;
+}
+
+void MetricHistogram::Read(MetricHistogramSummary& summary) const
+{
+    u64 counts[kBucketCount] = {};
+
+    summary = MetricHistogramSummary();
+    for (const Shard& shard : Shards)
+    {
+        for (int i = 0; i < kBucketCount; ++i)
+            counts[i] += shard.Buckets[i].load(std::memory_order_relaxed);
+        summary.Sum += shard.Sum.load(std::memory_order_relaxed);
+    }
+
+    for (u64 count : counts)
+        summary.Count += count;
+    if (summary.Count <= 0)
+        return;
+
+    // Walk up the buckets once, filling in each percentile as it is passed
+    const u64 p50 = (summary.Count * 50 + 99) / 100;
+    const u64 p90 = (summary.Count * 90 + 99) / 100;
+    const u64 p99 = (summary.Count * 99 + 99) / 100;
+    const u64 p999 = (summary.Count * 999 + 999) / 1000;
+    u64 seen = 0;
+
+    for (int i = 0; i < kBucketCount; ++i)
+    {
+        if (counts[i] <= 0)
+            continue;
+
+        const u64 before = seen;
+        seen += counts[i];
+        const u64 upper = GetBucketUpperBound(i);
+
+        if (before < p50 && seen >= p50)
+            summary.P50 = upper;
+        if (before < p90 && seen >= p90)
+            summary.P90 = upper;
+        if (before < p99 && seen >= p99)
+            summary.P99 = upper;
+        if (before < p999 && seen >= p999)
+            summary.P999 = upper;
+        summary.Max = upper;
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// MetricsRegistry
+
+template<class T>
+T& MetricsRegistry::getOrCreate(std::vector<Entry<T>>& entries, const char* name)
+{
+    Locker locker(RegistryLock);
+
+    for (auto& entry : entries)
+        if (entry.Name == name)
+            return *entry.Metric;
+
+    Entry<T> entry;
+    entry.Name = name;
+    entry.Metric = std::make_unique<T>();
+    entries.push_back(std::move(entry));
+    return *entries.back().Metric;
+}
+
+MetricCounter& MetricsRegistry::GetCounter(const char* name)
+{
+    return getOrCreate(Counters, name);
+}
+
+MetricGauge& MetricsRegistry::GetGauge(const char* name)
+{
+    return getOrCreate(Gauges, name);
+}
+
+MetricHistogram& MetricsRegistry::GetHistogram(const char* name)
+{
+    return getOrCreate(Histograms, name);
+}
+
+void MetricsRegistry::GetSnapshot(MetricsSnapshot& snapshot) const
+{
+    snapshot = MetricsSnapshot();
+    snapshot.TimeMsec = GetTimeMsec();
+
+    Locker locker(RegistryLock);
+
+    for (const auto& entry : Counters)
+        snapshot.Counters.emplace_back(entry.Name, entry.Metric->Read());
+    for (const auto& entry : Gauges)
+        snapshot.Gauges.emplace_back(entry.Name, entry.Metric->Read());
+    for (const auto& entry : Histograms)
+    {
+        MetricHistogramSummary summary;
+        entry.Metric->Read(summary);
+        snapshot.Histograms.emplace_back(entry.Name, summary);
+    }
+}
+
+std::string MetricsSnapshot::FormatText() const
+{
+    std::vector<std::pair<std::string, std::string>> lines;
+
+    for (const auto& counter : Counters)
+        lines.emplace_back(counter.first, std::to_string(counter.second));
+    for (const auto& gauge : Gauges)
+        lines.emplace_back(gauge.first, std::to_string(gauge.second));
+    for (const auto& histogram : Histograms)
+    {
+        const MetricHistogramSummary& summary = histogram.second;
+        lines.emplace_back(histogram.first + ".count", std::to_string(summary.Count));
+        lines.emplace_back(histogram.first + ".sum", std::to_string(summary.Sum));
+        lines.emplace_back(histogram.first + ".p50", std::to_string(summary.P50));
+        lines.emplace_back(histogram.first + ".p90", std::to_string(summary.P90));
+        lines.emplace_back(histogram.first + ".p99", std::to_string(summary.P99));
+        lines.emplace_back(histogram.first + ".p999", std::to_string(summary.P999));
+        lines.emplace_back(histogram.first + ".max", std::to_string(summary.Max));
+    }
+
+    std::sort(lines.begin(), lines.end());
+
+    std::ostringstream text;
+    for (const auto& line : lines)
+        text << line.first << ' ' << line.second << '\n';
+    return text.str();
+}
+
+MetricsRegistry& GetMetrics()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+
+//-----------------------------------------------------------------------------
+// CallStats
+
+CallStats::SparseBlock::SparseBlock()
+{
+    for (int i = 0; i < kCallStatsBlockEntries; ++i)
+        Keys[i].store(0, std::memory_order_relaxed);
+}
+
+CallStats::CallStats(const std::shared_ptr<CallStats>& parent, int shardCount,
+    std::atomic<u64>* allocatedBytes)
+    : Parent(parent)
+    , ShardCount(shardCount > 1 ? shardCount : 1)
+    , AllocatedBytes(allocatedBytes)
+{
+    if (ShardCount > 1)
+    {
+        Shards = MakeCountedArray<Shard>(AllocatedBytes, ShardCount);
+        for (int i = 0; i < ShardCount; ++i)
+            new (&Shards[i]) Shard;
+    }
+}
+
+CallStats::~CallStats()
+{
+    SparseBlock* block = Sparse.Next.load(std::memory_order_acquire);
+    while (block)
+    {
+        SparseBlock* next = block->Next.load(std::memory_order_relaxed);
+        block->~SparseBlock();
+        CountedFree(AllocatedBytes, block);
+        block = next;
+    }
+}
+
+CallStats::Counts* CallStats::claimSparse(u16 key)
+{
+    SparseBlock* block = &Sparse;
+    for (;;)
+    {
+        for (int i = 0; i < kCallStatsBlockEntries; ++i)
+        {
+            u16 found = block->Keys[i].load(std::memory_order_acquire);
+            if (found == 0 && block->Keys[i].compare_exchange_strong(found, key, std::memory_order_acq_rel))
+                return &block->Entries[i];
+            if (found == key)
+                return &block->Entries[i];
+        }
+
+        SparseBlock* next = block->Next.load(std::memory_order_acquire);
+        if (!next)
+        {
+            void* address = CountedAlloc(AllocatedBytes, sizeof(SparseBlock));
+            if (!address)
+                return nullptr;
+            SparseBlock* created = new (address) SparseBlock;
+
+            // If another thread linked a block first, use that one
+            if (block->Next.compare_exchange_strong(next, created, std::memory_order_acq_rel))
+                next = created;
+            else
+            {
+                created->~SparseBlock();
+                CountedFree(AllocatedBytes, created);
+            }
+        }
+        block = next;
+    }
+}
+
+const CallStats::Counts* CallStats::findSparse(u16 key) const
+{
+    for (const SparseBlock* block = &Sparse; block; block = block->Next.load(std::memory_order_acquire))
+    {
+        for (int i = 0; i < kCallStatsBlockEntries; ++i)
+        {
+            const u16 found = block->Keys[i].load(std::memory_order_acquire);
+            if (found == key)
+                return &block->Entries[i];
+            if (found == 0)
+                return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+void CallStats::Get(CallDirection direction, CallTransport transport, u8 callId, CallStatsEntry& entry) const
+{
+    entry = CallStatsEntry();
+
+    if (!Shards)
+    {
+        const Counts* counts = findSparse(getSparseKey(direction, transport, callId));
+        if (counts)
+        {
+            entry.Calls = counts->Calls.load(std::memory_order_relaxed);
+            entry.Bytes = counts->Bytes.load(std::memory_order_relaxed);
+            entry.HandlerNsec = counts->HandlerNsec.load(std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    for (int i = 0; i < ShardCount; ++i)
+    {
+        const Counts& counts = Shards[i].Table[(int)direction][(int)transport][callId];
+        entry.Calls += counts.Calls.load(std::memory_order_relaxed);
+        entry.Bytes += counts.Bytes.load(std::memory_order_relaxed);
+        entry.HandlerNsec += counts.HandlerNsec.load(std::memory_order_relaxed);
+    }
+}
+
+std::string CallStats::FormatText() const
+{
+    static const char* kDirections[] = { "sent", "received" };
+    static const char* kTransports[] = { "UDP", "TCP" };
+
+    struct Line
+    {
+        int Direction, Transport, CallId;
+        CallStatsEntry Entry;
+    };
+    std::vector<Line> lines;
+
+    for (int direction = 0; direction < (int)CallDirection::Count; ++direction)
+    {
+        for (int transport = 0; transport < (int)CallTransport::Count; ++transport)
+        {
+            for (int callId = 0; callId < 256; ++callId)
+            {
+                Line line;
+                line.Direction = direction;
+                line.Transport = transport;
+                line.CallId = callId;
+                Get((CallDirection)direction, (CallTransport)transport, (u8)callId, line.Entry);
+                if (line.Entry.Calls > 0)
+                    lines.push_back(line);
+            }
+        }
+    }
+
+    std::stable_sort(lines.begin(), lines.end(), [](const Line& a, const Line& b)
+    {
+        return a.Entry.Bytes > b.Entry.Bytes;
+    });
+
+    std::ostringstream text;
+    for (const Line& line : lines)
+    {
+        text << kDirections[line.Direction] << ' ' << kTransports[line.Transport]
+            << " call " << line.CallId << ": " << line.Entry.Calls << " calls, "
+            << line.Entry.Bytes << " bytes";
+        if (line.Direction == (int)CallDirection::Received)
+            text << ", " << line.Entry.HandlerNsec / 1000 << " usec in handler";
+        text << '\n';
+    }
+    return text.str();
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include "Tools.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// Metrics
+//
+// Counters, gauges and histograms cheap enough for the packet paths.  Updates
+// go to one of kMetricShards cache lines picked by the calling thread, so
+// worker threads do not contend, and reads add the shards up.  Metrics live
+// in the registry for the life of the process, so call sites keep references:
+//
+//   static MetricCounter& SentBytes = GetMetrics().GetCounter("udp.sent_bytes");
+//   SentBytes.Add(bytes);
+
+// Shards per metric.  Threads past this share shards, which is still correct
+static const int kMetricShards = 8;
+
+// Shard of the calling thread
+int GetMetricShardIndex();
+
+// Shards are aligned to cache lines, which operator new only respects from
+// C++17 on.  Metrics with shards allocate through these instead
+void* AllocateMetric(size_t bytes);
+void FreeMetric(void* address);
+
+
+//-----------------------------------------------------------------------------
+// MetricCounter
+
+class MetricCounter
+{
+public:
+    MetricCounter() {}
+
+    // No copies, please.
+    MetricCounter(const MetricCounter&) = delete;
+    MetricCounter& operator=(const MetricCounter&) = delete;
+
+    void Add(u64 count = 1)
+    {
+        Shards[GetMetricShardIndex()].Value.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    u64 Read() const;
+
+    static void* operator new(size_t bytes)
+    {
+        return AllocateMetric(bytes);
+    }
+    static void operator delete(void* address)
+    {
+        FreeMetric(address);
+    }
+
+protected:
+    // Keep threads off each other's cache lines
+    struct alignas(64) Shard
+    {
+        std::atomic<u64> Value{ 0 };
+    };
+
+    Shard Shards[kMetricShards];
+};
+
+
+//-----------------------------------------------------------------------------
+// MetricGauge
+//
+// A level rather than a total, like connection count.  Not sharded, since
+// gauges change on connect and disconnect rather than per packet
+
+class MetricGauge
+{
+public:
+    MetricGauge() {}
+
+    // No copies, please.
+    MetricGauge(const MetricGauge&) = delete;
+    MetricGauge& operator=(const MetricGauge&) = delete;
+
+    void Add(s64 delta)
+    {
+        Value.fetch_add(delta, std::memory_order_relaxed);
+    }
+    void Set(s64 value)
+    {
+        Value.store(value, std::memory_order_relaxed);
+    }
+    s64 Read() const
+    {
+        return Value.load(std::memory_order_relaxed);
+    }
+
+protected:
+    std::atomic<s64> Value{ 0 };
+};
+
+
+//-----------------------------------------------------------------------------
+// MetricHistogram
+//
+// Log-linear buckets in the style of HdrHistogram: Each power of two is split
+// into 8 buckets, so values are kept to about 12% precision.  Values 0 to 7
+// are exact and values past 2^32 land in the last bucket
+
+struct MetricHistogramSummary
+{
+    u64 Count = 0;
+    u64 Sum = 0;
+
+    // Upper bounds of the buckets holding these percentiles
+    u64 P50 = 0, P90 = 0, P99 = 0, P999 = 0, Max = 0;
+};
+
+class MetricHistogram
+{
+public:
+    static const int kSubBucketBits = 3;
+    static const int kBucketCount = (32 - kSubBucketBits + 1) << kSubBucketBits;
+
+    MetricHistogram() {}
+
+    // No copies, please.
+    MetricHistogram(const MetricHistogram&) = delete;
+    MetricHistogram& operator=(const MetricHistogram&) = delete;
+
+    void Record(u64 value)
+    {
+        Shard& shard = Shards[GetMetricShardIndex()];
+        shard.Buckets[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.Sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void Read(MetricHistogramSummary& summary) const;
+
+    static int GetBucket(u64 value)
+    {
+        if (value < (1u << kSubBucketBits))
+            return (int)value;
+        if (value > 0xffffffff)
+            return kBucketCount - 1;
+
+#if defined(_MSC_VER)
+        unsigned long msb;
+        _BitScanReverse(&msb, (u32)value);
+#else
+        const int msb = 31 - __builtin_clz((u32)value);
+#endif
+        const int shift = (int)msb - kSubBucketBits;
+        return ((shift + 1) << kSubBucketBits) + (int)((value >> shift) & ((1u << kSubBucketBits) - 1));
+    }
+
+    // Largest value that falls in the bucket
+    static u64 GetBucketUpperBound(int bucket);
+
+    static void* operator new(size_t bytes)
+    {
+        return AllocateMetric(bytes);
+    }
+    static void operator delete(void* address)
+    {
+        FreeMetric(address);
+    }
+
+protected:
+    // Keep threads off each other's cache lines
+    struct alignas(64) Shard
+    {
+        std::atomic<u64> Buckets[kBucketCount];
+        std::atomic<u64> Sum;
+
+        Shard();
+    };
+
+    Shard Shards[kMetricShards];
+};
+
+
+//-----------------------------------------------------------------------------
+// MetricsRegistry
+
+struct MetricsSnapshot
+{
+    u64 TimeMsec = 0;
+
+    std::vector<std::pair<std::string, u64>> Counters;
+    std::vector<std::pair<std::string, s64>> Gauges;
+    std::vector<std::pair<std::string, MetricHistogramSummary>> Histograms;
+
+    // One "name value" line per metric, sorted by name.  Histograms are
+    // written as name.count, name.sum, name.p50 and so on
+    std::string FormatText() const;
+};
+
+class MetricsRegistry
+{
+public:
+    MetricsRegistry() {}
+
+    // No copies, please.
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    // Returns the metric with this name, creating it on first use.  The
+    // reference stays valid for the life of the registry
+    MetricCounter& GetCounter(const char* name);
+    MetricGauge& GetGauge(const char* name);
+    MetricHistogram& GetHistogram(const char* name);
+
+    // Read every metric.  Counters and histograms are totals since start, so
+    // rates come from the difference between two snapshots
+    void GetSnapshot(MetricsSnapshot& snapshot) const;
+
+protected:
+    template<class T>
+    struct Entry
+    {
+        std::string Name;
+        std::unique_ptr<T> Metric;
+    };
+
+    mutable Lock RegistryLock;
+    std::vector<Entry<MetricCounter>> Counters;
+    std::vector<Entry<MetricGauge>> Gauges;
+    std::vector<Entry<MetricHistogram>> Histograms;
+
+    template<class T>
+    T& getOrCreate(std::vector<Entry<T>>& entries, const char* name);
+};
+
+// Registry shared by the library and the application
+MetricsRegistry& GetMetrics();
+
+
+//-----------------------------------------------------------------------------
+// CallStats
+//
+// Optional traffic accounting by call id, for each direction and transport.
+// Received calls also add up the time spent deserializing and handling them.
+// Stats can feed a parent, so each connection keeps its own table and the
+// server adds them all up in another.  A table fed by many threads, like the
+// server's, should be sharded: Each thread then adds to the shard picked by
+// GetMetricShardIndex() and reads add the shards up, as for MetricCounter.
+// An unsharded table is sparse instead, since a connection only uses a few
+// call ids: Entries are claimed as calls first show up, in blocks of
+// kCallStatsBlockEntries
+
+enum class CallDirection
+{
+    Sent,
+    Received,
+
+    Count
+};
+
+enum class CallTransport
+{
+    UDP,
+    TCP,
+
+    Count
+};
+
+// Entries per block of a sparse table
+static const int kCallStatsBlockEntries = 16;
+
+struct CallStatsEntry
+{
+    u64 Calls = 0;
+    u64 Bytes = 0;
+    u64 HandlerNsec = 0;
+};
+
+class CallStats
+{
+public:
+    // Tables are allocated through CountedAlloc() with allocatedBytes
+    explicit CallStats(const std::shared_ptr<CallStats>& parent = nullptr, int shardCount = 1,
+        std::atomic<u64>* allocatedBytes = nullptr);
+    ~CallStats();
+
+    // No copies, please.
+    CallStats(const CallStats&) = delete;
+    CallStats& operator=(const CallStats&) = delete;
+
+    void Add(CallDirection direction, CallTransport transport, u8 callId, u64 bytes, u64 handlerNsec = 0)
+    {
+        for (CallStats* stats = this; stats; stats = stats->Parent.get())
+        {
+            Counts* counts = stats->getCounts(direction, transport, callId);
+            if (!counts)
+                continue; // Out of memory
+            counts->Calls.fetch_add(1, std::memory_order_relaxed);
+            counts->Bytes.fetch_add(bytes, std::memory_order_relaxed);
+            if (handlerNsec > 0)
+                counts->HandlerNsec.fetch_add(handlerNsec, std::memory_order_relaxed);
+        }
+    }
+
+    void Get(CallDirection direction, CallTransport transport, u8 callId, CallStatsEntry& entry) const;
+
+    // One line for each call id with traffic, most bytes first
+    std::string FormatText() const;
+
+protected:
+    struct Counts
+    {
+        std::atomic<u64> Calls{ 0 };
+        std::atomic<u64> Bytes{ 0 };
+        std::atomic<u64> HandlerNsec{ 0 };
+    };
+
+    struct Shard
+    {
+        Counts Table[(int)CallDirection::Count][(int)CallTransport::Count][256];
+    };
+
+    // Entries of a sparse table are claimed in order by setting their key,
+    // so the first unclaimed key ends a search.  A full block links to the
+    // next one
+    struct SparseBlock
+    {
+        std::atomic<u16> Keys[kCallStatsBlockEntries]; // 0 for unclaimed
+        Counts Entries[kCallStatsBlockEntries];
+        std::atomic<SparseBlock*> Next{ nullptr };
+
+        SparseBlock();
+    };
+
+    std::shared_ptr<CallStats> Parent;
+    int ShardCount = 1;
+    std::atomic<u64>* AllocatedBytes = nullptr;
+
+    // Dense table per shard, or null for a sparse table
+    CountedPtr<Shard[]> Shards;
+
+    // First block of a sparse table
+    SparseBlock Sparse;
+
+    static u16 getSparseKey(CallDirection direction, CallTransport transport, u8 callId)
+    {
+        return (u16)(1 + (((int)direction * (int)CallTransport::Count + (int)transport) << 8) + callId);
+    }
+
+    Counts* getCounts(CallDirection direction, CallTransport transport, u8 callId)
+    {
+        if (Shards)
+        {
+            Shard& shard = Shards[ShardCount > 1 ? GetMetricShardIndex() % ShardCount : 0];
+            return &shard.Table[(int)direction][(int)transport][callId];
+        }
+        return claimSparse(getSparseKey(direction, transport, callId));
+    }
+
+    // Returns the entry for the key, claiming one if needed.  Returns null if
+    // out of memory
+    Counts* claimSparse(u16 key);
+
+    // Returns null if the key has no entry
+    const Counts* findSparse(u16 key) const;
+};
@@ -2,12 +2,15 @@
 
 #include "Tools.h"
 #include "Stream.h"
+#include "ViewArena.h"
+#include "Metrics.h"
 #include <unordered_map>
 #include <memory>
 #include <functional>
 #include <type_traits>
 #include <utility>
 #include <algorithm> // std::remove
+#include <chrono>
 
 
 //-----------------------------------------------------------------------------
@@ -173,14 +176,19 @@ struct CallSerializer
 template < int kCallId, typename... Args >
 struct CallSerializer < kCallId, void(Args...) >
 {
+    static const int kSegmentBytes = 4096;
+
     std::function<void(Stream&)> CallSender;
 
     bool operator()(Args... args)
     {
-        // Wrap a local buffer to construct the packet
+        // Wrap a local buffer to construct the packet.  Larger calls spill
+        // into segments from the thread's arena instead of being copied
         u8 writeBuffer[512];
         Stream stream;
         stream.WrapWrite(writeBuffer, sizeof(writeBuffer));
+        stream.SetAllocator(&GetThreadStreamArena());
+        stream.SetSegmentBytes(kSegmentBytes);
 
         // Write call id byte
         u8 callId = static_cast<u8>(kCallId);
@@ -193,13 +201,6 @@ struct CallSerializer < kCallId, void(Args...) >
             return false;
         }
 
-        // Parameters should never exceed 255 bytes
-        if (stream.IsDynamic())
-        {
-            DEBUG_BREAK;
-            return false;
-        }
-
         CallSender(stream);
         return true;
     }
@@ -301,7 +302,7 @@ public:
     {
         typedef typename function_traits<F>::template arg<0>::type A0;
 
-        typename base_param_trait<A0>::type a0;
+        typename base_param_trait<A0>::type a0{};
 
         if (!InputSerializer::SerializeInputs<
             typename add_input_ref_t<A0>::type>(
@@ -330,8 +331,8 @@ public:
         typedef typename function_traits<F>::template arg<0>::type A0;
         typedef typename function_traits<F>::template arg<1>::type A1;
 
-        typename base_param_trait<A0>::type a0;
-        typename base_param_trait<A1>::type a1;
+        typename base_param_trait<A0>::type a0{};
+        typename base_param_trait<A1>::type a1{};
 
         if (!InputSerializer::SerializeInputs<
             typename add_input_ref_t<A0>::type,
@@ -364,9 +365,9 @@ public:
         typedef typename function_traits<F>::template arg<1>::type A1;
         typedef typename function_traits<F>::template arg<2>::type A2;
 
-        typename base_param_trait<A0>::type a0;
-        typename base_param_trait<A1>::type a1;
-        typename base_param_trait<A2>::type a2;
+        typename base_param_trait<A0>::type a0{};
+        typename base_param_trait<A1>::type a1{};
+        typename base_param_trait<A2>::type a2{};
 
         if (!InputSerializer::SerializeInputs<
             typename add_input_ref_t<A0>::type,
@@ -403,10 +404,10 @@ public:
         typedef typename function_traits<F>::template arg<2>::type A2;
         typedef typename function_traits<F>::template arg<3>::type A3;
 
-        typename base_param_trait<A0>::type a0;
-        typename base_param_trait<A1>::type a1;
-        typename base_param_trait<A2>::type a2;
-        typename base_param_trait<A3>::type a3;
+        typename base_param_trait<A0>::type a0{};
+        typename base_param_trait<A1>::type a1{};
+        typename base_param_trait<A2>::type a2{};
+        typename base_param_trait<A3>::type a3{};
 
         if (!InputSerializer::SerializeInputs<
             typename add_input_ref_t<A0>::type,
@@ -447,11 +448,11 @@ public:
         typedef typename function_traits<F>::template arg<3>::type A3;
         typedef typename function_traits<F>::template arg<4>::type A4;
 
-        typename base_param_trait<A0>::type a0;
-        typename base_param_trait<A1>::type a1;
-        typename base_param_trait<A2>::type a2;
-        typename base_param_trait<A3>::type a3;
-        typename base_param_trait<A4>::type a4;
+        typename base_param_trait<A0>::type a0{};
+        typename base_param_trait<A1>::type a1{};
+        typename base_param_trait<A2>::type a2{};
+        typename base_param_trait<A3>::type a3{};
+        typename base_param_trait<A4>::type a4{};
 
         if (!InputSerializer::SerializeInputs<
             typename add_input_ref_t<A0>::type,
@@ -521,19 +522,56 @@ public:
         for (auto& call : CallTable)
             call.reset();
     }
-    bool Call(Stream& input)
+    // Route the next call in the stream.  With stats, the call is counted
+    // as received on the given transport
+    bool Call(Stream& input, CallStats* stats = nullptr, CallTransport transport = CallTransport::UDP)
     {
-        u8 callId;
+        const int startUsed = input.GetUsed();
+
+        u8 callId = 0;
         if (!input.Serialize(callId))
             return false;
 
+        static MetricCounter& Calls = GetMetrics().GetCounter("rpc.calls");
+        static MetricCounter& Failures = GetMetrics().GetCounter("rpc.failures");
+
         Locker locker(CallLock);
 
         auto& call = CallTable[callId];
         if (!call)
+        {
+            Failures.Add();
             return false;
+        }
+
+        if (!stats)
+        {
+            if (!call->WrappedCall(input))
+            {
+                Failures.Add();
+                return false;
+            }
+        }
+        else
+        {
+            // Handlers often take well under a microsecond, so this uses a
+            // finer clock than GetTimeUsec()
+            const auto t0 = std::chrono::steady_clock::now();
+            const bool success = call->WrappedCall(input);
+            const auto t1 = std::chrono::steady_clock::now();
+
+            if (!success)
+            {
+                Failures.Add();
+                return false;
+            }
+
+            stats->Add(CallDirection::Received, transport, callId, input.GetUsed() - startUsed,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
 
-        return call->WrappedCall(input);
+        Calls.Add();
+        return true;
     }
 
 protected:
@@ -0,0 +1,74 @@
+#include "SipHash.h"
+
+
+//-----------------------------------------------------------------------------
+// SipHash-2-4
+
+static FORCE_INLINE u64 ReadU64LE(const u8* p)
+{
+    return (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) | ((u64)p[3] << 24) |
+           ((u64)p[4] << 32) | ((u64)p[5] << 40) | ((u64)p[6] << 48) | ((u64)p[7] << 56);
+}
+
+static FORCE_INLINE u64 Rol64(u64 x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+#define SIPROUND \
+    v0 += v1; v1 = Rol64(v1, 13); v1 ^= v0; v0 = Rol64(v0, 32); \
+    v2 += v3; v3 = Rol64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = Rol64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = Rol64(v1, 17); v1 ^= v2; v2 = Rol64(v2, 32);
+
+u64 SipHash24(const u8 key[16], const void* data, size_t bytes)
+{
+    const u64 k0 = ReadU64LE(key);
+    const u64 k1 = ReadU64LE(key + 8);
+
+    u64 v0 = k0 ^ 0x736f6d6570736575ULL;
+    u64 v1 = k1 ^ 0x646f72616e646f6dULL;
+    u64 v2 = k0 ^ 0x6c7967656e657261ULL;
+    u64 v3 = k1 ^ 0x7465646279746573ULL;
+
+    const u8* p = reinterpret_cast<const u8*>(data);
+    const u8* end = p + (bytes & ~(size_t)7);
+
+    for (; p != end; p += 8)
+    {
+        const u64 m = ReadU64LE(p);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Last block holds the leftover bytes and the length
+    u64 b = (u64)bytes << 56;
+    switch (bytes & 7)
+    {
+    case 7: b |= (u64)p[6] << 48;
+    case 6: b |= (u64)p[5] << 40;
+    case 5: b |= (u64)p[4] << 32;
+    case 4: b |= (u64)p[3] << 24;
+    case 3: b |= (u64)p[2] << 16;
+    case 2: b |= (u64)p[1] << 8;
+    case 1: b |= (u64)p[0];
+    default: break;
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Tools.h"
+
+
+//-----------------------------------------------------------------------------
+// SipHash-2-4
+//
+// Keyed 64-bit PRF by Aumasson and Bernstein.  Fast on short inputs, which
+// makes it a good MAC for handshake cookies.
+
+u64 SipHash24(const u8 key[16], const void* data, size_t bytes);
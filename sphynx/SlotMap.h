@@ -0,0 +1,158 @@
+#pragma once
+
+#include "Tools.h"
+#include <vector>
+#include <utility> // std::move
+
+
+//-----------------------------------------------------------------------------
+// SlotHandle
+//
+// Reference to a SlotMap entry.  The generation is bumped whenever a slot is
+// freed, so handles to removed entries stop resolving instead of pointing at
+// whatever reuses the slot.
+
+struct SlotHandle
+{
+    static const u32 kInvalidIndex = ~(u32)0;
+
+    u32 Index = kInvalidIndex;
+    u32 Generation = 0;
+
+    bool IsValid() const
+    {
+        return Index != kInvalidIndex;
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+// SlotMap<T>
+//
+// Values are kept packed in one array for iteration, and an indirection
+// table maps handles to their current position.  Insert and remove are O(1):
+// Removal moves the last value into the hole.  Iteration order is not stable.
+//
+// Not thread-safe.
+
+template<typename T>
+class SlotMap
+{
+public:
+    SlotHandle Insert(T value)
+    {
+        SlotHandle handle;
+
+        if (!FreeSlots.empty())
+        {
+            handle.Index = FreeSlots.back();
+            FreeSlots.pop_back();
+        }
+        else
+        {
+            handle.Index = static_cast<u32>(Slots.size());
+            Slots.emplace_back();
+        }
+
+        Slot& slot = Slots[handle.Index];
+        slot.ValueIndex = static_cast<u32>(Values.size());
+        handle.Generation = slot.Generation;
+
+        Values.push_back(std::move(value));
+        ValueSlots.push_back(handle.Index);
+
+        return handle;
+    }
+
+    // Returns false if the handle is stale
+    bool Remove(SlotHandle handle)
+    {
+        Slot* slot = find(handle);
+        if (!slot)
+            return false;
+
+        const u32 valueIndex = slot->ValueIndex;
+        const u32 lastIndex = static_cast<u32>(Values.size() - 1);
+
+        // Fill the hole with the last value
+        if (valueIndex != lastIndex)
+        {
+            Values[valueIndex] = std::move(Values[lastIndex]);
+            ValueSlots[valueIndex] = ValueSlots[lastIndex];
+            Slots[ValueSlots[valueIndex]].ValueIndex = valueIndex;
+        }
+        Values.pop_back();
+        ValueSlots.pop_back();
+
+        slot->ValueIndex = SlotHandle::kInvalidIndex;
+        ++slot->Generation;
+        FreeSlots.push_back(handle.Index);
+
+        return true;
+    }
+
+    // Returns null if the handle is stale
+    T* Get(SlotHandle handle)
+    {
+        Slot* slot = find(handle);
+        return slot ? &Values[slot->ValueIndex] : nullptr;
+    }
+
+    size_t size() const
+    {
+        return Values.size();
+    }
+
+    bool empty() const
+    {
+        return Values.empty();
+    }
+
+    void clear()
+    {
+        // Bump the generation of every live slot so old handles go stale
+        for (u32 index : ValueSlots)
+        {
+            Slots[index].ValueIndex = SlotHandle::kInvalidIndex;
+            ++Slots[index].Generation;
+            FreeSlots.push_back(index);
+        }
+        Values.clear();
+        ValueSlots.clear();
+    }
+
+    typename std::vector<T>::iterator begin()
+    {
+        return Values.begin();
+    }
+    typename std::vector<T>::iterator end()
+    {
+        return Values.end();
+    }
+
+protected:
+    struct Slot
+    {
+        u32 ValueIndex = SlotHandle::kInvalidIndex;
+        u32 Generation = 0;
+    };
+
+    std::vector<Slot> Slots;
+    std::vector<u32> FreeSlots;
+
+    // Packed values and the slot that owns each one
+    std::vector<T> Values;
+    std::vector<u32> ValueSlots;
+
+    Slot* find(SlotHandle handle)
+    {
+        if (handle.Index >= Slots.size())
+            return nullptr;
+
+        Slot& slot = Slots[handle.Index];
+        if (slot.Generation != handle.Generation || slot.ValueIndex == SlotHandle::kInvalidIndex)
+            return nullptr;
+
+        return &slot;
+    }
+};
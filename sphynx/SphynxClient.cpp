@@ -11,11 +11,17 @@ SphynxClient::SphynxClient()
     ServerTimeDeltaMsec = 0;
     SendingHandshakes = false;
 
+    StatePool = std::make_shared<TCPStatePool>();
+
+    // Make room for the largest datagram header
+    UDPOutReserved = kC2SUDPHeaderMaxBytes + 2;
+    UDPOutUsed = UDPOutReserved;
+
     RPCHeartbeatTCP.CallSender = TCPCallSender;
     RPCHeartbeatUDP.CallSender = UDPCallSender;
     RPCHandshakeUDP.CallSender = UDPCallSender;
 
-    Router.Set<S2CTCPHandshakeT>(S2CTCPHandshakeID, [this](u32 cookie, u16 udpPort)
+    Router.Set<S2CTCPHandshakeT>(S2CTCPHandshakeID, [this](u64 cookie, u16 udpPort)
     {
         Logger.Info("Got TCP handshake: cookie=", cookie, ", UDPport=", udpPort);
 
@@ -49,7 +55,7 @@ SphynxClient::SphynxClient()
             Interface->OnConnect(this);
         }
 
-        const u64 nowMsec = GetTimeMsec();
+        const u64 nowMsec = GetCachedMsec();
         const u64 bestS2Cdelta = WinTimes.ComputeDelta(nowMsec);
         ServerTimeDeltaMsec = (bestC2Sdelta - (u16)bestS2Cdelta) >> 1;
 
@@ -67,9 +73,25 @@ SphynxClient::~SphynxClient()
 {
 }
 
+int SphynxClient::WriteUDPHeader(u8* end)
+{
+    // Handshakes go out before the server knows the address, so only
+    // address established sessions by id
+    if (!IsFullConnection)
+    {
+        end[-1] = 0; // No flags
+        return 1;
+    }
+
+    u8* header = end - kC2SUDPHeaderMaxBytes;
+    header[0] = kC2SUDPFlagConnectionId;
+    memcpy(header + 1, &ConnectionCookie, 8);
+    return kC2SUDPHeaderMaxBytes;
+}
+
 void SphynxClient::OnTimerTick()
 {
-    const u64 nowMsec = GetTimeMsec();
+    const u64 nowMsec = UpdateCachedTime() / 1000;
 
     if (SendingHandshakes)
     {
@@ -107,7 +129,7 @@ void SphynxClient::OnTimerTick()
             (nowMsec - LastUDPTimeSyncMsec > static_cast<u64>(S2CUDPTimeSyncIntervalMsec)))
         {
             LastUDPTimeSyncMsec = nowMsec;
-            Logger.Trace("Sending UDP heartbeat ", nowMsec);
+            SPHYNX_TRACE(Logger, "Sending UDP heartbeat ", nowMsec);
 
             RPCHeartbeatUDP(ToServerTime15(nowMsec));
 
@@ -122,7 +144,7 @@ void SphynxClient::OnTimerTick()
         if (nowMsec - LastTCPHeartbeatMsec > static_cast<u64>(kS2CTCPHeartbeatIntervalMsec))
         {
             LastTCPHeartbeatMsec = nowMsec;
-            Logger.Trace("Sending TCP heartbeat ", nowMsec);
+            SPHYNX_TRACE(Logger, "Sending TCP heartbeat ", nowMsec);
 
             RPCHeartbeatTCP(ToServerTime15(nowMsec));
         }
@@ -130,6 +152,8 @@ void SphynxClient::OnTimerTick()
 
     Flush();
 
+    ReleaseIdleTCPState(nowMsec);
+
     PostNextTimer();
 }
 
@@ -154,9 +178,22 @@ void SphynxClient::Loop()
 {
     SetThreadName("ClientWorker");
 
+    StartResolve();
+
+    Logger.Info("Client thread: Entering loop");
+
+    while (!Terminated)
+        Context->run();
+
+    Logger.Info("Client thread: Exiting loop");
+}
+
+void SphynxClient::StartResolve()
+{
+    // The handler holds the resolver, which cancels the lookup when destroyed
     auto resolver = std::make_shared<asio::ip::tcp::resolver>(*Context);
     resolver->async_resolve(Settings->Host, std::to_string(Settings->TCPPort), asio::ip::tcp::resolver::flags::numeric_service,
-        [this](const asio::error_code& error, const asio::ip::tcp::resolver::results_type& results)
+        [this, resolver](const asio::error_code& error, const asio::ip::tcp::resolver::results_type& results)
     {
         if (!!error)
             OnResolveError(error);
@@ -175,13 +212,6 @@ void SphynxClient::Loop()
             PostNextConnect();
         }
     });
-
-    Logger.Info("Client thread: Entering loop");
-
-    while (!Terminated)
-        Context->run();
-
-    Logger.Info("Client thread: Exiting loop");
 }
 
 void SphynxClient::OnUDPClose()
@@ -201,7 +231,7 @@ void SphynxClient::PostNextRecvFrom()
     UDPSocket->async_receive_from(asio::buffer(UDPReceiveBuffer), FromEndpoint, [this](
 		const asio::error_code& error, std::size_t bytes_transferred)
 	{
-		const u64 nowMsec = GetTimeMsec();
+		const u64 nowMsec = UpdateCachedTime() / 1000;
 
 		if (!!error)
 			OnUDPError(error);
@@ -212,7 +242,7 @@ void SphynxClient::PostNextRecvFrom()
 			Stream stream;
             stream.WrapRead(&UDPReceiveBuffer[0], bytes_transferred);
 
-			Logger.Trace("UDP: Got data len=", stream.GetRemaining());
+			SPHYNX_TRACE(Logger, "UDP: Got data len=", stream.GetRemaining());
 
 			OnUDPData(nowMsec, stream);
 
@@ -233,8 +263,13 @@ void SphynxClient::Start(const std::shared_ptr<ClientSettings>& settings)
 
     Cipher.InitializeEncryption(0, EncryptionRole::Client);
 
-    Context = std::make_shared<asio::io_context>();
-    Context->restart();
+    if (Settings->Context)
+        Context = Settings->Context;
+    else
+    {
+        Context = std::make_shared<asio::io_context>();
+        Context->restart();
+    }
 
     SphynxPeer::Start(Context);
     TCPSocket->open(asio::ip::tcp::v4());
@@ -252,7 +287,11 @@ void SphynxClient::Start(const std::shared_ptr<ClientSettings>& settings)
     TCPSocket->set_option(NoDelayOption);
 
     Terminated = false;
-    Thread = std::make_unique<std::thread>(&SphynxClient::Loop, this);
+
+    if (Settings->Context)
+        asio::post(*Context, [this]() { StartResolve(); });
+    else
+        Thread = std::make_unique<std::thread>(&SphynxClient::Loop, this);
 }
 
 void SphynxClient::OnResolveError(const asio::error_code& error)
@@ -298,7 +337,7 @@ void SphynxClient::OnConnect()
     Timer = std::make_unique<asio::steady_timer>(*Context);
     PostNextTimer();
 
-    PostNextTCPRead();
+    StartTCPReads();
 }
 
 void SphynxClient::Stop()
@@ -309,6 +348,10 @@ void SphynxClient::Stop()
 
     SphynxPeer::Stop();
 
+    // Cancels the pending receive, so that the client thread runs out of work
+    if (UDPSocket)
+        UDPSocket->close();
+
     if (Timer)
         Timer->cancel();
     if (Thread)
@@ -323,6 +366,75 @@ void SphynxClient::Stop()
         }
     }
     Thread = nullptr;
-    Context = nullptr;
     Timer = nullptr;
+
+    // A shared context still has sockets of other clients on it
+    if (!Settings || !Settings->Context)
+        Context = nullptr;
+}
+
+
+//-----------------------------------------------------------------------------
+// ClientThreadPool
+
+ClientThreadPool::~ClientThreadPool()
+{
+    Stop();
+}
+
+void ClientThreadPool::Start(unsigned threadCount)
+{
+    if (threadCount <= 0)
+        threadCount = std::thread::hardware_concurrency();
+    if (threadCount <= 0)
+        threadCount = 1;
+
+    Logger.Info("Starting ", threadCount, " client threads");
+
+    Threads.resize(threadCount);
+    for (PoolThread& thread : Threads)
+    {
+        thread.Context = std::make_shared<asio::io_context>();
+        thread.Work = std::make_unique<WorkGuard>(thread.Context->get_executor());
+
+        std::shared_ptr<asio::io_context> context = thread.Context;
+        thread.Thread = std::make_unique<std::thread>([context]()
+        {
+            SetThreadName("ClientPool");
+            context->run();
+        });
+    }
+}
+
+void ClientThreadPool::Stop()
+{
+    for (PoolThread& thread : Threads)
+    {
+        thread.Work = nullptr;
+        thread.Context->stop();
+    }
+
+    for (PoolThread& thread : Threads)
+    {
+        try
+        {
+            thread.Thread->join();
+        }
+        catch (std::system_error& err)
+        {
+            Logger.Warning("Exception while joining thread: ", err.what());
+        }
+    }
+
+    Threads.clear();
+}
+
+std::shared_ptr<asio::io_context> ClientThreadPool::GetNextContext()
+{
+    if (Threads.empty())
+    {
+        DEBUG_BREAK; return nullptr;
+    }
+
+    return Threads[NextContext++ % Threads.size()].Context;
 }
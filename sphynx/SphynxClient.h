@@ -34,6 +34,53 @@ struct ClientSettings
 
     // Client interface
     ClientInterface* Interface = nullptr;
+
+    // Suggested: null = The client runs its own thread and io_context.
+    // Otherwise the client runs on this context, which the caller keeps
+    // running, so that many clients can share a few threads.  Such clients
+    // must be destroyed after the context stops.  See ClientThreadPool
+    std::shared_ptr<asio::io_context> Context;
+};
+
+
+//-----------------------------------------------------------------------------
+// ClientThreadPool
+//
+// A few threads, each running its own io_context, for hosting thousands of
+// clients in one process, as a load generator does.  Each context is only
+// run by one thread, so the handlers of a client never run concurrently.
+
+class ClientThreadPool
+{
+public:
+    ClientThreadPool() {}
+    ~ClientThreadPool();
+
+    // No copies, please.
+    ClientThreadPool(const ClientThreadPool&) = delete;
+    ClientThreadPool& operator=(const ClientThreadPool&) = delete;
+
+    // 0 = Match CPU core count
+    void Start(unsigned threadCount = 0);
+
+    // Stop the contexts without running the remaining handlers
+    void Stop();
+
+    // Contexts are handed out round-robin
+    std::shared_ptr<asio::io_context> GetNextContext();
+
+protected:
+    typedef asio::executor_work_guard<asio::io_context::executor_type> WorkGuard;
+
+    struct PoolThread
+    {
+        std::shared_ptr<asio::io_context> Context;
+        std::unique_ptr<WorkGuard> Work;
+        std::unique_ptr<std::thread> Thread;
+    };
+
+    std::vector<PoolThread> Threads;
+    std::atomic<unsigned> NextContext{ 0 };
 };
 
 
@@ -72,8 +119,8 @@ protected:
 	std::unique_ptr<std::thread> Thread;
 	std::atomic_bool Terminated;
 
-	// Connection cookie
-	uint32_t ConnectionCookie = 0;
+	// Connection cookie.  Low 32 bits are the server's connection id
+	u64 ConnectionCookie = 0;
     std::atomic_bool SendingHandshakes;
     uint32_t LastHandshakeAttemptMsec = 0;
 
@@ -105,9 +152,12 @@ protected:
 
 	void PostNextTimer();
 	void Loop();
+	void StartResolve();
 	void OnTimerTick();
 	void OnTimerError(const asio::error_code& error);
 
+	int WriteUDPHeader(u8* end) override;
+
 	void OnUDPClose();
 	void OnUDPError(const asio::error_code& error);
 	void PostNextRecvFrom();
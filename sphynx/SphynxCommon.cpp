@@ -1,7 +1,23 @@
 #include "SphynxCommon.h"
+#include "Capture.h"
 
 static logging::Channel Logger("SphynxCommon");
 
+static MetricCounter& UDPSentDatagrams = GetMetrics().GetCounter("udp.sent_datagrams");
+static MetricCounter& UDPSentBytes = GetMetrics().GetCounter("udp.sent_bytes");
+static MetricCounter& UDPSendErrors = GetMetrics().GetCounter("udp.send_errors");
+static MetricCounter& UDPReceivedDatagrams = GetMetrics().GetCounter("udp.received_datagrams");
+static MetricCounter& UDPReceivedBytes = GetMetrics().GetCounter("udp.received_bytes");
+static MetricCounter& UDPInvalidDatagrams = GetMetrics().GetCounter("udp.invalid_datagrams");
+static MetricCounter& UDPDroppedTooLong = GetMetrics().GetCounter("udp.dropped_too_long");
+
+// Compression ratio is tcp.flush_bytes / tcp.compressed_bytes
+static MetricCounter& TCPFlushes = GetMetrics().GetCounter("tcp.flushes");
+static MetricCounter& TCPFlushBytes = GetMetrics().GetCounter("tcp.flush_bytes");
+static MetricCounter& TCPCompressedBytes = GetMetrics().GetCounter("tcp.compressed_bytes");
+static MetricCounter& TCPDroppedTooLong = GetMetrics().GetCounter("tcp.dropped_too_long");
+static MetricCounter& TCPDroppedQueueFull = GetMetrics().GetCounter("tcp.dropped_queue_full");
+
 
 //-----------------------------------------------------------------------------
 // WindowedTimes
@@ -37,7 +53,7 @@ void WindowedTimes::Insert(u64 remoteSendMsec, u64 localRecvMsec)
         static_assert(kWinCount == 2, "Need to change index update code");
         RingWriteIndex ^= 1;
 
-        Logger.Debug("Advanced to next time window index=", RingWriteIndex);
+        SPHYNX_DEBUG(Logger, "Advanced to next time window index=", RingWriteIndex);
 
         sample = BestRing + RingWriteIndex;
         sample->FirstMsec = localRecvMsec;
@@ -199,45 +215,399 @@ void Encryptor::InitializeEncryption(u32 key, EncryptionRole role)
 
 
 //-----------------------------------------------------------------------------
-// SphynxPeer
+// TCPStatePool
 
-SphynxPeer::SphynxPeer()
-	: UDPCallSender([this](Stream& stream) { PackUDP(stream); })
-	, TCPCallSender([this](Stream& stream) { PackTCP(stream); })
+// Contexts lent to states in shared mode, created on first use per thread
+struct ThreadTCPContexts
 {
-	IsFullConnection = false;
-	Disconnected = false;
+    ~ThreadTCPContexts()
+    {
+        if (Compression)
+            ZBUFF_freeCCtx(Compression);
+        if (Decompression)
+            ZSTD_freeDCtx(Decompression);
+    }
 
-    UDPOutBufferSize = kUDPPackingBufferSizeBytes;
-    UDPOutBuffer = std::make_unique<u8[]>(UDPOutBufferSize);
+    ZBUFF_CCtx* Compression = nullptr;
+    ZSTD_DCtx* Decompression = nullptr;
+};
 
-    TCPOutBufferSize = kTCPPackingBufferSizeBytes;
-    TCPOutBuffer = std::make_unique<u8[]>(TCPOutBufferSize);
+static std::atomic<u64> SharedContextBytes(0);
+static thread_local ThreadTCPContexts ThreadContexts;
 
-    DecompressedBufferSize = ZBUFF_recommendedDOutSize();
-    DecompressedBuffer = std::make_unique<u8[]>(DecompressedBufferSize);
+static ZSTD_customMem GetSharedContextMem()
+{
+    ZSTD_customMem customMem;
+    customMem.customAlloc = &TCPStatePool::CountedAlloc;
+    customMem.customFree = &TCPStatePool::CountedFree;
+    customMem.opaque = &SharedContextBytes;
+    return customMem;
+}
 
-    CompressionBufferSize = ZBUFF_recommendedCOutSize();
-    CompressionBuffer = std::make_unique<u8[]>(CompressionBufferSize);
+TCPSendState::TCPSendState(const ZSTD_customMem& customMem, bool sharedContext)
+    : CustomMem(customMem)
+{
+    OutBuffer = (u8*)CustomMem.customAlloc(CustomMem.opaque, kTCPPackingBufferSizeBytes);
 
-    DecompressionContext = ZBUFF_createDCtx();
-    ZBUFF_decompressInit(DecompressionContext);
+    // Output is drained in pieces, so this only needs to fit a typical flush
+    CompressionBufferSize = ZSTD_compressBound(kTCPPackingBufferSizeBytes);
+    CompressionBuffer = (u8*)CustomMem.customAlloc(CustomMem.opaque, CompressionBufferSize);
 
-    CompressionContext = ZBUFF_createCCtx();
+    if (!sharedContext)
+        Context = ZBUFF_createCCtx_advanced(CustomMem);
 }
 
-SphynxPeer::~SphynxPeer()
+TCPSendState::~TCPSendState()
+{
+    if (Context)
+        ZBUFF_freeCCtx(Context);
+    CustomMem.customFree(CustomMem.opaque, CompressionBuffer);
+    CustomMem.customFree(CustomMem.opaque, OutBuffer);
+}
+
+ZBUFF_CCtx* TCPSendState::GetContext()
+{
+    if (Context)
+        return Context;
+
+    if (!ThreadContexts.Compression)
+        ThreadContexts.Compression = ZBUFF_createCCtx_advanced(GetSharedContextMem());
+    return ThreadContexts.Compression;
+}
+
+TCPReceiveState::TCPReceiveState(const ZSTD_customMem& customMem, bool sharedContext)
+    : CustomMem(customMem)
+{
+    ReadBufferSize = ZSTD_compressBound(kTCPPackingBufferSizeBytes) + kTCPRecvLimitBytes;
+    ReadBuffer = (u8*)CustomMem.customAlloc(CustomMem.opaque, ReadBufferSize);
+
+    // Each frame holds one flush of at most kTCPPackingBufferSizeBytes, and
+    // frames that do not fit are rejected
+    DecompressedBufferSize = kTCPPackingBufferSizeBytes;
+    DecompressedBuffer = (u8*)CustomMem.customAlloc(CustomMem.opaque, DecompressedBufferSize);
+
+    if (!sharedContext)
+        Context = ZSTD_createDCtx_advanced(CustomMem);
+}
+
+TCPReceiveState::~TCPReceiveState()
+{
+    if (Context)
+        ZSTD_freeDCtx(Context);
+    CustomMem.customFree(CustomMem.opaque, DecompressedBuffer);
+    CustomMem.customFree(CustomMem.opaque, ReadBuffer);
+}
+
+ZSTD_DCtx* TCPReceiveState::GetContext()
+{
+    if (Context)
+        return Context;
+
+    if (!ThreadContexts.Decompression)
+        ThreadContexts.Decompression = ZSTD_createDCtx_advanced(GetSharedContextMem());
+    return ThreadContexts.Decompression;
+}
+
+TCPStatePool::TCPStatePool(bool sharedContexts)
+    : SharedContexts(sharedContexts)
+{
+    CustomMem.customAlloc = &TCPStatePool::CountedAlloc;
+    CustomMem.customFree = &TCPStatePool::CountedFree;
+    CustomMem.opaque = &AllocatedBytes;
+}
+
+TCPStatePool::~TCPStatePool()
+{
+    // Free before the byte counter goes away
+    FreeSendStates.clear();
+    FreeReceiveStates.clear();
+}
+
+void* TCPStatePool::CountedAlloc(void* opaque, size_t size)
+{
+    return ::CountedAlloc(static_cast<std::atomic<u64>*>(opaque), size);
+}
+
+void TCPStatePool::CountedFree(void* opaque, void* address)
+{
+    ::CountedFree(static_cast<std::atomic<u64>*>(opaque), address);
+}
+
+std::unique_ptr<TCPSendState> TCPStatePool::AcquireSend()
+{
+    std::unique_ptr<TCPSendState> state;
+    {
+        Locker locker(PoolLock);
+        if (!FreeSendStates.empty())
+        {
+            state = std::move(FreeSendStates.back());
+            FreeSendStates.pop_back();
+        }
+    }
+
+    if (!state)
+    {
+        state = std::make_unique<TCPSendState>(CustomMem, SharedContexts);
+        if (!state->OutBuffer || !state->CompressionBuffer || (!SharedContexts && !state->Context))
+        {
+            Logger.Warning("Out of memory for TCP send state");
+            DEBUG_BREAK; return nullptr;
+        }
+    }
+
+    ++SendStatesInUse;
+    return state;
+}
+
+std::unique_ptr<TCPReceiveState> TCPStatePool::AcquireReceive()
+{
+    std::unique_ptr<TCPReceiveState> state;
+    {
+        Locker locker(PoolLock);
+        if (!FreeReceiveStates.empty())
+        {
+            state = std::move(FreeReceiveStates.back());
+            FreeReceiveStates.pop_back();
+        }
+    }
+
+    if (!state)
+    {
+        state = std::make_unique<TCPReceiveState>(CustomMem, SharedContexts);
+        if (!state->ReadBuffer || !state->DecompressedBuffer || (!SharedContexts && !state->Context))
+        {
+            Logger.Warning("Out of memory for TCP receive state");
+            DEBUG_BREAK; return nullptr;
+        }
+    }
+
+    // A peer released while holding a partial frame leaves it behind
+    state->ReadUsed = 0;
+
+    ++ReceiveStatesInUse;
+    return state;
+}
+
+void TCPStatePool::Release(std::unique_ptr<TCPSendState> state)
+{
+    if (!state)
+        return;
+    --SendStatesInUse;
+
+    Locker locker(PoolLock);
+    if (FreeSendStates.size() < kTCPStatePoolLimit)
+        FreeSendStates.push_back(std::move(state));
+}
+
+void TCPStatePool::Release(std::unique_ptr<TCPReceiveState> state)
+{
+    if (!state)
+        return;
+    --ReceiveStatesInUse;
+
+    Locker locker(PoolLock);
+    if (FreeReceiveStates.size() < kTCPStatePoolLimit)
+        FreeReceiveStates.push_back(std::move(state));
+}
+
+void TCPStatePool::GetStats(TCPStateStats& stats) const
+{
+    stats.SendStatesInUse += SendStatesInUse;
+    stats.ReceiveStatesInUse += ReceiveStatesInUse;
+    stats.AllocatedBytes += AllocatedBytes;
+    stats.SharedContextBytes = SharedContextBytes;
+
+    Locker locker(PoolLock);
+    stats.PooledStates += static_cast<int>(FreeSendStates.size() + FreeReceiveStates.size());
+}
+
+
+//-----------------------------------------------------------------------------
+// TCP Frames
+
+bool CompressTCPFrame(ZBUFF_CCtx* context, u8* buffer, size_t bufferSize,
+    const u8* data, size_t bytes, const std::function<void(const u8*, int)>& send,
+    int compressionLevel)
+{
+    size_t destlen = 0;
+
+    // Size the window for this flush rather than for unknown-length input.
+    // At kCompressionLevel that keeps the context and the peer's decoder
+    // down to tens of KB instead of several MB
+    const ZSTD_parameters params = ZSTD_getParams(compressionLevel, bytes, 0);
+    const size_t ir = ZBUFF_compressInit_advanced(context, nullptr, 0, params, 0);
+    if (ZBUFF_isError(ir))
+    {
+        Logger.Warning("Compressor init failed, err=", ZSTD_getErrorName(ir), " #", ir);
+        DEBUG_BREAK; return false;
+    }
+
+	for (;;)
+	{
+		destlen = bufferSize;
+
+		size_t used = bytes;
+		size_t cr = ZBUFF_compressContinue(context, buffer, &destlen, data, &used);
+
+		if (destlen < 0 || ZBUFF_isError(cr) || used <= 0 || used > bytes)
+		{
+            Logger.Warning("Invalid send compressed data, err=", ZSTD_getErrorName(cr), " #", cr);
+			DEBUG_BREAK; return false;
+		}
+
+		if (used == bytes)
+			break;
+        if (destlen != 0)
+        {
+            Logger.Warning("Compressor did not use all data but also did not generate output");
+            DEBUG_BREAK; return false;
+        }
+
+        send(buffer, (int)destlen);
+
+		data += used;
+		bytes -= (int)used;
+	}
+
+	size_t offset = destlen;
+	for (;;)
+	{
+		size_t remaining = bufferSize - offset;
+		size_t written = remaining;
+        size_t cr = ZBUFF_compressEnd(context, buffer + offset, &written);
+
+		if (ZBUFF_isError(cr))
+		{
+            Logger.Warning("Invalid send end compressed data, err=", ZSTD_getErrorName(cr), " #", cr);
+			DEBUG_BREAK; return false;
+		}
+
+		offset += written;
+
+        send(buffer, (int)offset);
+
+		if (cr == 0)
+			break;
+
+		offset = 0;
+	}
+
+    return true;
+}
+
+int GetTCPFrameBytes(const u8* data, size_t bytes)
 {
-    if (CompressionContext)
+    static const size_t kDictIdBytes[4] = { 0, 1, 2, 4 };
+    static const size_t kContentSizeBytes[4] = { 0, 2, 4, 8 };
+    static const size_t kBlockHeaderBytes = 3;
+    static const size_t kChecksumBytes = 4;
+
+    if (bytes < ZSTD_frameHeaderSize_min)
+        return 0;
+
+    u32 magic;
+    memcpy(&magic, data, 4);
+    if (magic != ZSTD_MAGICNUMBER)
+        return -1;
+
+    // Frame header descriptor: See ZSTD_frameHeaderSize()
+    const u8 descriptor = data[4];
+    const unsigned singleSegment = (descriptor >> 5) & 1;
+    const size_t contentSizeBytes = kContentSizeBytes[descriptor >> 6];
+    const bool hasChecksum = ((descriptor >> 2) & 1) != 0;
+
+    size_t offset = ZSTD_frameHeaderSize_min + !singleSegment +
+        kDictIdBytes[descriptor & 3] + contentSizeBytes +
+        (singleSegment && !contentSizeBytes);
+
+    // Walk the block headers: See ZSTD_getcBlockSize()
+    for (;;)
     {
-        ZBUFF_freeCCtx(CompressionContext);
-        CompressionContext = nullptr;
+        if (bytes < offset + kBlockHeaderBytes)
+            return 0;
+
+        const u32 header = data[offset] | ((u32)data[offset + 1] << 8) | ((u32)data[offset + 2] << 16);
+        offset += kBlockHeaderBytes;
+
+        const unsigned blockType = (header >> 1) & 3;
+        if (blockType == 3) // Reserved
+            return -1;
+        offset += (blockType == 1) ? 1 : (header >> 3); // RLE blocks hold one byte
+
+        if (header & 1) // Last block
+            break;
     }
-    if (DecompressionContext)
+
+    if (hasChecksum)
+        offset += kChecksumBytes;
+
+    if (offset > bytes)
+        return 0;
+    return (int)offset;
+}
+
+int DecompressTCPFrames(ZSTD_DCtx* context, u8* buffer, size_t bufferSize,
+    const u8* data, size_t bytes, const std::function<void(Stream&)>& deliver)
+{
+    size_t used = 0;
+
+    while (used < bytes)
     {
-        ZBUFF_freeDCtx(DecompressionContext);
-        DecompressionContext = nullptr;
+        const int frameBytes = GetTCPFrameBytes(data + used, bytes - used);
+        if (frameBytes < 0)
+        {
+            Logger.Warning("Invalid compressed frame header");
+            return -1;
+        }
+        if (frameBytes == 0)
+            break; // Wait for the rest of the frame
+
+        // One shot: Decoded straight into the buffer with no stream state
+        const size_t zr = ZSTD_decompressDCtx(context, buffer, bufferSize, data + used, frameBytes);
+
+        if (ZSTD_isError(zr))
+        {
+            Logger.Warning("Invalid compressed data, err=", ZSTD_getErrorName(zr), " #", zr);
+            return -1;
+        }
+        if (zr <= 0)
+        {
+            Logger.Warning("Invalid compressed data, empty frame");
+            return -1;
+        }
+
+        used += frameBytes;
+
+		Stream stream;
+		stream.WrapRead(buffer, zr);
+		deliver(stream);
     }
+
+    return (int)used;
+}
+
+
+//-----------------------------------------------------------------------------
+// SphynxPeer
+
+SphynxPeer::SphynxPeer(const std::shared_ptr<std::atomic<u64>>& allocatedBytes)
+	: UDPCallSender([this](Stream& stream) { PackUDP(stream); })
+	, TCPCallSender([this](Stream& stream) { PackTCP(stream); })
+	, AllocatedBytes(allocatedBytes)
+{
+	IsFullConnection = false;
+	Disconnected = false;
+
+    UDPOutBufferSize = kUDPPackingBufferSizeBytes;
+    UDPOutBuffer = MakeCountedArray<u8>(AllocatedBytes.get(), UDPOutBufferSize);
+}
+
+SphynxPeer::~SphynxPeer()
+{
+    if (SendStatePool)
+        SendStatePool->Release(std::move(SendState));
+    if (ReceiveStatePool)
+        ReceiveStatePool->Release(std::move(ReceiveState));
 }
 
 void SphynxPeer::Start(std::shared_ptr<asio::io_context>& context)
@@ -257,19 +627,25 @@ void SphynxPeer::Stop()
     }
 }
 
-void SphynxPeer::SendUDP(const u8* data, int bytes)
+void SphynxPeer::SendUDP(const u8* data, int bytes, int plaintextBytes)
 {
 	if (bytes <= 0)
 	{
 		DEBUG_BREAK; return;
 	}
+	if (!UDPSocket)
+		return; // Replay peers have no sockets
 	uint8_t* packet = new (std::nothrow) uint8_t[bytes];
 	if (!packet)
 	{
 		DEBUG_BREAK; return;
 	}
 
-    Cipher.EncryptUDP(data, packet, bytes);
+    UDPSentDatagrams.Add();
+    UDPSentBytes.Add(bytes);
+
+    memcpy(packet, data, plaintextBytes);
+    Cipher.EncryptUDP(data + plaintextBytes, packet + plaintextBytes, bytes - plaintextBytes);
 
     UDPSocket->async_send_to(asio::buffer(packet, bytes), PeerUDPAddress,
 		[packet, this](const asio::error_code& error, std::size_t sentBytes)
@@ -282,76 +658,173 @@ void SphynxPeer::SendUDP(const u8* data, int bytes)
 
 void SphynxPeer::OnUDPSendError(const asio::error_code& error)
 {
-    Logger.Warning("UDP send error: ", error.message());
+    UDPSendErrors.Add();
+
+    static logging::RateLimit limit(kWarningRateLimit);
+    Logger.LogLimited(limit, logging::Level::Warning, "UDP send error: ", error.message());
 }
 
-void SphynxPeer::OnTCPRead(Stream& wholePacket)
+void SphynxPeer::OnTCPRead(size_t bytes)
 {
-    u8* data = (u8*)wholePacket.GetFront();
-    int dataSize = (int)wholePacket.GetRemaining();
-    Cipher.DecryptTCP(data, data, dataSize);
-
-    while (dataSize > 0)
-	{
-        size_t srcsz = dataSize, destsz = DecompressedBufferSize;
+    TCPReceiveState* state = ReceiveState.get();
 
-		size_t zr = ZBUFF_decompressContinue(DecompressionContext, &DecompressedBuffer[0], &destsz, data, &srcsz);
-
-        if (ZBUFF_isError(zr))
-        {
-            Logger.Warning("Invalid compressed data, err=", ZSTD_getErrorName(zr), " #", zr);
-            Disconnect();
-            DEBUG_BREAK; return;
-        }
-        if (zr != 0 || destsz <= 0)
-        {
-            Logger.Warning("Invalid compressed data, zr=", zr, ", destsz=", destsz);
-            Disconnect();
-            DEBUG_BREAK; return;
-        }
+    u8* data = state->ReadBuffer + state->ReadUsed;
+    Cipher.DecryptTCP(data, data, (int)bytes);
+    state->ReadUsed += bytes;
 
-        data += srcsz;
-        dataSize -= (int)srcsz;
+    ZSTD_DCtx* context = state->GetContext();
+    if (!context)
+    {
+        Logger.Warning("Out of memory for TCP decompression context");
+        Disconnect();
+        DEBUG_BREAK; return;
+    }
 
-		Stream stream;
-		stream.WrapRead(&DecompressedBuffer[0], destsz);
-		OnTCPData(stream);
+    const int used = DecompressTCPFrames(context, state->DecompressedBuffer, state->DecompressedBufferSize,
+        state->ReadBuffer, state->ReadUsed, [this](Stream& stream) { OnTCPData(stream); });
+    if (used < 0)
+    {
+        Disconnect();
+        return;
+    }
 
-        ZBUFF_decompressInit(DecompressionContext);
+    // Move a partial frame to the front for the next read to complete.  It
+    // must leave room for a whole read, which fits any valid frame
+    const size_t remaining = state->ReadUsed - used;
+    if (remaining > state->ReadBufferSize - kTCPRecvLimitBytes)
+    {
+        Logger.Warning("Compressed frame too large: Disconnecting");
+        Disconnect();
+        return;
     }
+    if (remaining > 0 && used > 0)
+        memmove(state->ReadBuffer, state->ReadBuffer + used, remaining);
+    state->ReadUsed = remaining;
 }
 
 void SphynxPeer::PackTCP(Stream& stream)
 {
-    if (stream.GetUsed() > TCPOutBufferSize)
+    if (stream.GetUsed() > kTCPMessageMaxBytes)
     {
-        Logger.Warning("Dropped outgoing TCP packet that was too long");
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "Dropped outgoing TCP packet that was too long");
+        TCPDroppedTooLong.Add();
         DEBUG_BREAK; return;
     }
 
+    CountSentCall(stream, CallTransport::TCP);
+
 	Locker locker(TCPFlushLock);
-	if (TCPOutUsed + stream.GetUsed() > TCPOutBufferSize)
+	if (!SendState)
+	{
+		SendState = StatePool->AcquireSend();
+		if (!SendState)
+			return;
+		SendStatePool = StatePool;
+	}
+	if (stream.GetUsed() > kTCPPackingBufferSizeBytes)
+	{
+		PackTCPChunks(stream);
+		return;
+	}
+	if (TCPOutUsed + stream.GetUsed() > kTCPPackingBufferSizeBytes)
 	{
 		FlushUDP();
 		FlushTCP();
 	}
-	memcpy(&TCPOutBuffer[0] + TCPOutUsed, stream.GetFront(), stream.GetUsed());
+	const bool wasEmpty = (TCPOutUsed == 0);
+	stream.CopyTo(SendState->OutBuffer + TCPOutUsed);
 	TCPOutUsed += stream.GetUsed();
+
+	if (wasEmpty)
+		OnNeedsTick();
+}
+
+void SphynxPeer::PackTCPChunks(Stream& stream)
+{
+    // Chunk header: Call id, message size, and the vector_view count and length
+    static const int kChunkHeaderBytes = 1 + 4 + 4 + 4;
+
+    // Do not start a chunk in less room than this
+    static const int kChunkMinBytes = 1000;
+
+    const u32 messageBytes = (u32)stream.GetUsed();
+
+    // Chunks are compressed and queued as they are packed, so a peer that
+    // is not reading would otherwise let large messages pile up
+    if (GetTCPSendQueueBytes() + messageBytes > kTCPSendQueueLimitBytes)
+    {
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "Dropped outgoing large TCP message: Send queue is full");
+        TCPDroppedQueueFull.Add();
+        return;
+    }
+
+    const bool wasEmpty = (TCPOutUsed == 0);
+
+    // Feed each segment of the message through the packing buffer
+    const int segmentCount = stream.GetSegmentCount();
+    for (int i = 0; i < segmentCount; ++i)
+    {
+        int bytes = 0;
+        const u8* data = stream.GetSegment(i, bytes);
+
+        while (bytes > 0)
+        {
+            int room = kTCPPackingBufferSizeBytes - (int)TCPOutUsed - kChunkHeaderBytes;
+            if (room < kChunkMinBytes)
+            {
+                FlushUDP();
+                FlushTCP();
+                room = kTCPPackingBufferSizeBytes - kChunkHeaderBytes;
+            }
+
+            const int chunkBytes = bytes < room ? bytes : room;
+
+            Stream chunk;
+            chunk.WrapWrite(SendState->OutBuffer + TCPOutUsed, kChunkHeaderBytes + chunkBytes);
+            u8 callId = static_cast<u8>(TCPChunkID);
+            chunk.Serialize(callId);
+            chunk.Serialize(messageBytes);
+            chunk.Serialize(vector_view<const u8>(data, chunkBytes));
+            if (!chunk.Good() || chunk.IsDynamic())
+            {
+                DEBUG_BREAK; return;
+            }
+            TCPOutUsed += chunk.GetUsed();
+
+            data += chunkBytes;
+            bytes -= chunkBytes;
+        }
+    }
+
+    // The last chunk goes out with the next flush
+    if (wasEmpty && TCPOutUsed > 0)
+        OnNeedsTick();
 }
 
 void SphynxPeer::PackUDP(Stream& stream)
 {
-    if (stream.GetUsed() > UDPOutBufferSize)
+    // The front of the buffer is held for the header and timestamp
+    if ((size_t)stream.GetUsed() > UDPOutBufferSize - UDPOutReserved)
     {
-        Logger.Warning("Dropped outgoing UDP packet that was too long");
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "Dropped outgoing UDP packet that was too long");
+        UDPDroppedTooLong.Add();
         DEBUG_BREAK; return;
     }
 
+    CountSentCall(stream, CallTransport::UDP);
+
     Locker locker(UDPFlushLock);
 	if (UDPOutUsed + stream.GetUsed() > UDPOutBufferSize)
 		FlushUDP();
-	memcpy(&UDPOutBuffer[0] + UDPOutUsed, stream.GetFront(), stream.GetUsed());
+	const bool wasEmpty = (UDPOutUsed <= UDPOutReserved);
+	stream.CopyTo(&UDPOutBuffer[0] + UDPOutUsed);
 	UDPOutUsed += stream.GetUsed();
+
+	if (wasEmpty)
+		OnNeedsTick();
 }
 
 void SphynxPeer::Flush()
@@ -360,9 +833,33 @@ void SphynxPeer::Flush()
 	FlushTCP();
 }
 
+void SphynxPeer::EnableCallStats(const std::shared_ptr<CallStats>& parent)
+{
+	Stats = MakeCounted<CallStats>(AllocatedBytes.get(), parent, 1, AllocatedBytes.get());
+}
+
+void SphynxPeer::SetCapture(const std::shared_ptr<CaptureWriter>& capture)
+{
+	Locker locker(CaptureLock);
+
+	Capture = capture;
+	if (Capture)
+		CaptureSource = Capture->AddSource();
+	Capturing = (Capture != nullptr);
+}
+
+void SphynxPeer::captureInbound(CaptureType type, const u8* data, int bytes)
+{
+	Locker locker(CaptureLock);
+
+	if (Capture)
+		Capture->Write(CaptureSource, type, data, bytes);
+}
+
 void SphynxPeer::Disconnect()
 {
-	Disconnected = true;
+	if (!Disconnected.exchange(true))
+		OnNeedsTick();
 }
 
 bool SphynxPeer::IsDisconnected() const
@@ -374,65 +871,57 @@ void SphynxPeer::FlushTCP()
 {
 	Locker locker(TCPFlushLock);
 
-	u8* data = &TCPOutBuffer[0];
-	size_t bytes = TCPOutUsed;
+	const size_t bytes = TCPOutUsed;
 	if (bytes <= 0)
 		return;
 
 	TCPOutUsed = 0;
-	size_t destlen = 0;
+	LastTCPSendMsec = GetTimeMsec();
 
-    ZBUFF_compressInit(CompressionContext, kCompressionLevel);
+	TCPFlushes.Add();
+	TCPFlushBytes.Add(bytes);
 
-	for (;;)
+	ZBUFF_CCtx* context = SendState->GetContext();
+	if (!context)
 	{
-		destlen = CompressionBufferSize;
-
-		size_t used = bytes;
-		size_t cr = ZBUFF_compressContinue(CompressionContext, &CompressionBuffer[0], &destlen, data, &used);
-
-		if (destlen < 0 || ZBUFF_isError(cr) || used <= 0 || used > bytes)
-		{
-            Logger.Warning("Invalid send compressed data, err=", ZSTD_getErrorName(cr), " #", cr);
-			DEBUG_BREAK; return;
-		}
-
-		if (used == bytes)
-			break;
-        if (destlen != 0)
-        {
-            Logger.Warning("Compressor did not use all data but also did not generate output");
-            DEBUG_BREAK; return;
-        }
-
-        SendTCP(&CompressionBuffer[0], (int)destlen);
-
-		data += used;
-		bytes -= (int)used;
+		Logger.Warning("Out of memory for TCP compression context");
+		DEBUG_BREAK; return;
 	}
 
-	size_t offset = destlen;
-	for (;;)
+	CompressTCPFrame(context, SendState->CompressionBuffer, SendState->CompressionBufferSize,
+		SendState->OutBuffer, bytes, [this](const u8* data, int dataBytes)
 	{
-		size_t remaining = (size_t)CompressionBufferSize - offset;
-		size_t written = remaining;
-        size_t cr = ZBUFF_compressEnd(CompressionContext, &CompressionBuffer[0] + offset, &written);
+		TCPCompressedBytes.Add(dataBytes);
+		SendTCP(data, dataBytes);
+	});
+}
 
-		if (ZBUFF_isError(cr))
-		{
-            Logger.Warning("Invalid send end compressed data, err=", ZSTD_getErrorName(cr), " #", cr);
-			DEBUG_BREAK; return;
-		}
+void SphynxPeer::SendTCPImmediate(Stream& stream)
+{
+    // Handshake-sized messages only: Compressed on the stack
+    static const int kMaxImmediateBytes = 64;
+    u8 compressed[1024]; // Above ZSTD_compressBound(kMaxImmediateBytes) = 588
 
-		offset += written;
+    if (stream.GetUsed() > kMaxImmediateBytes)
+    {
+        Logger.Warning("Dropped outgoing immediate TCP packet that was too long");
+        TCPDroppedTooLong.Add();
+        DEBUG_BREAK; return;
+    }
 
-        SendTCP(&CompressionBuffer[0], (int)offset);
+    // One-shot compression frees its workspace before returning, and the
+    // frame decodes the same as the streaming compressor's
+    const size_t destlen = ZSTD_compress(compressed, sizeof(compressed), stream.GetFront(), stream.GetUsed(), 1);
+    if (ZSTD_isError(destlen))
+    {
+        Logger.Warning("Invalid immediate compressed data, err=", ZSTD_getErrorName(destlen), " #", destlen);
+        DEBUG_BREAK; return;
+    }
 
-		if (cr == 0)
-			break;
+    CountSentCall(stream, CallTransport::TCP);
 
-		offset = 0;
-	}
+    Locker locker(TCPFlushLock);
+    SendTCP(compressed, (int)destlen);
 }
 
 void SphynxPeer::SendTCP(const u8* data, int bytes)
@@ -441,6 +930,8 @@ void SphynxPeer::SendTCP(const u8* data, int bytes)
 	{
 		DEBUG_BREAK; return;
 	}
+	if (!TCPSocket)
+		return; // Replay peers have no sockets
 	uint8_t* packet = new (std::nothrow) uint8_t[bytes];
 	if (!packet)
 	{
@@ -449,105 +940,374 @@ void SphynxPeer::SendTCP(const u8* data, int bytes)
 
     Cipher.EncryptTCP(data, packet, bytes);
 
-    TCPSocket->async_send(asio::buffer(packet, bytes),
-		[packet, this](const asio::error_code& error, std::size_t sentBytes)
-	{
-		delete[] packet;
-		if (!!error)
-			OnTCPSendError(error);
-	});
+    Locker locker(TCPSendLock);
+
+    if (TCPWriteFailed)
+    {
+        delete[] packet;
+        return;
+    }
+
+    TCPSendQueue.emplace_back(packet);
+    TCPSendQueueBuffers.push_back(asio::buffer(packet, bytes));
+    TCPSendQueueBytes += bytes;
+
+    if (!TCPWriteInProgress)
+        PostNextTCPWrite();
+}
+
+void SphynxPeer::PostNextTCPWrite()
+{
+    // Called with TCPSendLock held
+    TCPWriting.swap(TCPSendQueue);
+    TCPWritingBuffers.swap(TCPSendQueueBuffers);
+    TCPWritingBytes = asio::buffer_size(TCPWritingBuffers);
+    TCPWriteInProgress = true;
+
+    asio::async_write(*TCPSocket, TCPWritingBuffers,
+        [this](const asio::error_code& error, std::size_t writtenBytes)
+    {
+        OnTCPWritten(error);
+    });
+}
+
+void SphynxPeer::OnTCPWritten(const asio::error_code& error)
+{
+    Locker locker(TCPSendLock);
+
+    TCPWriting.clear();
+    TCPWritingBuffers.clear();
+    TCPSendQueueBytes -= TCPWritingBytes;
+    TCPWritingBytes = 0;
+    TCPWriteInProgress = false;
+
+    if (!!error)
+    {
+        // The stream is broken after a partial write: Stop sending
+        TCPWriteFailed = true;
+        TCPSendQueue.clear();
+        TCPSendQueueBuffers.clear();
+        TCPSendQueueBytes = 0;
+
+        OnTCPSendError(error);
+        Disconnect();
+        return;
+    }
+
+    if (!TCPSendQueue.empty())
+        PostNextTCPWrite();
+}
+
+size_t SphynxPeer::GetTCPSendQueueBytes()
+{
+    Locker locker(TCPSendLock);
+    return TCPSendQueueBytes;
 }
 
 void SphynxPeer::FlushUDP()
 {
 	Locker locker(UDPFlushLock);
 
-	u8* data = &UDPOutBuffer[0];
+	const int reserved = (int)UDPOutReserved;
 	int bytes = (int)UDPOutUsed;
 
-	UDPOutUsed = 2;
+	UDPOutUsed = reserved;
 
-	if (bytes <= 2)
+	if (bytes <= reserved)
 		return;
 
+	// Timestamp goes right after the header room
+	u8* data = &UDPOutBuffer[0] + reserved - 2;
 	*(u16*)data = (u16)GetTimeMsec();
+	bytes -= reserved - 2;
 
-	SendUDP(data, bytes);
+	const int headerBytes = WriteUDPHeader(data);
+
+	SendUDP(data - headerBytes, bytes + headerBytes, headerBytes);
 }
 
 void SphynxPeer::OnTCPData(Stream& stream)
 {
-	RouteData(stream);
+	if (Capturing)
+		captureInbound(CaptureType::TCP, stream.GetFront(), stream.GetBufferSize());
+
+	// Chunks are taken off here rather than by the router, so that only
+	// the TCP stream can reach the message being reassembled
+	while (stream.GetRemaining() > 0)
+	{
+		if (stream.GetFront()[stream.GetUsed()] != TCPChunkID)
+		{
+			if (!Router.Call(stream, Stats.get(), CallTransport::TCP))
+				break;
+			continue;
+		}
+
+		const int startUsed = stream.GetUsed();
+
+		u8 callId = 0;
+		u32 messageBytes = 0;
+		vector_view<const u8> data;
+		if (!stream.Serialize(callId) || !stream.Serialize(messageBytes) || !stream.Serialize(data) ||
+			!OnTCPChunk(messageBytes, data))
+		{
+			static logging::RateLimit limit(kWarningRateLimit);
+			Logger.LogLimited(limit, logging::Level::Warning, "Invalid TCP message chunk: Disconnecting");
+			Disconnect();
+			break;
+		}
+
+		if (Stats)
+			Stats->Add(CallDirection::Received, CallTransport::TCP, TCPChunkID, stream.GetUsed() - startUsed);
+	}
 }
 
-void SphynxPeer::OnUDPData(u64 nowMsec, Stream& rawStream)
+bool SphynxPeer::OnTCPChunk(u32 messageBytes, vector_view<const u8> data)
+{
+    // The first chunk announces the size, and the rest must agree with it
+    if (TCPMessage.empty())
+    {
+        if (messageBytes <= (u32)kTCPPackingBufferSizeBytes || messageBytes > (u32)kTCPMessageMaxBytes)
+            return false;
+
+        TCPMessageBytes = messageBytes;
+        TCPMessage.reserve(messageBytes);
+    }
+    else if (messageBytes != TCPMessageBytes)
+        return false;
+
+    // TCPMessage is always shorter than TCPMessageBytes here
+    if (data.size() == 0 || data.size() > TCPMessageBytes - TCPMessage.size())
+        return false;
+
+    TCPMessage.insert(TCPMessage.end(), data.begin(), data.end());
+
+    if (TCPMessage.size() < TCPMessageBytes)
+        return true;
+
+    // Take the buffer so handlers may start the next message.  Its memory
+    // is given back afterwards: Large messages are rare
+    std::vector<u8> message;
+    message.swap(TCPMessage);
+
+    Stream stream;
+    stream.WrapRead(message.data(), message.size());
+    RouteData(stream, CallTransport::TCP);
+    return true;
+}
+
+bool SphynxPeer::OnUDPData(u64 nowMsec, Stream& rawStream)
+{
+    DecryptUDPData(rawStream);
+    return OnUDPDecrypted(nowMsec, rawStream.GetFront(), rawStream.GetBufferSize());
+}
+
+void SphynxPeer::DecryptUDPData(Stream& rawStream)
 {
     u8* data = rawStream.GetFront();
     int dataSize = rawStream.GetBufferSize();
     Cipher.DecryptUDP(data, data, dataSize);
 
+    UDPReceivedDatagrams.Add();
+    UDPReceivedBytes.Add(dataSize);
+}
+
+bool SphynxPeer::OnUDPDecrypted(u64 nowMsec, const u8* data, int dataSize)
+{
+    if (Capturing)
+        captureInbound(CaptureType::UDP, data, dataSize);
+
+    return OnUDPPlaintext(nowMsec, data, dataSize);
+}
+
+bool SphynxPeer::IsNextUDPDatagram(u64 nowMsec, const u8* data, int dataSize) const
+{
+    // Nothing to compare against before the first datagram
+    if (LastUDPReceiveLocalMsec == 0)
+        return false;
+
     Stream stream;
     stream.WrapRead(data, dataSize);
 
-	u16 partialTime;
+    u16 partialTime = 0;
+    if (!stream.Serialize(partialTime))
+        return false;
+
+    // Expand the timestamp around the remote time expected now rather than
+    // the last one received, so that old datagrams cannot wrap into the
+    // future.  One that is a multiple of 65.5 seconds old can still land in
+    // the window, which is why the window is kept narrow
+    const u64 elapsedMsec = nowMsec - LastUDPReceiveLocalMsec;
+    const u64 expectedMsec = LastUDPReceiveRemoteMsec + elapsedMsec;
+    const u64 sentTime = ReconstructCounter16(expectedMsec, partialTime);
+
+    const s64 aheadMsec = (s64)(sentTime - expectedMsec);
+    return (s64)(sentTime - LastUDPReceiveRemoteMsec) > 0 &&
+        aheadMsec >= -kS2CUDPMigrateWindowMsec && aheadMsec <= kS2CUDPMigrateWindowMsec;
+}
+
+bool SphynxPeer::OnUDPPlaintext(u64 nowMsec, const u8* data, int dataSize)
+{
+    Stream stream;
+    stream.WrapRead(data, dataSize);
+
+	u16 partialTime = 0;
 	if (!stream.Serialize(partialTime))
-		return;
+	{
+		UDPInvalidDatagrams.Add();
+		return false;
+	}
 
-	if (RouteData(stream))
+	if (RouteData(stream, CallTransport::UDP))
 	{
 		LastReceiveLocalMsec = nowMsec;
+		LastUDPReceiveLocalMsec = nowMsec;
 
 		// Only use timestamps if the rest of the data is not invalid
 		u64 sentTime = ReconstructCounter16(LastUDPReceiveRemoteMsec, partialTime);
 		LastUDPReceiveRemoteMsec = sentTime;
 		WinTimes.Insert(sentTime, nowMsec);
+		return true;
 	}
+
+	UDPInvalidDatagrams.Add();
+	return false;
 }
 
-bool SphynxPeer::RouteData(Stream& stream)
+bool SphynxPeer::RouteData(Stream& stream, CallTransport transport)
 {
     bool success = false;
 
-    while (Router.Call(stream))
+    while (Router.Call(stream, Stats.get(), transport))
         success = true;
 
-	return success;
+    return success;
 }
 
-void SphynxPeer::PostNextTCPRead()
+void SphynxPeer::StartTCPReads()
 {
-	auto mutableBuffer = TCPReceiveStreamBuf.prepare(kTCPRecvLimitBytes);
+	asio::error_code error;
+	TCPSocket->non_blocking(true, error);
+	if (!!error)
+	{
+		OnTCPReadError(error);
+		return;
+	}
 
-	TCPSocket->async_read_some(mutableBuffer, [this](
-		const asio::error_code& error, std::size_t bytes_transferred)
+	PostNextTCPRead();
+}
+
+void SphynxPeer::PostNextTCPRead()
+{
+	TCPSocket->async_wait(asio::ip::tcp::socket::wait_read, [this](const asio::error_code& error)
 	{
 		if (!!error)
 			OnTCPReadError(error);
-		else if (bytes_transferred <= 0)
-			OnTCPClose();
 		else
+			OnTCPReadable();
+	});
+}
+
+void SphynxPeer::OnTCPReadable()
+{
+	Locker locker(TCPReceiveLock);
+
+	if (!ReceiveState)
+	{
+		ReceiveState = StatePool->AcquireReceive();
+		if (!ReceiveState)
 		{
-            Stream packet;
-            packet.WrapRead(TCPReceiveStreamBuf.data().data(), bytes_transferred);
+			Disconnect();
+			return;
+		}
+		ReceiveStatePool = StatePool;
+	}
+	LastTCPReceiveMsec = UpdateCachedTime() / 1000;
+
+	// The socket is non-blocking, so a spurious wake-up returns would_block
+	asio::error_code error;
+	u8* readBuffer = ReceiveState->ReadBuffer + ReceiveState->ReadUsed;
+	const size_t bytes = TCPSocket->read_some(asio::buffer(readBuffer, kTCPRecvLimitBytes), error);
+
+	if (error == asio::error::would_block)
+		PostNextTCPRead(); // Spurious wake-up
+	else if (!!error)
+		OnTCPReadError(error);
+	else if (bytes <= 0)
+		OnTCPClose();
+	else
+	{
+		OnTCPRead(bytes);
+
+		if (!IsDisconnected())
+			PostNextTCPRead();
+	}
+}
+
+void SphynxPeer::SetTCPStatePool(const std::shared_ptr<TCPStatePool>& pool)
+{
+	// Same order as a read that packs a reply
+	Locker receiveLocker(TCPReceiveLock);
+	Locker flushLocker(TCPFlushLock);
+	StatePool = pool;
+}
 
-            OnTCPRead(packet);
+u64 SphynxPeer::ReleaseIdleTCPState(u64 nowMsec)
+{
+	// Signed compares below: Traffic times may be a little newer than nowMsec
 
-            TCPReceiveStreamBuf.consume(bytes_transferred);
+	u64 retryMsec = 0;
 
-            PostNextTCPRead();
+	{
+		Locker locker(TCPFlushLock);
+		if (SendState)
+		{
+			if (TCPOutUsed == 0 && (s64)(nowMsec - LastTCPSendMsec) >= kTCPIdleReleaseMsec)
+			{
+				SendStatePool->Release(std::move(SendState));
+				SendStatePool.reset();
+			}
+			else
+				retryMsec = LastTCPSendMsec + kTCPIdleReleaseMsec;
 		}
-	});
+	}
+
+	// A read in progress is not idle, so do not wait for it
+	u64 receiveRetryMsec = 0;
+	if (!TCPReceiveLock.TryEnter())
+		receiveRetryMsec = nowMsec + kTCPIdleReleaseMsec;
+	else
+	{
+		if (ReceiveState)
+		{
+			if ((s64)(nowMsec - LastTCPReceiveMsec) < kTCPIdleReleaseMsec)
+				receiveRetryMsec = LastTCPReceiveMsec + kTCPIdleReleaseMsec;
+			else if (ReceiveState->ReadUsed != 0)
+				receiveRetryMsec = nowMsec + kTCPIdleReleaseMsec; // Holding a partial frame
+			else
+			{
+				ReceiveStatePool->Release(std::move(ReceiveState));
+				ReceiveStatePool.reset();
+			}
+		}
+		TCPReceiveLock.Leave();
+	}
+
+	if (retryMsec == 0 || (receiveRetryMsec != 0 && (s64)(receiveRetryMsec - retryMsec) < 0))
+		retryMsec = receiveRetryMsec;
+	return retryMsec;
 }
 
 void SphynxPeer::OnTCPReadError(const asio::error_code& error)
 {
-    Logger.Warning("TCP read error: ", error.message());
+    static logging::RateLimit limit(kWarningRateLimit);
+    Logger.LogLimited(limit, logging::Level::Warning, "TCP read error: ", error.message());
 	Disconnect();
 }
 
 void SphynxPeer::OnTCPSendError(const asio::error_code& error)
 {
-    Logger.Warning("TCP send error: ", error.message());
+    static logging::RateLimit limit(kWarningRateLimit);
+    Logger.LogLimited(limit, logging::Level::Warning, "TCP send error: ", error.message());
 	Disconnect();
 }
 
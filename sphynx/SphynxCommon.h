@@ -7,7 +7,7 @@
 #include "Logging.h"
 #include "Stream.h"
 #include "RPC.h"
-#include "zstd/zstd.h"
+#define ZBUFF_STATIC_LINKING_ONLY /* ZBUFF_createCCtx_advanced, ZSTD_getParams */
 #include "zstd/zbuff.h"
 
 
@@ -39,9 +39,30 @@ static const int kS2CUDPTimeSyncFastCount = 10; // 10 count
 static const int kS2CTimeoutMsec = 40000; // 40 seconds
 static const int kC2STimeoutMsec = 40000; // 40 seconds
 
+// Time allowed between TCP accept and UDP handshake
+static const int kS2CHandshakeTimeoutMsec = 10000; // 10 seconds
+
+// Handshake cookies are valid for one to two of these
+static const int kCookieBucketMsec = 10000; // 10 seconds
+
+// Minimum time between UDP address changes for one connection
+static const int kS2CUDPMigrateIntervalMsec = 1000; // 1 second
+
+// A datagram from a new client address must be stamped within this much of
+// the remote time expected on arrival
+static const int kS2CUDPMigrateWindowMsec = 2000; // 2 seconds
+
 // UDP datagram max size
 static const int kUDPDatagramMax = 490;
 
+// Client-to-server UDP datagrams start with a plaintext flags byte.
+// If this flag is set, the flags are followed by the u64 connection cookie,
+// whose low 32 bits are the connection id, so the server can find the
+// connection without an endpoint lookup and follow the client across
+// address changes
+static const u8 kC2SUDPFlagConnectionId = 1;
+static const int kC2SUDPHeaderMaxBytes = 1 + 8;
+
 // Time between client sending UDP handshakes
 static const int kClientHandshakeIntervalMsec = 100; // msec
 
@@ -49,9 +70,36 @@ static const int kClientHandshakeIntervalMsec = 100; // msec
 static const int kUDPPackingBufferSizeBytes = kUDPDatagramMax; // in bytes
 static const int kTCPPackingBufferSizeBytes = 16000; // in bytes
 
+// Largest TCP message, which is sent as chunks that each fit the packing
+// buffer and is reassembled by the receiver
+static const int kTCPMessageMaxBytes = 4000000; // in bytes
+
+// Encrypted TCP data waiting to be written before large messages are dropped
+static const size_t kTCPSendQueueLimitBytes = 8000000; // in bytes
+
 // Compression level to use for TCP packet compression
 static const int kCompressionLevel = 9;
 
+// Time without TCP traffic before a peer hands its TCP buffers and
+// compression contexts back to its pool
+static const int kTCPIdleReleaseMsec = 2000; // 2 seconds
+
+// Number of idle TCP send and receive states each pool keeps for reuse
+static const int kTCPStatePoolLimit = 64;
+
+// Messages per second from each rate-limited warning, e.g. per-packet errors
+static const int kWarningRateLimit = 10;
+
+
+//-----------------------------------------------------------------------------
+// Shared Protocol
+
+// Piece of a TCP message that is larger than the packing buffer.  Taken off
+// the TCP stream by SphynxPeer::OnTCPData() rather than routed, so that it
+// cannot arrive any other way
+typedef void TCPChunkT(u32 messageBytes, vector_view<const u8> data);
+static const int TCPChunkID = 252;
+
 
 //-----------------------------------------------------------------------------
 // S2C Protocol
@@ -62,14 +110,14 @@ static const int S2CHeartbeatID = 255;
 typedef void S2CTimeSyncT(u16 bestC2Sdelta);
 static const int S2CTimeSyncID = 254;
 
-typedef void S2CTCPHandshakeT(u32 cookie, u16 udpPort);
+typedef void S2CTCPHandshakeT(u64 cookie, u16 udpPort);
 static const int S2CTCPHandshakeID = 253;
 
 
 //-----------------------------------------------------------------------------
 // C2S Protocol
 
-typedef void C2SUDPHandshakeT(u32 cookie);
+typedef void C2SUDPHandshakeT(u64 cookie);
 static const int C2SUDPHandshakeID = 255;
 
 typedef void C2SHeartbeatT(u16 sendTime);
@@ -149,15 +197,163 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// TCPStatePool
+//
+// TCP packing and compression buffers and the zstd contexts only need to be
+// held by peers that have TCP traffic in flight.  Peers acquire them from a
+// pool on first use and release them after kTCPIdleReleaseMsec without TCP
+// traffic.  Every byte they hold, zstd internals included, is allocated
+// through the pool so that it can be reported.
+//
+// Frames are independent: Each flush is one frame, and frames are only
+// decompressed once they have been received whole.  So in shared mode the
+// states hold no zstd contexts and instead
+// borrow the contexts of the thread doing the work, which is the worker
+// thread running the tick or socket handler.  This trades one context pair
+// per active peer for one per thread, and keeps the zstd tables hot.
+
+struct TCPSendState
+{
+    TCPSendState(const ZSTD_customMem& customMem, bool sharedContext);
+    ~TCPSendState();
+
+    // No copies, please.
+    TCPSendState(const TCPSendState&) = delete;
+    TCPSendState& operator=(const TCPSendState&) = delete;
+
+    const ZSTD_customMem CustomMem;
+
+    // Packing buffer of kTCPPackingBufferSizeBytes
+    u8* OutBuffer = nullptr;
+
+    u8* CompressionBuffer = nullptr;
+    size_t CompressionBufferSize = 0;
+
+    // Own context, or null to borrow the thread's context
+    ZBUFF_CCtx* Context = nullptr;
+
+    // Returns null if out of memory
+    ZBUFF_CCtx* GetContext();
+};
+
+struct TCPReceiveState
+{
+    TCPReceiveState(const ZSTD_customMem& customMem, bool sharedContext);
+    ~TCPReceiveState();
+
+    // No copies, please.
+    TCPReceiveState(const TCPReceiveState&) = delete;
+    TCPReceiveState& operator=(const TCPReceiveState&) = delete;
+
+    const ZSTD_customMem CustomMem;
+
+    // Socket reads land after any partial frame left by the last read.
+    // Room for the largest frame plus one read
+    u8* ReadBuffer = nullptr;
+    size_t ReadBufferSize = 0;
+    size_t ReadUsed = 0;
+
+    // Frames are decompressed here in one shot and handed to handlers in place
+    u8* DecompressedBuffer = nullptr;
+    size_t DecompressedBufferSize = 0;
+
+    // Own context, or null to borrow the thread's context
+    ZSTD_DCtx* Context = nullptr;
+
+    // Returns null if out of memory
+    ZSTD_DCtx* GetContext();
+};
+
+struct TCPStateStats
+{
+    // States held by peers
+    int SendStatesInUse = 0;
+    int ReceiveStatesInUse = 0;
+
+    // States waiting in pools
+    int PooledStates = 0;
+
+    // Bytes held by all of the states above
+    u64 AllocatedBytes = 0;
+
+    // Bytes held by thread contexts in shared mode, for the whole process
+    u64 SharedContextBytes = 0;
+};
+
+class TCPStatePool
+{
+public:
+    explicit TCPStatePool(bool sharedContexts = false);
+    ~TCPStatePool();
+
+    // No copies, please.
+    TCPStatePool(const TCPStatePool&) = delete;
+    TCPStatePool& operator=(const TCPStatePool&) = delete;
+
+    // Returns null if out of memory
+    std::unique_ptr<TCPSendState> AcquireSend();
+    std::unique_ptr<TCPReceiveState> AcquireReceive();
+
+    void Release(std::unique_ptr<TCPSendState> state);
+    void Release(std::unique_ptr<TCPReceiveState> state);
+
+    // Adds this pool's numbers to the stats
+    void GetStats(TCPStateStats& stats) const;
+
+    // Allocator for ZSTD_customMem that counts bytes in the std::atomic<u64>
+    // passed as the opaque pointer
+    static void* CountedAlloc(void* opaque, size_t size);
+    static void CountedFree(void* opaque, void* address);
+
+protected:
+    const bool SharedContexts;
+    std::atomic<u64> AllocatedBytes{ 0 };
+    std::atomic_int SendStatesInUse{ 0 };
+    std::atomic_int ReceiveStatesInUse{ 0 };
+    ZSTD_customMem CustomMem;
+
+    mutable Lock PoolLock;
+    std::vector<std::unique_ptr<TCPSendState>> FreeSendStates;
+    std::vector<std::unique_ptr<TCPReceiveState>> FreeReceiveStates;
+};
+
+
+//-----------------------------------------------------------------------------
+// TCP Frames
+
+// Compress one flush of TCP data into a zstd frame, passing each piece of
+// output to send().  Returns false on error
+bool CompressTCPFrame(ZBUFF_CCtx* context, u8* buffer, size_t bufferSize,
+    const u8* data, size_t bytes, const std::function<void(const u8*, int)>& send,
+    int compressionLevel = kCompressionLevel);
+
+// Returns the size of the zstd frame at the front of the data, 0 if the
+// frame is not complete yet, or -1 if the data is not a frame
+int GetTCPFrameBytes(const u8* data, size_t bytes);
+
+// Decompress the whole frames at the front of the data, passing each one to
+// deliver().  Returns the number of bytes used, which stops short of a frame
+// that is not complete yet, or -1 if the data is invalid
+int DecompressTCPFrames(ZSTD_DCtx* context, u8* buffer, size_t bufferSize,
+    const u8* data, size_t bytes, const std::function<void(Stream&)>& deliver);
+
+
 //-----------------------------------------------------------------------------
 // SphynxPeer
 //
 // Shared code between SphynxServer::Connection and SphynxClient
 
+// See Capture.h
+class CaptureWriter;
+enum class CaptureType : u8;
+
 class SphynxPeer
 {
 public:
-	SphynxPeer();
+	// Memory the peer holds for its whole life is counted in allocatedBytes
+	// if given.  See CountedAlloc()
+	explicit SphynxPeer(const std::shared_ptr<std::atomic<u64>>& allocatedBytes = nullptr);
 	virtual ~SphynxPeer();
 
 	void Start(std::shared_ptr<asio::io_context>& context);
@@ -174,28 +370,120 @@ public:
 	const std::function<void(Stream&)> UDPCallSender;
 	const std::function<void(Stream&)> TCPCallSender;
 
+	// Count calls, bytes and handler time for each call id, also adding them
+	// to the parent if given.  Must be called before any traffic
+	void EnableCallStats(const std::shared_ptr<CallStats>& parent = nullptr);
+
+	// Null unless EnableCallStats() was called
+	const CallStats* GetCallStats() const
+	{
+		return Stats.get();
+	}
+
+	// Record decrypted inbound traffic to the writer, or stop with null
+	void SetCapture(const std::shared_ptr<CaptureWriter>& capture);
+
 protected:
-    void OnTCPRead(Stream& stream);
+    // Called with the number of bytes just read into the receive state
+    void OnTCPRead(size_t bytes);
 	void OnTCPData(Stream& stream);
+	// Make the socket non-blocking for OnTCPReadable() and start reading
+	void StartTCPReads();
 	void PostNextTCPRead();
+	void OnTCPReadable();
 	void OnTCPReadError(const asio::error_code& error);
 	void OnTCPSendError(const asio::error_code& error);
 	void OnTCPClose();
 	void SendTCP(const u8* data, int bytes);
 
-	void OnUDPData(u64 nowMsec, Stream& stream);
-    void SendUDP(const u8* data, int bytes);
+	// Write everything in the send queue with one gathered write
+	void PostNextTCPWrite();
+	void OnTCPWritten(const asio::error_code& error);
+
+	// Bytes queued or being written, for deciding whether there is room
+	size_t GetTCPSendQueueBytes();
+
+	// Reassemble chunks of a large message and route it once complete.
+	// Returns false if the chunk does not fit the message
+	bool OnTCPChunk(u32 messageBytes, vector_view<const u8> data);
+
+	// Compress and send one message right away, bypassing the packing
+	// buffer.  Used before the session is established so that no TCP
+	// buffers or compression contexts are allocated yet
+	void SendTCPImmediate(Stream& stream);
+
+	// Returns true if the datagram held at least one valid call
+	bool OnUDPData(u64 nowMsec, Stream& stream);
+
+	// The two halves of OnUDPData(): Decrypt a datagram in place, then
+	// capture and route it
+	void DecryptUDPData(Stream& stream);
+	bool OnUDPDecrypted(u64 nowMsec, const u8* data, int bytes);
+
+	// Returns true if a decrypted datagram was sent after the last one
+	// received, and within kS2CUDPMigrateWindowMsec of the remote time expected
+	// now.  Changes nothing, so it can vet a datagram before routing it
+	bool IsNextUDPDatagram(u64 nowMsec, const u8* data, int bytes) const;
+
+	// Route a decrypted datagram.  Returns true if any of it was valid
+	bool OnUDPPlaintext(u64 nowMsec, const u8* data, int bytes);
+    void SendUDP(const u8* data, int bytes, int plaintextBytes = 0);
 	void OnUDPSendError(const asio::error_code& error);
 
 	void PackTCP(Stream& stream);
 	void PackUDP(Stream& stream);
+
+	// Split a message larger than the packing buffer into chunks, flushing
+	// as each buffer fills.  Must hold TCPFlushLock
+	void PackTCPChunks(Stream& stream);
 	void FlushTCP();
 	void FlushUDP();
 
-	bool RouteData(Stream& stream);
+	// Route every call in the stream, counting them under the transport they
+	// came over.  Returns true if any were valid
+	bool RouteData(Stream& stream, CallTransport transport);
+
+	// Count a call written by a CallSerializer, if stats are enabled
+	void CountSentCall(Stream& stream, CallTransport transport)
+	{
+		if (Stats)
+			Stats->Add(CallDirection::Sent, transport, stream.GetFront()[0], stream.GetUsed());
+	}
+
+	// Take TCP state from a different pool from now on.  State held now
+	// goes back to the pool it came from, which counted its memory
+	void SetTCPStatePool(const std::shared_ptr<TCPStatePool>& pool);
+
+	// Hand TCP state that has been idle for kTCPIdleReleaseMsec back to the
+	// pool.  Returns the time to call again, or 0 if no state is held
+	u64 ReleaseIdleTCPState(u64 nowMsec);
+
+	// Called when the peer has new work for its next tick: Outgoing data was
+	// queued into an empty buffer, or the peer was disconnected
+	virtual void OnNeedsTick() {}
+
+	// Write a plaintext datagram header that ends just before `end` and
+	// return its size, which must fit in UDPOutReserved - 2 bytes
+	virtual int WriteUDPHeader(u8* end) { return 0; }
 
     Encryptor Cipher;
 
+	// Counter for the allocations below.  Declared first so that it is
+	// released last
+	std::shared_ptr<std::atomic<u64>> AllocatedBytes;
+
+	// Per-call accounting, or null when disabled
+	CountedPtr<CallStats> Stats;
+
+	// Capture of inbound traffic.  The flag keeps the lock off the receive
+	// path while not capturing
+	std::atomic_bool Capturing{ false };
+	Lock CaptureLock;
+	std::shared_ptr<CaptureWriter> Capture;
+	u32 CaptureSource = 0;
+
+	void captureInbound(CaptureType type, const u8* data, int bytes);
+
 	// Asio context
 	std::shared_ptr<asio::io_context> Context;
 
@@ -213,34 +501,53 @@ protected:
 	// Last UDP or TCP packet local receive time for timeouts
 	u64 LastReceiveLocalMsec = 0;
 
-	// Last UDP packet expanded remote timestamp
+	// Last UDP packet expanded remote timestamp, and its local receive time
 	u64 LastUDPReceiveRemoteMsec = 0;
+	u64 LastUDPReceiveLocalMsec = 0;
 
 	// UDP time synchronization data collection
 	WindowedTimes WinTimes;
 
-	// TCP receive stream buffer
-	asio::streambuf TCPReceiveStreamBuf;
+	// Source of TCP state.  Must be set before any TCP traffic, and changed
+	// only with SetTCPStatePool()
+	std::shared_ptr<TCPStatePool> StatePool;
+
+	// TCP receive state, or null while idle, and the pool it goes back to.
+	// Reads wait for the socket to become readable before taking a buffer,
+	// so idle peers hold none
+	Lock TCPReceiveLock;
+	std::unique_ptr<TCPReceiveState> ReceiveState;
+	std::shared_ptr<TCPStatePool> ReceiveStatePool;
+	u64 LastTCPReceiveMsec = 0;
+
+	// Large message being reassembled from chunks and its announced size.
+	// Both use TCPReceiveLock
+	std::vector<u8> TCPMessage;
+	u32 TCPMessageBytes = 0;
 
 	// Outgoing UDP datagram buffer
 	Lock UDPFlushLock;
-	std::unique_ptr<u8[]> UDPOutBuffer;
+	CountedPtr<u8[]> UDPOutBuffer;
+	size_t UDPOutReserved = 2; // Header room plus the 16-bit timestamp
 	size_t UDPOutUsed = 2;
 	size_t UDPOutBufferSize = 0;
 
-	// Outgoing TCP datagram buffer
+	// Outgoing TCP packing buffer and compression state, or null while
+	// idle, and the pool it goes back to
 	Lock TCPFlushLock;
-    std::unique_ptr<u8[]> TCPOutBuffer;
+	std::unique_ptr<TCPSendState> SendState;
+	std::shared_ptr<TCPStatePool> SendStatePool;
 	size_t TCPOutUsed = 0;
-	size_t TCPOutBufferSize = 0;
-
-	// TCP decompression context and buffer
-	ZBUFF_DCtx* DecompressionContext = nullptr;
-    std::unique_ptr<u8[]> DecompressedBuffer;
-	size_t DecompressedBufferSize = 0;
-
-	// TCP compression context and buffer
-	ZBUFF_CCtx* CompressionContext = nullptr;
-    std::unique_ptr<u8[]> CompressionBuffer;
-	size_t CompressionBufferSize = 0;
+	u64 LastTCPSendMsec = 0;
+
+	// Encrypted TCP data waiting for the write in progress, which owns
+	// TCPWriting.  Only one write is posted at a time, so data cannot
+	// interleave when the socket takes part of a write
+	Lock TCPSendLock;
+	std::vector<std::unique_ptr<u8[]>> TCPSendQueue, TCPWriting;
+	std::vector<asio::const_buffer> TCPSendQueueBuffers, TCPWritingBuffers;
+	size_t TCPSendQueueBytes = 0; // Includes the write in progress
+	size_t TCPWritingBytes = 0;
+	bool TCPWriteInProgress = false;
+	bool TCPWriteFailed = false;
 };
@@ -1,17 +1,31 @@
 #include "SphynxServer.h"
+#include "SipHash.h"
+#include "Capture.h"
+#include <random>
+#include <sstream>
 
 static logging::Channel Logger("SphynxServer");
 
+static MetricGauge& ServerConnections = GetMetrics().GetGauge("server.connections");
+static MetricHistogram& WorkerTickUsec = GetMetrics().GetHistogram("server.worker_tick_usec");
+static MetricHistogram& WorkerPromoteUsec = GetMetrics().GetHistogram("server.worker_promote_usec");
+static MetricHistogram& WorkerUserTickUsec = GetMetrics().GetHistogram("server.worker_user_tick_usec");
+static MetricHistogram& WorkerFlushUsec = GetMetrics().GetHistogram("server.worker_flush_usec");
+static MetricHistogram& WorkerTickLagUsec = GetMetrics().GetHistogram("server.worker_tick_lag_usec");
+static MetricCounter& WorkerSlowTicks = GetMetrics().GetCounter("server.worker_slow_ticks");
+static MetricCounter& UDPMigrations = GetMetrics().GetCounter("udp.migrations");
+static MetricCounter& UDPMigrationsRefused = GetMetrics().GetCounter("udp.migrations_refused");
+
 
 //-----------------------------------------------------------------------------
 // Tools
 
-#ifdef _MSC_VER
-#include <nmmintrin.h>
+#if !defined(ANDROID) && (defined(_MSC_VER) || defined(__SSE4_2__))
+    #define HAS_CRC32_INTRINSIC /* disable if it doesn't compile */
 #endif
 
-#ifndef ANDROID
-    #define HAS_CRC32_INTRINSIC /* disable if it doesn't compile */
+#ifdef HAS_CRC32_INTRINSIC
+#include <nmmintrin.h>
 #endif
 
 ALIGNED_TYPE(asio::ip::address_v4::bytes_type, 16) aligned_v4_t;
@@ -57,6 +71,26 @@ uint32_t hash_ip_addr(const asio::ip::udp::endpoint& addr)
     return key;
 }
 
+EndpointKey::EndpointKey(const asio::ip::udp::endpoint& addr)
+{
+    aligned_v6_t v6bytes;
+
+    if (addr.address().is_v4())
+    {
+        // IPv4-mapped IPv6 form: ::ffff:a.b.c.d
+        aligned_v4_t v4bytes = addr.address().to_v4().to_bytes();
+        memset(&v6bytes[0], 0, 10);
+        v6bytes[10] = 0xff;
+        v6bytes[11] = 0xff;
+        memcpy(&v6bytes[12], &v4bytes[0], 4);
+    }
+    else
+        v6bytes = addr.address().to_v6().to_bytes();
+
+    memcpy(Address, &v6bytes[0], sizeof(Address));
+    Port = addr.port();
+}
+
 
 //-----------------------------------------------------------------------------
 // ServerWorker
@@ -73,26 +107,25 @@ ServerWorker::~ServerWorker()
 void ServerWorker::AddNewConnection(const std::shared_ptr<Connection>& connection)
 {
     ConnectionCount++;
+    ServerConnections.Add(1);
 
-    Locker locker(NewConnectionsLock);
-    NewConnections.push_back(connection);
+    NewConnections.Push(connection);
 }
 
-void ServerWorker::RemoveConnection(const std::shared_ptr<Connection>& connection)
+void ServerWorker::WakeConnection(const std::shared_ptr<Connection>& connection)
 {
-    ConnectionCount--;
-
-    Locker locker(NewConnectionsLock);
-    NewConnections.remove(connection);
-    Connections.remove(connection);
+    Locker locker(WakeQueueLock);
+    WakeQueue.push_back(connection);
 }
 
 void ServerWorker::Start(std::shared_ptr<asio::io_context>& context, unsigned threadId,
-    std::shared_ptr<ServerSettings>& settings)
+    std::shared_ptr<ServerSettings>& settings, ServerWorkers* workers)
 {
     Context = context;
     ThreadId = threadId;
     Settings = settings;
+    Workers = workers;
+    StatePool = std::make_shared<TCPStatePool>(Settings->SharedCompressionContexts);
 
     Logger.Debug("Thread ", ThreadId, ": Starting");
 
@@ -105,7 +138,15 @@ void ServerWorker::Start(std::shared_ptr<asio::io_context>& context, unsigned th
 
 void ServerWorker::PostNextTimer()
 {
-    Timer->expires_after(std::chrono::milliseconds(kServerWorkerTimerIntervalMsec));
+    // Ticks are due at fixed intervals from the previous due time, so the
+    // time spent ticking does not push the schedule back.  After a stall
+    // the next tick runs right away instead of several back to back
+    const auto nowTime = asio::steady_timer::clock_type::now();
+    auto nextTime = Timer->expiry() + std::chrono::milliseconds(kServerWorkerTimerIntervalMsec);
+    if (nextTime < nowTime)
+        nextTime = nowTime;
+
+    Timer->expires_at(nextTime);
     Timer->async_wait([this](const asio::error_code& error)
     {
         if (!!error)
@@ -136,34 +177,188 @@ void ServerWorker::Loop()
     Logger.Info("Thread ", ThreadId, ": Exiting loop");
 }
 
-void ServerWorker::PromoteNewConnections()
+void ServerWorker::PromoteNewConnections(u64 nowMsec)
+{
+    NewConnections.Drain([this, nowMsec](std::shared_ptr<Connection>& connection)
+    {
+        connection->WorkerHandle = Connections.Insert(connection);
+        connection->WheelNode.Context = connection.get();
+        connection->Worker = this;
+
+        // Connections moved here from another worker have already started,
+        // and take TCP state from this worker's pool from now on
+        if (!connection->WorkerStarted)
+        {
+            connection->WorkerStarted = true;
+            connection->OnWorkerStart();
+        }
+        else
+            connection->SetTCPStatePool(StatePool);
+
+        ProcessConnection(connection.get(), nowMsec);
+    });
+}
+
+void ServerWorker::ProcessConnection(Connection* connection, u64 nowMsec)
+{
+    // Data queued while ticking is flushed by the tick itself, so hold off
+    // wake-ups until OnTick() is about to flush
+    connection->WakePending = true;
+
+    const u64 startUsec = GetTimeUsec();
+    const bool remove = connection->OnTick(nowMsec);
+    ProfileConnection(connection, GetTimeUsec() - startUsec);
+
+    if (remove)
+    {
+        connection->Worker = nullptr;
+        Wheel.Cancel(&connection->WheelNode);
+        ConnectionCount--;
+        ServerConnections.Add(-1);
+        Connections.Remove(connection->WorkerHandle); // May free the connection
+        return;
+    }
+
+    // If the connection asked to move to another worker:
+    const int requested = connection->RequestedWorker.exchange(-1);
+    if (requested >= 0)
+    {
+        ServerWorker* worker = Workers->GetWorker(static_cast<unsigned>(requested));
+        if (worker != this)
+        {
+            std::shared_ptr<Connection> moved = *Connections.Get(connection->WorkerHandle);
+
+            connection->Worker = nullptr;
+            Wheel.Cancel(&connection->WheelNode);
+            ConnectionCount--;
+            ServerConnections.Add(-1);
+            Connections.Remove(connection->WorkerHandle);
+
+            worker->AddNewConnection(moved);
+            return;
+        }
+    }
+
+    // Sleep until the next deadline, rounding to the nearest tick
+    s64 delayMsec = (s64)(connection->NextTickMsec - nowMsec) - kServerWorkerTimerIntervalMsec / 2;
+    u64 ticks = 1;
+    if (delayMsec > 0)
+        ticks = (u64)(delayMsec + kServerWorkerTimerIntervalMsec - 1) / kServerWorkerTimerIntervalMsec;
+
+    Wheel.Schedule(&connection->WheelNode, Wheel.GetCurrentTick() + ticks);
+}
+
+void ServerWorker::ProfileConnection(Connection* connection, u64 usec)
 {
-    std::list<std::shared_ptr<Connection>> newConnections;
+    SlowConnection slow;
+    slow.Id = (u32)connection->ConnectionCookie;
+    slow.Usec = usec;
+    slow.UserTickUsec = connection->LastUserTickUsec;
+    slow.FlushUsec = connection->LastFlushUsec;
+
+    // Cleared so a connection removed without ticking does not count twice
+    connection->LastUserTickUsec = 0;
+    connection->LastFlushUsec = 0;
+
+    Profile.UserTickUsec += slow.UserTickUsec;
+    Profile.FlushUsec += slow.FlushUsec;
+    ++Profile.ConnectionCount;
+
+    // Insertion into the short list of slowest connections
+    for (int i = 0; i < kSlowConnectionCount; ++i)
     {
-        Locker locker(NewConnectionsLock);
-        newConnections.splice(newConnections.end(), NewConnections);
+        if (slow.Usec > Profile.Slowest[i].Usec)
+            std::swap(slow, Profile.Slowest[i]);
     }
+}
+
+void ServerWorker::OnSlowTick(u64 tickUsec, u64 promoteUsec, u64 lagUsec)
+{
+    SlowTicks++;
+    WorkerSlowTicks.Add();
 
-    for (auto& connection : newConnections)
-        connection->OnWorkerStart();
+    std::ostringstream slowest;
+    for (const SlowConnection& slow : Profile.Slowest)
+    {
+        if (slow.Usec <= 0)
+            break;
+        slowest << " [id " << slow.Id << ": " << slow.Usec << " usec, user tick "
+            << slow.UserTickUsec << ", flush " << slow.FlushUsec << "]";
+    }
 
-    Connections.splice(Connections.end(), newConnections);
+    static logging::RateLimit limit(kWarningRateLimit);
+    Logger.LogLimited(limit, logging::Level::Warning, "Thread ", ThreadId, ": Slow tick took ", tickUsec,
+        " usec for ", Profile.ConnectionCount, " connections (promote ", promoteUsec, ", user tick ",
+        Profile.UserTickUsec, ", flush ", Profile.FlushUsec, ", lag ", lagUsec, "). Slowest:", slowest.str());
+}
+
+void ServerWorker::GetTickStats(WorkerTickStats& stats)
+{
+    stats.LastTickUsec = LastTickUsec;
+    stats.PeakTickUsec = PeakTickUsec.exchange(0);
+    stats.LastLagUsec = LastLagUsec;
+    stats.PeakLagUsec = PeakLagUsec.exchange(0);
+    stats.SlowTicks = SlowTicks;
 }
 
 void ServerWorker::OnTimerTick()
 {
-    u64 nowMsec = GetTimeMsec();
+    // Lag is how long after its due time the tick started: The timer firing
+    // late, or the thread busy with other handlers
+    const auto lateTime = asio::steady_timer::clock_type::now() - Timer->expiry();
+    const s64 behindUsec = std::chrono::duration_cast<std::chrono::microseconds>(lateTime).count();
+    const u64 lagUsec = behindUsec > 0 ? (u64)behindUsec : 0;
+
+    const u64 startUsec = UpdateCachedTime();
+    u64 nowMsec = startUsec / 1000;
 
-    Logger.Trace("Thread ", ThreadId, ": Tick ", nowMsec);
+    SPHYNX_TRACE(Logger, "Thread ", ThreadId, ": Tick ", nowMsec);
 
-    PromoteNewConnections();
+    Profile = TickProfile();
 
-    Connections.remove_if(
-        [nowMsec](std::shared_ptr<Connection>& connection)
+    PromoteNewConnections(nowMsec);
+    const u64 promoteUsec = GetTimeUsec() - startUsec;
+
+    // Tick connections with a deadline that came up
+    Wheel.Advance([this, nowMsec](TimerNode* node)
     {
-        return connection->OnTick(nowMsec);
+        ProcessConnection(static_cast<Connection*>(node->Context), nowMsec);
     });
 
+    // Tick connections that were woken since the last tick
+    {
+        Locker locker(WakeQueueLock);
+        WakeQueueWork.swap(WakeQueue);
+    }
+    for (auto& connection : WakeQueueWork)
+    {
+        // Skip connections that have since been removed or moved away
+        if (connection->Worker != this)
+            continue;
+
+        Wheel.Cancel(&connection->WheelNode);
+        ProcessConnection(connection.get(), nowMsec);
+    }
+    WakeQueueWork.clear();
+
+    const u64 tickUsec = GetTimeUsec() - startUsec;
+
+    WorkerTickUsec.Record(tickUsec);
+    WorkerPromoteUsec.Record(promoteUsec);
+    WorkerUserTickUsec.Record(Profile.UserTickUsec);
+    WorkerFlushUsec.Record(Profile.FlushUsec);
+    WorkerTickLagUsec.Record(lagUsec);
+
+    LastTickUsec = tickUsec;
+    LastLagUsec = lagUsec;
+    if (tickUsec > PeakTickUsec)
+        PeakTickUsec = tickUsec;
+    if (lagUsec > PeakLagUsec)
+        PeakLagUsec = lagUsec;
+
+    if (Settings->SlowTickMsec > 0 && tickUsec > Settings->SlowTickMsec * 1000ull)
+        OnSlowTick(tickUsec, promoteUsec, lagUsec);
+
     PostNextTimer();
 }
 
@@ -229,7 +424,7 @@ void ServerWorkers::Start(std::shared_ptr<asio::io_context>& context, std::share
     for (auto& worker : Workers)
     {
         worker = std::make_shared<ServerWorker>();
-        worker->Start(Context, threadId++, Settings);
+        worker->Start(Context, threadId++, Settings, this);
     }
 }
 
@@ -247,6 +442,24 @@ ServerWorker* ServerWorkers::FindLaziestWorker()
     return Workers[laziestWorker].get();
 }
 
+ServerWorker* ServerWorkers::GetWorker(unsigned workerHint)
+{
+    return Workers[workerHint % Workers.size()].get();
+}
+
+void ServerWorkers::GetTCPStateStats(TCPStateStats& stats) const
+{
+    for (auto& worker : Workers)
+        worker->GetTCPStatePool()->GetStats(stats);
+}
+
+void ServerWorkers::GetTickStats(std::vector<WorkerTickStats>& stats)
+{
+    stats.resize(Workers.size());
+    for (size_t i = 0; i < Workers.size(); ++i)
+        Workers[i]->GetTickStats(stats[i]);
+}
+
 void ServerWorkers::Stop()
 {
     Logger.Info("Stopping ", Settings->WorkerCount, " workers");
@@ -266,18 +479,24 @@ void ServerWorkers::Stop()
 //-----------------------------------------------------------------------------
 // Connection
 
-Connection::Connection()
+Connection::Connection(const std::shared_ptr<std::atomic<u64>>& allocatedBytes)
+    : SphynxPeer(allocatedBytes)
 {
+    RequestedWorker = -1;
+    Worker = nullptr;
+    WakePending = false;
+    TickIntervalMsec = kServerWorkerTimerIntervalMsec;
+
     RPCTimeSyncUDP.CallSender = UDPCallSender;
     RPCHeartbeatTCP.CallSender = TCPCallSender;
-    RPCTCPHandshake.CallSender = TCPCallSender;
+    RPCTCPHandshake.CallSender = [this](Stream& stream) { SendTCPImmediate(stream); };
 
     Router.Set<C2SHeartbeatT>(C2SHeartbeatID, [this](u16 sentTimeMsec)
     {
-        u64 nowMsec = GetTimeMsec();
+        u64 nowMsec = GetCachedMsec();
         u64 sentTimeFullMsec = ReconstructMsec(nowMsec, sentTimeMsec);
 
-        Logger.Debug("Got heartbeat from ", (int)(nowMsec - sentTimeFullMsec));
+        SPHYNX_TRACE(Logger, "Got heartbeat from ", (int)(nowMsec - sentTimeFullMsec));
 
         // Client is keeping connection alive
     });
@@ -285,17 +504,49 @@ Connection::Connection()
 
 Connection::~Connection()
 {
+    if (OwnerInterface && Interface)
+        OwnerInterface->DestroyConnection(Interface, this);
+}
+
+void Connection::MoveToWorker(unsigned workerHint)
+{
+    RequestedWorker = static_cast<int>(workerHint & 0x7fffffff);
+    Wake();
+}
+
+void Connection::SetTickIntervalMsec(int intervalMsec)
+{
+    TickIntervalMsec = intervalMsec > 0 ? intervalMsec : 0;
+    Wake();
+}
+
+void Connection::Wake()
+{
+    if (WakePending.exchange(true))
+        return; // Already queued
+
+    // Connections between workers are processed as soon as they are promoted
+    ServerWorker* worker = Worker;
+    if (worker)
+        worker->WakeConnection(shared_from_this());
 }
 
-void Connection::Start(std::shared_ptr<asio::io_context>& context, ConnectionInterface* iface)
+void Connection::OnNeedsTick()
+{
+    Wake();
+}
+
+void Connection::Start(std::shared_ptr<asio::io_context>& context, ServerInterface* server, ConnectionInterface* iface)
 {
 	SphynxPeer::Start(context);
 
+    OwnerInterface = server;
     Interface = iface;
 }
 
-void Connection::OnAccept(const std::shared_ptr<asio::ip::udp::socket>& udpSocket, unsigned short port, u32 cookie)
+void Connection::OnAccept(UDPServer* udpServer, const std::shared_ptr<asio::ip::udp::socket>& udpSocket, unsigned short port, u64 cookie)
 {
+    OwnerUDPServer = udpServer;
     UDPSocket = udpSocket;
     UDPPort = port;
     ConnectionCookie = cookie;
@@ -307,52 +558,118 @@ void Connection::OnWorkerStart()
 
     Logger.Info("Worker starting on connection. Sending TCP handshake");
 
-    RPCTCPHandshake(ConnectionCookie, UDPPort);
+    StartMsec = GetTimeMsec();
 
-    PostNextTCPRead();
+    RPCTCPHandshake(ConnectionCookie, UDPPort);
 }
 
 void Connection::OnUDPHandshake(asio::ip::udp::endpoint& from, std::shared_ptr<asio::ip::udp::socket>& udpSocket)
 {
-    PeerUDPAddress = from;
+    {
+        Locker locker(UDPFlushLock);
+        PeerUDPAddress = from;
+    }
 	UDPSocket = udpSocket;
 
+    // The first move is rate limited from here
+    LastUDPMigrateMsec = GetCachedMsec();
+
 	IsFullConnection = true;
 
     Logger.Info("Connection got UDP handshake from client: Session established!");
 
     Interface->OnConnect(this);
+
+    // Start TCP reads, time sync and user ticks
+    Wake();
+}
+
+asio::ip::udp::endpoint Connection::OnUDPMigrate(const asio::ip::udp::endpoint& from)
+{
+    // Senders read the address under this lock
+    Locker locker(UDPFlushLock);
+    asio::ip::udp::endpoint old = PeerUDPAddress;
+    PeerUDPAddress = from;
+    return old;
+}
+
+asio::ip::udp::endpoint Connection::GetPeerUDPAddress()
+{
+    Locker locker(UDPFlushLock);
+    return PeerUDPAddress;
+}
+
+// Returns true if the deadline falls within half a worker tick of now
+static FORCE_INLINE bool IsDue(u64 deadlineMsec, u64 nowMsec)
+{
+    return (s64)(nowMsec + kServerWorkerTimerIntervalMsec / 2 - deadlineMsec) >= 0;
+}
+
+static FORCE_INLINE void KeepEarliest(u64& nextMsec, u64 deadlineMsec)
+{
+    if ((s64)(deadlineMsec - nextMsec) < 0)
+        nextMsec = deadlineMsec;
 }
 
 bool Connection::OnTick(u64 nowMsec)
 {
-    if (nowMsec - LastReceiveLocalMsec > kS2CTimeoutMsec && LastReceiveLocalMsec != 0)
+    const u64 lastReceiveMsec = LastReceiveLocalMsec;
+
+    // Signed: Receive and start times can be a little newer than nowMsec
+    if ((s64)(nowMsec - lastReceiveMsec) > kS2CTimeoutMsec && lastReceiveMsec != 0)
     {
-        Logger.Warning("Client timeout: Disconnecting");
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "Client timeout: Disconnecting");
 
         Disconnect();
     }
 
-    if (!IsDisconnected() && IsFullConnection)
+    if (!IsFullConnection && (s64)(nowMsec - StartMsec) > kS2CHandshakeTimeoutMsec)
+    {
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "Client did not complete UDP handshake: Disconnecting");
+
+        Disconnect();
+    }
+
+    const int tickIntervalMsec = TickIntervalMsec;
+
+    if (!IsDisconnected() && IsFullConnection && tickIntervalMsec > 0 &&
+        IsDue(NextUserTickMsec, nowMsec))
+    {
+        NextUserTickMsec = nowMsec + tickIntervalMsec;
+
+        const u64 userStartUsec = GetTimeUsec();
         Interface->OnTick(this, nowMsec);
+        LastUserTickUsec = GetTimeUsec() - userStartUsec;
+    }
 
     if (IsDisconnected())
     {
-        Logger.Warning("Client is disconnected: Removing from worker list");
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "Client is disconnected: Removing from worker list");
 
         if (IsFullConnection)
             Interface->OnDisconnect(this);
 
-        // FIXME: Call PreMapRemove() here on UDP server
-        // FIXME: Call MapRemove() here on UDP server
+        if (OwnerUDPServer)
+            OwnerUDPServer->OnConnectionClosed(this);
 
         return true; // Remove from list
     }
 
-    if (IsFullConnection && nowMsec - LastUDPTimeSyncMsec > static_cast<u64>(S2CUDPTimeSyncIntervalMsec))
+    // Reads are started here rather than on the UDP thread so that all TCP
+    // socket operations are started from the worker
+    if (IsFullConnection && !TCPReadStarted)
+    {
+        TCPReadStarted = true;
+        StartTCPReads();
+    }
+
+    if (IsFullConnection && IsDue(LastUDPTimeSyncMsec + S2CUDPTimeSyncIntervalMsec, nowMsec))
     {
         LastUDPTimeSyncMsec = nowMsec;
-        Logger.Debug("Sending UDP timesync ", nowMsec);
+        SPHYNX_TRACE(Logger, "Sending UDP timesync ", nowMsec);
 
         u16 bestDelta = static_cast<u16>(WinTimes.ComputeDelta(nowMsec));
         RPCTimeSyncUDP(bestDelta);
@@ -365,20 +682,93 @@ bool Connection::OnTick(u64 nowMsec)
         }
     }
 
-    if (nowMsec - LastTCPHeartbeatMsec > kS2CTCPHeartbeatIntervalMsec)
+    if (IsDue(LastTCPHeartbeatMsec + kS2CTCPHeartbeatIntervalMsec, nowMsec))
     {
         LastTCPHeartbeatMsec = nowMsec;
-        Logger.Debug("Sending TCP heartbeat ", nowMsec);
+        SPHYNX_TRACE(Logger, "Sending TCP heartbeat ", nowMsec);
 
         RPCHeartbeatTCP();
     }
 
+    // Anything queued after this point needs another tick to go out
+    WakePending = false;
+
+    const u64 flushStartUsec = GetTimeUsec();
     Flush();
+    LastFlushUsec = GetTimeUsec() - flushStartUsec;
+
+    const u64 releaseMsec = ReleaseIdleTCPState(nowMsec);
+
+    // Work out when the worker needs to tick this connection again
+    u64 nextMsec = LastTCPHeartbeatMsec + kS2CTCPHeartbeatIntervalMsec;
+    if (IsFullConnection)
+    {
+        KeepEarliest(nextMsec, LastUDPTimeSyncMsec + S2CUDPTimeSyncIntervalMsec);
+        if (tickIntervalMsec > 0)
+            KeepEarliest(nextMsec, NextUserTickMsec);
+    }
+    else
+        KeepEarliest(nextMsec, StartMsec + kS2CHandshakeTimeoutMsec + 1);
+    if (lastReceiveMsec != 0)
+        KeepEarliest(nextMsec, lastReceiveMsec + kS2CTimeoutMsec + 1);
+    if (releaseMsec != 0)
+        KeepEarliest(nextMsec, releaseMsec);
+    NextTickMsec = nextMsec;
 
     return false; // Do not remove from list
 }
 
 
+//-----------------------------------------------------------------------------
+// Arena
+
+Arena::Arena(unsigned arenaIndex, unsigned idCount)
+    : Index(arenaIndex)
+    , IdCount(idCount)
+{
+    // Hand out the lowest ids first so they stay short on the wire
+    FreeIds.reserve(IdCount);
+    for (unsigned i = IdCount; i > 0; --i)
+        FreeIds.push_back(i - 1);
+}
+
+Arena::~Arena()
+{
+}
+
+bool Arena::Join(Connection* connection, u32& id)
+{
+    {
+        Locker locker(IdLock);
+        if (FreeIds.empty())
+            return false;
+        id = FreeIds.back();
+        FreeIds.pop_back();
+    }
+
+    connection->MoveToWorker(Index);
+    return true;
+}
+
+void Arena::Leave(u32 id)
+{
+    Locker locker(IdLock);
+    FreeIds.push_back(id);
+}
+
+int Arena::GetCount() const
+{
+    Locker locker(IdLock);
+    return static_cast<int>(IdCount - FreeIds.size());
+}
+
+bool Arena::IsFull() const
+{
+    Locker locker(IdLock);
+    return FreeIds.empty();
+}
+
+
 //-----------------------------------------------------------------------------
 // UDPServer
 
@@ -419,25 +809,191 @@ void UDPServer::Start(std::shared_ptr<asio::io_context>& context, unsigned short
 
     PreConnectionCipher.InitializeEncryption(0, EncryptionRole::Server);
 
-    PreConnectionRouter.Set<C2SUDPHandshakeT>(C2SUDPHandshakeID, [this](u32 cookie)
+    std::random_device randomDevice;
+    for (unsigned i = 0; i < sizeof(CookieKey); i += 4)
     {
+        const u32 word = randomDevice();
+        memcpy(CookieKey + i, &word, 4);
+    }
+
+    PreConnectionRouter.Set<C2SUDPHandshakeT>(C2SUDPHandshakeID, [this](u64 cookie)
+    {
+        // Reject forged and expired cookies before touching any state
+        if (!checkCookie(cookie, FromEndpoint.address(), GetCachedMsec()))
+            return;
+
         std::shared_ptr<Connection> connection;
-        if (PreMapFindRemove(cookie, connection))
+        ConnectionIds.Find(static_cast<u32>(cookie), [&connection, cookie](Connection* candidate)
         {
-            Logger.Info("Got UDP data from the client");
+            if (candidate->ConnectionCookie == cookie &&
+                !candidate->IsFullConnection &&
+                !candidate->IsDisconnected())
+            {
+                connection = candidate->shared_from_this();
+            }
+        });
+        if (!connection)
+            return;
 
-            connection->OnUDPHandshake(FromEndpoint, UDPSocket);
+        Logger.Info("Got UDP data from the client");
 
-            MapInsert(FromEndpoint, connection);
-        }
+        connection->OnUDPHandshake(FromEndpoint, UDPSocket);
+
+        MapInsert(FromEndpoint, connection);
     });
 
     PostNextRecvFrom();
 }
 
-void UDPServer::OnAccept(const std::shared_ptr<Connection>& connection, u32 cookie)
+u64 UDPServer::OnAccept(const std::shared_ptr<Connection>& connection)
+{
+    const u32 connectionId = ConnectionIds.Insert(connection);
+    if (connectionId == 0)
+    {
+        static logging::RateLimit limit(kWarningRateLimit);
+        Logger.LogLimited(limit, logging::Level::Warning, "UDP ", Port, ": Out of connection ids");
+        return 0;
+    }
+
+    const u64 bucket = GetTimeMsec() / kCookieBucketMsec;
+    return computeCookie(connectionId, bucket, connection->PeerTCPAddress.address());
+}
+
+u64 UDPServer::computeCookie(u32 connectionId, u64 bucket, const asio::ip::address& addr) const
+{
+    const EndpointKey key(asio::ip::udp::endpoint(addr, 0));
+
+    u8 input[4 + 8 + 16];
+    memcpy(input, &connectionId, 4);
+    memcpy(input + 4, &bucket, 8);
+    memcpy(input + 12, key.Address, 16);
+
+    const u64 mac = SipHash24(CookieKey, input, sizeof(input));
+    return (mac & 0xffffffff00000000ULL) | connectionId;
+}
+
+bool UDPServer::checkCookie(u64 cookie, const asio::ip::address& addr, u64 nowMsec) const
+{
+    const u32 connectionId = static_cast<u32>(cookie);
+    const u64 bucket = nowMsec / kCookieBucketMsec;
+
+    // Accept cookies from this bucket and the one before
+    return cookie == computeCookie(connectionId, bucket, addr) ||
+           cookie == computeCookie(connectionId, bucket - 1, addr);
+}
+
+void UDPServer::OnConnectionClosed(Connection* connection)
+{
+    if (connection->IsFullConnection)
+    {
+        asio::ip::udp::endpoint addr = connection->GetPeerUDPAddress();
+        MapRemove(addr);
+    }
+
+    ConnectionIds.Remove(static_cast<u32>(connection->ConnectionCookie));
+}
+
+void UDPServer::HandleDatagram(u64 nowMsec, const u8* data, size_t bytes)
+{
+    if (bytes < 1)
+        return;
+
+    const u8 flags = data[0];
+
+    if (flags & kC2SUDPFlagConnectionId)
+    {
+        if (bytes < static_cast<size_t>(kC2SUDPHeaderMaxBytes))
+            return;
+
+        u64 cookie;
+        memcpy(&cookie, data + 1, 8);
+
+        Stream stream;
+        stream.WrapRead(data + kC2SUDPHeaderMaxBytes, bytes - kC2SUDPHeaderMaxBytes);
+
+        if (HandleConnectionIdData(nowMsec, cookie, stream))
+            return;
+
+        // Unknown id: Fall back to the source address
+        stream.WrapRead(data + kC2SUDPHeaderMaxBytes, bytes - kC2SUDPHeaderMaxBytes);
+        EstablishedConnections.Find(FromEndpoint, [nowMsec, &stream](Connection* connection)
+        {
+            connection->OnUDPData(nowMsec, stream);
+        });
+        return;
+    }
+
+    Stream stream;
+    stream.WrapRead(data + 1, bytes - 1);
+
+    const bool established = EstablishedConnections.Find(FromEndpoint, [nowMsec, &stream](Connection* connection)
+    {
+        connection->OnUDPData(nowMsec, stream);
+    });
+    if (!established)
+        HandlePreConnectData(stream);
+}
+
+bool UDPServer::HandleConnectionIdData(u64 nowMsec, u64 cookie, Stream& stream)
 {
-    PreMapInsert(cookie, connection);
+    const u32 connectionId = static_cast<u32>(cookie);
+    std::shared_ptr<Connection> migrating;
+
+    const bool found = ConnectionIds.Find(connectionId, [&](Connection* connection)
+    {
+        // The cookie is the session secret: Drop datagrams that lack it
+        if (connection->ConnectionCookie != cookie || !connection->IsFullConnection)
+            return;
+
+        // Only this thread changes the address, so it can be read unlocked
+        if (connection->PeerUDPAddress == FromEndpoint)
+            connection->OnUDPData(nowMsec, stream);
+        else if (!connection->IsDisconnected())
+        {
+            // A client that keeps moving is more likely someone else
+            if ((s64)(nowMsec - connection->LastUDPMigrateMsec) < kS2CUDPMigrateIntervalMsec)
+            {
+                UDPMigrationsRefused.Add();
+                return;
+            }
+
+            migrating = connection->shared_from_this();
+        }
+    });
+
+    if (migrating)
+    {
+        // The cookie travels in the clear, so it only proves the sender saw
+        // a datagram.  Move only for a datagram sent after anything received
+        // so far and about now, so that a replay cannot move it.  Nothing is
+        // routed or updated until then
+        migrating->DecryptUDPData(stream);
+        if (!migrating->IsNextUDPDatagram(nowMsec, stream.GetFront(), stream.GetBufferSize()))
+        {
+            UDPMigrationsRefused.Add();
+
+            static logging::RateLimit limit(kWarningRateLimit);
+            Logger.LogLimited(limit, logging::Level::Warning, "UDP ", Port, ": Refused to move connection ",
+                connectionId, " to ", FromEndpoint.address().to_string(), " : ", FromEndpoint.port());
+            return found;
+        }
+
+        // Client address changed, for example by a NAT rebinding
+        migrating->LastUDPMigrateMsec = nowMsec;
+        UDPMigrations.Add();
+        asio::ip::udp::endpoint oldAddr = migrating->OnUDPMigrate(FromEndpoint);
+
+        Logger.Info("UDP ", Port, ": Connection ", connectionId, " moved from ",
+            oldAddr.address().to_string(), " : ", oldAddr.port(), " to ",
+            FromEndpoint.address().to_string(), " : ", FromEndpoint.port());
+
+        MapRemove(oldAddr);
+        MapInsert(FromEndpoint, migrating);
+
+        migrating->OnUDPDecrypted(nowMsec, stream.GetFront(), stream.GetBufferSize());
+    }
+
+    return found;
 }
 
 void UDPServer::HandlePreConnectData(Stream& rawStream)
@@ -449,7 +1005,7 @@ void UDPServer::HandlePreConnectData(Stream& rawStream)
     Stream stream;
     stream.WrapRead(data, dataSize);
 
-    u16 partialTime;
+    u16 partialTime = 0;
     if (!stream.Serialize(partialTime))
         return;
 
@@ -463,7 +1019,8 @@ void UDPServer::OnUDPClose()
 
 void UDPServer::OnUDPError(const asio::error_code& error)
 {
-    Logger.Warning("UDP ", Port, ": Socket error: ", error.message());
+    static logging::RateLimit limit(kWarningRateLimit);
+    Logger.LogLimited(limit, logging::Level::Warning, "UDP ", Port, ": Socket error: ", error.message());
 }
 
 void UDPServer::PostNextRecvFrom()
@@ -473,7 +1030,7 @@ void UDPServer::PostNextRecvFrom()
     UDPSocket->async_receive_from(asio::buffer(UDPReceiveBuffer), FromEndpoint, [this](
         const asio::error_code& error, std::size_t bytes_transferred)
     {
-        const u64 nowMsec = GetTimeMsec();
+        const u64 nowMsec = UpdateCachedTime() / 1000;
 
         if (!!error)
             OnUDPError(error);
@@ -481,16 +1038,9 @@ void UDPServer::PostNextRecvFrom()
             OnUDPClose();
         else
         {
-            Stream stream;
-            stream.WrapRead(&UDPReceiveBuffer[0], bytes_transferred);
+            SPHYNX_TRACE(Logger, "UDP ", Port, ": Got data len=", bytes_transferred);
 
-            Logger.Trace("UDP ", Port, ": Got data len=", stream.GetRemaining());
-
-            std::shared_ptr<Connection> connection;
-            if (MapFind(FromEndpoint, connection))
-                connection->OnUDPData(nowMsec, stream);
-            else
-                HandlePreConnectData(stream);
+            HandleDatagram(nowMsec, &UDPReceiveBuffer[0], bytes_transferred);
 
             PostNextRecvFrom();
         }
@@ -499,115 +1049,24 @@ void UDPServer::PostNextRecvFrom()
 
 int UDPServer::GetConnectionCount() const
 {
-    size_t count = 0;
-    {
-        Locker locker(EstablishedConnectionsMapLock);
-        count += EstablishedConnectionsMap.size();
-    }
-    {
-        Locker locker(PreConnectionsMapLock);
-        count += PreConnectionsMap.size();
-    }
-    return static_cast<int>(count);
+    return ConnectionIds.GetCount();
 }
 
 bool UDPServer::MapInsert(asio::ip::udp::endpoint& addr, const std::shared_ptr<Connection>& conn)
 {
-    Locker locker(EstablishedConnectionsMapLock);
-
     // Returns true if the value was inserted, false if it existed already
-    return EstablishedConnectionsMap.insert(AddressMap::value_type(addr, conn)).second;
+    return EstablishedConnections.Insert(addr, conn);
 }
 
 bool UDPServer::MapRemove(asio::ip::udp::endpoint& addr)
 {
-    std::shared_ptr<Connection> connection;
-    {
-        Locker locker(EstablishedConnectionsMapLock);
-        auto iter = EstablishedConnectionsMap.find(addr);
-        if (iter == EstablishedConnectionsMap.end())
-            return false;
-        connection = iter->second;
-        EstablishedConnectionsMap.erase(iter);
-    }
-    connection.reset(); // Allow object to go out of scope
-    return true;
-}
-
-bool UDPServer::MapFind(asio::ip::udp::endpoint& addr, std::shared_ptr<Connection>& conn)
-{
-    Locker locker(EstablishedConnectionsMapLock);
-    auto iter = EstablishedConnectionsMap.find(addr);
-    if (iter == EstablishedConnectionsMap.end())
-    {
-        conn = nullptr;
-        return false;
-    }
-    conn = iter->second;
-    return true;
+    // Connection is released once no receive handler can still see it
+    return EstablishedConnections.Remove(addr);
 }
 
 void UDPServer::MapClear()
 {
-    std::vector<std::shared_ptr<Connection>> connections;
-    {
-        Locker locker(EstablishedConnectionsMapLock);
-        connections.reserve(EstablishedConnectionsMap.size());
-        for (auto& connection : EstablishedConnectionsMap)
-            connections.push_back(connection.second);
-        EstablishedConnectionsMap.clear();
-    }
-    connections.clear(); // Allow objects to go out of scope
-}
-
-bool UDPServer::PreMapInsert(u32 cookie, const std::shared_ptr<Connection>& conn)
-{
-    Locker locker(PreConnectionsMapLock);
-
-    // Returns true if the value was inserted, false if it existed already
-    return PreConnectionsMap.insert(CookieMap::value_type(cookie, conn)).second;
-}
-
-bool UDPServer::PreMapRemove(u32 cookie)
-{
-    std::shared_ptr<Connection> connection;
-    {
-        Locker locker(PreConnectionsMapLock);
-        auto iter = PreConnectionsMap.find(cookie);
-        if (iter == PreConnectionsMap.end())
-            return false;
-        connection = iter->second;
-        PreConnectionsMap.erase(iter);
-    }
-    connection.reset(); // Allow object to go out of scope
-    return true;
-}
-
-bool UDPServer::PreMapFindRemove(u32 cookie, std::shared_ptr<Connection>& conn)
-{
-    Locker locker(PreConnectionsMapLock);
-    auto iter = PreConnectionsMap.find(cookie);
-    if (iter == PreConnectionsMap.end())
-    {
-        conn = nullptr;
-        return false;
-    }
-    conn = iter->second;
-    PreConnectionsMap.erase(iter);
-    return true;
-}
-
-void UDPServer::PreMapClear()
-{
-    std::vector<std::shared_ptr<Connection>> connections;
-    {
-        Locker locker(PreConnectionsMapLock);
-        connections.reserve(PreConnectionsMap.size());
-        for (auto& connection : PreConnectionsMap)
-            connections.push_back(connection.second);
-        PreConnectionsMap.clear();
-    }
-    connections.clear(); // Allow objects to go out of scope
+    EstablishedConnections.Clear();
 }
 
 void UDPServer::Stop()
@@ -615,7 +1074,6 @@ void UDPServer::Stop()
     Logger.Debug("UDP ", Port, ": Stopping");
 
     MapClear();
-    PreMapClear();
 
     if (UDPSocket)
         UDPSocket->close();
@@ -644,11 +1102,28 @@ void Server::Start(std::shared_ptr<ServerSettings>& settings)
 
     Logger.Info("Starting server on TCP port ", Settings->MainTCPPort, " and UDP ports ", Settings->StartUDPPort, " - ", Settings->StopUDPPort);
 
-    KeyGen.Initialize((u32)GetTimeUsec());
-
     Context = std::make_shared<asio::io_context>();
     Context->restart();
 
+    if (Settings->CollectCallStats)
+        ServerCallStats = std::make_shared<CallStats>(nullptr, kMetricShards);
+
+    ConnectionBytes = std::make_shared<std::atomic<u64>>(0);
+
+    // Measure a connection that never starts
+    {
+        auto probeBytes = std::make_shared<std::atomic<u64>>(0);
+        std::shared_ptr<Connection> probe = createConnection(probeBytes);
+        IdleConnectionBytes = *probeBytes;
+    }
+
+    if (!Settings->CaptureFile.empty())
+    {
+        ServerCapture = std::make_shared<CaptureWriter>();
+        if (!ServerCapture->Open(Settings->CaptureFile))
+            ServerCapture = nullptr;
+    }
+
     Workers = std::make_shared<ServerWorkers>();
     Workers->Start(Context, Settings);
 
@@ -687,14 +1162,21 @@ void Server::OnAccept(const std::shared_ptr<Connection>& connection)
     auto& addr = connection->PeerTCPAddress;
     Logger.Info("Accepted a TCP connection from ", addr.address().to_string(), " : ", addr.port());
 
-    const u32 cookie = KeyGen.Next();
-
     UDPServer* udp = FindLaziestUDPServer();
-    connection->OnAccept(udp->GetUDPSocket(), udp->GetPort(), cookie);
 
-    udp->OnAccept(connection, cookie);
+    const u64 cookie = udp->OnAccept(connection);
+    if (cookie == 0)
+    {
+        connection->Stop();
+        PostNewAccept();
+        return;
+    }
+
+    connection->OnAccept(udp, udp->GetUDPSocket(), udp->GetPort(), cookie);
 
-    Workers->FindLaziestWorker()->AddNewConnection(connection);
+    ServerWorker* worker = Workers->FindLaziestWorker();
+    connection->StatePool = worker->GetTCPStatePool();
+    worker->AddNewConnection(connection);
 
     PostNewAccept();
 }
@@ -723,9 +1205,11 @@ void Server::OnAcceptError(const asio::error_code& error)
 
 void Server::PostNewAccept()
 {
-    auto connection = std::make_shared<Connection>();
+    auto connection = createConnection(ConnectionBytes);
     ConnectionInterface* iface = Settings->Interface->CreateConnection(connection.get());
-    connection->Start(Context, iface);
+    connection->Start(Context, Settings->Interface, iface);
+    if (ServerCapture)
+        connection->SetCapture(ServerCapture);
 
     TCPAcceptor->async_accept(*connection->TCPSocket, connection->PeerTCPAddress, [this, connection](const asio::error_code& error)
     {
@@ -736,6 +1220,37 @@ void Server::PostNewAccept()
     });
 }
 
+std::shared_ptr<Connection> Server::createConnection(const std::shared_ptr<std::atomic<u64>>& allocatedBytes)
+{
+    auto connection = std::allocate_shared<Connection>(CountingAllocator<Connection>(allocatedBytes), allocatedBytes);
+    if (ServerCallStats)
+        connection->EnableCallStats(ServerCallStats);
+    return connection;
+}
+
+void Server::GetMemoryStats(ServerMemoryStats& stats) const
+{
+    stats = ServerMemoryStats();
+
+    if (ConnectionBytes)
+        stats.ConnectionBytes = *ConnectionBytes;
+    stats.IdleConnectionBytes = IdleConnectionBytes;
+
+    for (auto& udp : UDPServers)
+        stats.ConnectionCount += udp->GetConnectionCount();
+
+    if (Workers)
+        Workers->GetTCPStateStats(stats.TCPState);
+}
+
+void Server::GetTickStats(ServerTickStats& stats)
+{
+    stats = ServerTickStats();
+
+    if (Workers)
+        Workers->GetTickStats(stats.Workers);
+}
+
 void Server::Stop()
 {
     Logger.Info("Stopping server");
@@ -753,6 +1268,9 @@ void Server::Stop()
     if (TCPAcceptor)
         TCPAcceptor->cancel();
 
+    if (ServerCapture)
+        ServerCapture->Close();
+
     Workers = nullptr;
     TCPAcceptor = nullptr;
     Context = nullptr;
@@ -1,7 +1,11 @@
 #pragma once
 
 #include "SphynxCommon.h"
-#include <list>
+#include "TimingWheel.h"
+#include "SlotMap.h"
+#include "MPSCQueue.h"
+#include "EndpointMap.h"
+#include "ConnectionIdTable.h"
 
 struct ServerSettings;
 class Connection;
@@ -9,6 +13,7 @@ class ServerWorker;
 class ServerWorkers;
 class UDPServer;
 class Server;
+class Arena;
 
 
 //-----------------------------------------------------------------------------
@@ -32,6 +37,9 @@ public:
     virtual ~ServerInterface() {}
 
     virtual ConnectionInterface* CreateConnection(Connection* connection) = 0;
+
+    // Called from the connection's destructor, once no socket handler can
+    // reach it.  The connection was removed from its worker earlier
     virtual void DestroyConnection(ConnectionInterface* iface, Connection* connection) = 0;
 };
 
@@ -53,6 +61,25 @@ struct ServerSettings
     // Suggested: Provide 2 UDP ports
     unsigned short StopUDPPort = 5061;
 
+    // Suggested: true = Connections borrow the worker thread's zstd contexts
+    // instead of holding their own while active.  See TCPStatePool
+    bool SharedCompressionContexts = true;
+
+    // Suggested: kServerWorkerTimerIntervalMsec = Warn with the slowest
+    // connections when a worker tick runs longer than its interval.
+    // 0 = Never warn
+    unsigned SlowTickMsec = kServerWorkerTimerIntervalMsec;
+
+    // Suggested: false = No per-call accounting.  true = Count calls, bytes
+    // and handler time for each call id, per connection and for the server.
+    // Costs a few atomic adds per call, on lines of the connection and of
+    // the calling thread's shard of the server table
+    bool CollectCallStats = false;
+
+    // Suggested: Empty = No capture.  Otherwise record the decrypted inbound
+    // traffic of every connection to this file for replay.  See Capture.h
+    std::string CaptureFile;
+
     ServerInterface* Interface = nullptr;
 };
 
@@ -60,30 +87,54 @@ struct ServerSettings
 //-----------------------------------------------------------------------------
 // Connection
 
-class Connection : public SphynxPeer
+class Connection : public SphynxPeer, public std::enable_shared_from_this<Connection>
 {
 public:
-    Connection();
+    // See SphynxPeer
+    explicit Connection(const std::shared_ptr<std::atomic<u64>>& allocatedBytes = nullptr);
     virtual ~Connection();
 
+    // Move this connection to another worker thread, so that it ticks on the
+    // same thread as related connections.  The worker is chosen by taking the
+    // hint modulo the worker count.  Takes effect on the next tick
+    void MoveToWorker(unsigned workerHint);
+
+    // Set how often ConnectionInterface::OnTick() is called for this
+    // connection.  Defaults to every worker tick.  Idle sessions can use a
+    // longer interval, and 0 stops the calls so the connection only wakes
+    // up for heartbeats, timeouts and outgoing data
+    void SetTickIntervalMsec(int intervalMsec);
+
+    // Process this connection on the next worker tick
+    void Wake();
+
 protected:
     friend class Server;
     friend class UDPServer;
     friend class ServerWorker;
 
-    void Start(std::shared_ptr<asio::io_context>& context, ConnectionInterface* iface);
+    void Start(std::shared_ptr<asio::io_context>& context, ServerInterface* server, ConnectionInterface* iface);
 
-    void OnAccept(const std::shared_ptr<asio::ip::udp::socket>& udpSocket, unsigned short port, u32 cookie);
+    void OnAccept(UDPServer* udpServer, const std::shared_ptr<asio::ip::udp::socket>& udpSocket, unsigned short port, u64 cookie);
     void OnWorkerStart();
 
     void OnUDPHandshake(asio::ip::udp::endpoint& from, std::shared_ptr<asio::ip::udp::socket>& udpSocket);
 
+    // Switch to a new client UDP address and return the old one
+    asio::ip::udp::endpoint OnUDPMigrate(const asio::ip::udp::endpoint& from);
+    asio::ip::udp::endpoint GetPeerUDPAddress();
+
     bool OnTick(u64 nowMsec);
 
+    void OnNeedsTick() override;
+
     asio::ip::tcp::endpoint PeerTCPAddress;
 
     ConnectionInterface* Interface = nullptr;
 
+    // Destroys Interface along with the connection
+    ServerInterface* OwnerInterface = nullptr;
+
     // Heartbeat timing
     u64 LastTCPHeartbeatMsec = 0;
     u64 LastUDPTimeSyncMsec = 0;
@@ -91,7 +142,52 @@ protected:
     int S2CUDPTimeSyncIntervalMsec = kS2CUDPTimeSyncIntervalFastMsec;
 
     unsigned short UDPPort = 0;
-    uint32_t ConnectionCookie = 0;
+
+    // Handshake cookie.  Low 32 bits are the id in the UDP server's table
+    u64 ConnectionCookie = 0;
+
+    // UDP server that accepted the connection
+    UDPServer* OwnerUDPServer = nullptr;
+
+    // Time the worker started the connection, for the handshake timeout
+    u64 StartMsec = 0;
+
+    // Time of the UDP handshake or of the last UDP address change.  Only the
+    // UDP server receive loop uses it
+    u64 LastUDPMigrateMsec = 0;
+
+    // TCP reads start once the UDP handshake has completed
+    bool TCPReadStarted = false;
+
+    // Set once OnWorkerStart() has run on the first worker
+    bool WorkerStarted = false;
+
+    // Worker index hint requested by MoveToWorker(), or -1 for none
+    std::atomic_int RequestedWorker;
+
+    // Worker that owns the connection, or null while it is between workers
+    std::atomic<ServerWorker*> Worker;
+
+    // Entry in the worker's connection table
+    SlotHandle WorkerHandle;
+
+    // Node in the worker's timing wheel
+    TimerNode WheelNode;
+
+    // Set while the connection is queued to be processed by its worker
+    std::atomic_bool WakePending;
+
+    // User tick timing
+    std::atomic_int TickIntervalMsec;
+    u64 NextUserTickMsec = 0;
+
+    // Time of the next heartbeat, time sync, user tick or timeout
+    u64 NextTickMsec = 0;
+
+    // Time spent in ConnectionInterface::OnTick() and Flush() by the last
+    // OnTick(), for the worker's tick profile
+    u64 LastUserTickUsec = 0;
+    u64 LastFlushUsec = 0;
 
     CallSerializer<S2CTCPHandshakeID, S2CTCPHandshakeT> RPCTCPHandshake;
     CallSerializer<S2CTimeSyncID, S2CTimeSyncT> RPCTimeSyncUDP;
@@ -102,6 +198,22 @@ protected:
 //-----------------------------------------------------------------------------
 // ServerWorker
 
+struct WorkerTickStats
+{
+    // Duration of the last tick, and the longest since the previous call to
+    // GetTickStats()
+    u64 LastTickUsec = 0;
+    u64 PeakTickUsec = 0;
+
+    // How far behind its schedule the last tick started, and the worst since
+    // the previous call.  Slow ticks and a busy thread both add to it
+    u64 LastLagUsec = 0;
+    u64 PeakLagUsec = 0;
+
+    // Ticks longer than ServerSettings::SlowTickMsec since start
+    u64 SlowTicks = 0;
+};
+
 class ServerWorker
 {
 public:
@@ -109,36 +221,87 @@ public:
     ~ServerWorker();
 
     void Start(std::shared_ptr<asio::io_context>& context, unsigned threadId,
-        std::shared_ptr<ServerSettings>& settings);
+        std::shared_ptr<ServerSettings>& settings, ServerWorkers* workers);
     void Stop();
 
     void AddNewConnection(const std::shared_ptr<Connection>& connection);
-    void RemoveConnection(const std::shared_ptr<Connection>& connection);
+
+    // Queue a connection owned by this worker to be processed on the next tick
+    void WakeConnection(const std::shared_ptr<Connection>& connection);
 
     int GetConnectionCount() const
     {
         return ConnectionCount;
     }
 
+    // TCP state for connections accepted onto this worker
+    const std::shared_ptr<TCPStatePool>& GetTCPStatePool() const
+    {
+        return StatePool;
+    }
+
+    // Read the tick timing and start new peaks
+    void GetTickStats(WorkerTickStats& stats);
+
 protected:
     unsigned ThreadId = 0;
+    ServerWorkers* Workers = nullptr;
     std::shared_ptr<asio::io_context> Context;
     std::unique_ptr<asio::steady_timer> Timer;
     std::unique_ptr<std::thread> Thread;
     std::atomic_bool Terminated;
 
-    Lock NewConnectionsLock;
-    std::list<std::shared_ptr<Connection>> NewConnections;
+    // Connections handed to this worker from other threads
+    MPSCQueue<std::shared_ptr<Connection>> NewConnections;
 
-    std::list<std::shared_ptr<Connection>> Connections;
+    Lock WakeQueueLock;
+    std::vector<std::shared_ptr<Connection>> WakeQueue;
+    std::vector<std::shared_ptr<Connection>> WakeQueueWork;
+
+    SlotMap<std::shared_ptr<Connection>> Connections;
+    std::shared_ptr<TCPStatePool> StatePool;
     std::shared_ptr<ServerSettings> Settings;
     std::atomic_int ConnectionCount;
 
+    // Connections are only ticked when their next deadline comes up, or when
+    // they are woken by outgoing data or a disconnect
+    TimingWheel Wheel;
+
+    // Tick timing, written by the worker and read by GetTickStats()
+    std::atomic<u64> LastTickUsec{ 0 };
+    std::atomic<u64> PeakTickUsec{ 0 };
+    std::atomic<u64> LastLagUsec{ 0 };
+    std::atomic<u64> PeakLagUsec{ 0 };
+    std::atomic<u64> SlowTicks{ 0 };
+
+    // Slowest connections of the current tick, slowest first
+    static const int kSlowConnectionCount = 3;
+    struct SlowConnection
+    {
+        u32 Id = 0;
+        u64 Usec = 0;
+        u64 UserTickUsec = 0;
+        u64 FlushUsec = 0;
+    };
+
+    // Phase times added up over the current tick
+    struct TickProfile
+    {
+        u64 UserTickUsec = 0;
+        u64 FlushUsec = 0;
+        int ConnectionCount = 0;
+        SlowConnection Slowest[kSlowConnectionCount];
+    };
+    TickProfile Profile;
+
     void Loop();
     void OnTimerTick();
     void OnTimerError(const asio::error_code& error);
     void PostNextTimer();
-    void PromoteNewConnections();
+    void PromoteNewConnections(u64 nowMsec);
+    void ProcessConnection(Connection* connection, u64 nowMsec);
+    void ProfileConnection(Connection* connection, u64 usec);
+    void OnSlowTick(u64 tickUsec, u64 promoteUsec, u64 lagUsec);
 };
 
 
@@ -156,6 +319,15 @@ public:
 
     ServerWorker* FindLaziestWorker();
 
+    // Returns the worker for the given index hint, modulo the worker count
+    ServerWorker* GetWorker(unsigned workerHint);
+
+    // Adds up the TCP state pools of all workers
+    void GetTCPStateStats(TCPStateStats& stats) const;
+
+    // One entry per worker
+    void GetTickStats(std::vector<WorkerTickStats>& stats);
+
 protected:
     std::shared_ptr<ServerSettings> Settings;
     std::shared_ptr<asio::io_context> Context;
@@ -164,9 +336,49 @@ protected:
 
 
 //-----------------------------------------------------------------------------
-// UDPServer
+// Arena
+//
+// A shard of the game world with its own id space.  Connections that join an
+// arena are moved to the worker for the arena, so all of its connections
+// tick one after another in the same timer handler.  Workers share one
+// io_context, so that handler may run on any worker thread, and network
+// handlers for the connections still run concurrently with it: Per-arena
+// state needs its own locking.  Derive from this to attach per-arena state
+// such as neighbor trackers.
+
+class Arena
+{
+public:
+    Arena(unsigned arenaIndex, unsigned idCount);
+    virtual ~Arena();
+
+    unsigned GetIndex() const
+    {
+        return Index;
+    }
+
+    // Acquire an id in this arena for the connection and move it to the
+    // arena's worker, so its players are ticked together in one pass.
+    // Returns false if the arena is full
+    bool Join(Connection* connection, u32& id);
+
+    // Release an id acquired by Join()
+    void Leave(u32 id);
+
+    int GetCount() const;
+    bool IsFull() const;
+
+protected:
+    const unsigned Index;
+    const unsigned IdCount;
+
+    mutable Lock IdLock;
+    std::vector<u32> FreeIds;
+};
 
-uint32_t hash_ip_addr(const asio::ip::udp::endpoint& addr);
+
+//-----------------------------------------------------------------------------
+// UDPServer
 
 namespace std {
     template<> struct hash<asio::ip::udp::endpoint>
@@ -187,9 +399,14 @@ public:
     void Start(std::shared_ptr<asio::io_context>& context, unsigned short port, std::shared_ptr<ServerSettings>& settings,
         std::shared_ptr<ServerWorkers>& workers,
         std::shared_ptr<UDPServer>& selfRef);
-    void OnAccept(const std::shared_ptr<Connection>& connection, u32 cookie);
+    // Add a connection accepted over TCP and return its handshake cookie,
+    // or 0 if there is no room
+    u64 OnAccept(const std::shared_ptr<Connection>& connection);
     void Stop();
 
+    // Release the cookie, address and id of a connection leaving its worker
+    void OnConnectionClosed(Connection* connection);
+
     int GetConnectionCount() const;
     std::shared_ptr<asio::ip::udp::socket> GetUDPSocket() const
     {
@@ -214,15 +431,14 @@ protected:
 	asio::ip::udp::endpoint FromEndpoint;
     std::array<u8, kUDPDatagramMax> UDPReceiveBuffer;
 
-    typedef std::unordered_map<asio::ip::udp::endpoint, std::shared_ptr<Connection>> AddressMap;
-
-    mutable Lock EstablishedConnectionsMapLock;
-    AddressMap EstablishedConnectionsMap;
+    // Looked up for every datagram, so reads do not lock
+    EndpointMap<Connection> EstablishedConnections;
 
-    typedef std::unordered_map<uint32_t, std::shared_ptr<Connection>> CookieMap;
+    // All connections by id, which is the low half of their cookie
+    ConnectionIdTable<Connection> ConnectionIds;
 
-    mutable Lock PreConnectionsMapLock;
-    CookieMap PreConnectionsMap;
+    // Secret key for handshake cookie MACs
+    u8 CookieKey[16];
 
     // Router for incoming pre-connection calls
     CallRouter PreConnectionRouter;
@@ -232,22 +448,47 @@ protected:
     void OnUDPError(const asio::error_code& error);
     void PostNextRecvFrom();
     void HandlePreConnectData(Stream& stream);
+    void HandleDatagram(u64 nowMsec, const u8* data, size_t bytes);
+    bool HandleConnectionIdData(u64 nowMsec, u64 cookie, Stream& stream);
 
     bool MapInsert(asio::ip::udp::endpoint& addr, const std::shared_ptr<Connection>& conn);
     bool MapRemove(asio::ip::udp::endpoint& addr);
-    bool MapFind(asio::ip::udp::endpoint& addr, std::shared_ptr<Connection>& conn);
     void MapClear();
 
-    bool PreMapInsert(u32 cookie, const std::shared_ptr<Connection>& conn);
-    bool PreMapRemove(u32 cookie);
-    bool PreMapFindRemove(u32 cookie, std::shared_ptr<Connection>& conn);
-    void PreMapClear();
+    // Cookie is the connection id plus a MAC over the id, the client
+    // address and a time bucket, so handshakes are checked without state
+    u64 computeCookie(u32 connectionId, u64 bucket, const asio::ip::address& addr) const;
+    bool checkCookie(u64 cookie, const asio::ip::address& addr, u64 nowMsec) const;
 };
 
 
 //-----------------------------------------------------------------------------
 // Server
 
+struct ServerMemoryStats
+{
+    int ConnectionCount = 0;
+
+    // TCP buffers and compression contexts, held or pooled
+    TCPStateStats TCPState;
+
+    // Bytes held by all connections whether or not they are active, counted
+    // by CountedAlloc(): The connection objects, their UDP packing buffers
+    // and call stats.  Includes the connection waiting for the next accept.
+    // TCP state, sockets and user state are not included
+    u64 ConnectionBytes = 0;
+
+    // The same for one connection with no traffic yet, measured by
+    // allocating one when the server starts
+    u64 IdleConnectionBytes = 0;
+};
+
+struct ServerTickStats
+{
+    // One entry per worker thread
+    std::vector<WorkerTickStats> Workers;
+};
+
 class Server
 {
 public:
@@ -257,13 +498,32 @@ public:
     void Start(std::shared_ptr<ServerSettings>& settings);
     void Stop();
 
+    void GetMemoryStats(ServerMemoryStats& stats) const;
+
+    // Worker tick timing.  Peaks are since the previous call
+    void GetTickStats(ServerTickStats& stats);
+
+    // Calls of all connections added up, or null unless enabled by
+    // ServerSettings::CollectCallStats.  Connections have their own
+    const CallStats* GetCallStats() const
+    {
+        return ServerCallStats.get();
+    }
+
 protected:
     std::shared_ptr<ServerSettings> Settings;
     std::shared_ptr<asio::io_context> Context;
     std::shared_ptr<asio::ip::tcp::acceptor> TCPAcceptor;
     std::vector<std::shared_ptr<UDPServer>> UDPServers;
     std::shared_ptr<ServerWorkers> Workers;
-    Abyssinian KeyGen;
+    std::shared_ptr<CallStats> ServerCallStats;
+    std::shared_ptr<CaptureWriter> ServerCapture;
+
+    // See ServerMemoryStats
+    std::shared_ptr<std::atomic<u64>> ConnectionBytes;
+    u64 IdleConnectionBytes = 0;
+
+    std::shared_ptr<Connection> createConnection(const std::shared_ptr<std::atomic<u64>>& allocatedBytes);
 
     void OnAccept(const std::shared_ptr<Connection>& connection);
     void OnAcceptError(const asio::error_code& error);
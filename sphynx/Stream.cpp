@@ -1,6 +1,7 @@
 #include "Stream.h"
 
 #include <string.h>
+#include <new> // std::nothrow
 
 
 //-----------------------------------------------------------------------------
@@ -18,7 +19,9 @@ Stream::Stream()
 
 Stream::~Stream()
 {
-    delete[] Dynamic;
+    FreeDynamic();
+    if (Dynamic)
+        FreeBuffer(Dynamic, Size);
     Dynamic = nullptr;
     Front = nullptr; // Catch use-after-free
 }
@@ -43,10 +46,49 @@ void Stream::WriteReset()
         return;
     }
 
+    // Keep the first segment to write into again
+    FreeDynamic();
     Used = 0;
 }
 
-bool Stream::Grow(int newUsed)
+u8* Stream::AllocateBuffer(int bytes)
+{
+    if (Allocator)
+        return Allocator->AllocateBuffer(bytes);
+    return new (std::nothrow) u8[bytes];
+}
+
+void Stream::FreeBuffer(u8* data, int bytes)
+{
+    if (Allocator)
+        Allocator->FreeBuffer(data, bytes);
+    else
+        delete[] data;
+}
+
+void Stream::FreeDynamic()
+{
+    if (Chain.empty())
+        return;
+
+    if (Dynamic)
+        FreeBuffer(Dynamic, Size);
+    for (size_t i = 1; i < Chain.size(); ++i)
+    {
+        if (Chain[i].Owned)
+            FreeBuffer(Chain[i].Data, Chain[i].Size);
+    }
+
+    const Segment& first = Chain[0];
+    Front = first.Data;
+    Size = first.Size;
+    Dynamic = first.Owned ? first.Data : nullptr;
+
+    Chain.clear();
+    ChainedUsed = 0;
+}
+
+bool Stream::Grow(int bytes)
 {
     if (!Writing)
     {
@@ -54,13 +96,47 @@ bool Stream::Grow(int newUsed)
         return false;
     }
 
+    const int newUsed = Used + bytes;
+
     // This would cause undefined output for the POW2 function.
-    if (newUsed <= 0)
+    if (bytes <= 0 || newUsed <= 0)
     {
         // Invalid input.
         return false;
     }
 
+    if (SegmentBytes > 0)
+    {
+        // Start a new segment: What was written stays where it is
+        const int segmentSize = bytes > SegmentBytes ? bytes : SegmentBytes;
+
+        u8* segment = AllocateBuffer(segmentSize);
+        if (!segment)
+        {
+            // Out of memory.
+            return false;
+        }
+
+        if (Used > 0)
+        {
+            Segment filled;
+            filled.Data = Front;
+            filled.Size = Size;
+            filled.Used = Used;
+            filled.Owned = (Dynamic != nullptr);
+            Chain.push_back(filled);
+            ChainedUsed += Used;
+        }
+        else if (Dynamic)
+            FreeBuffer(Dynamic, Size);
+
+        Dynamic = Front = segment;
+        Size = segmentSize;
+        Used = 0;
+
+        return true;
+    }
+
     // Bump buffer size to the next power of two.
     int newSize = NextHighestPow2(newUsed);
 
@@ -72,7 +148,7 @@ bool Stream::Grow(int newUsed)
     }
 
     // Allocate this size.
-    u8* newDynamic = new u8[newSize];
+    u8* newDynamic = AllocateBuffer(newSize);
 
     if (!newDynamic)
     {
@@ -84,7 +160,8 @@ bool Stream::Grow(int newUsed)
     memcpy(newDynamic, Front, Used);
 
     // Use the new dynamic buffer.
-    delete[] Dynamic;
+    if (Dynamic)
+        FreeBuffer(Dynamic, Size);
     Dynamic = Front = newDynamic;
     Size = newSize;
 
@@ -93,6 +170,12 @@ bool Stream::Grow(int newUsed)
 
 void Stream::WrapBuffer(void* vbuffer, int size, bool writing)
 {
+    // Release memory from growing past the previous buffer
+    FreeDynamic();
+    if (Dynamic)
+        FreeBuffer(Dynamic, Size);
+    Dynamic = nullptr;
+
     Front     = (u8*)vbuffer;
     Size      = size;
     Writing   = writing;
@@ -108,10 +191,8 @@ void Stream::WrapBuffer(void* vbuffer, int size, bool writing)
 
 u8* Stream::GetBlock(int bytes)
 {
-    int newUsed = Used + bytes;
-
     // If truncated,
-    if (newUsed > Size && !Grow(newUsed))
+    if (bytes < 0 || (bytes > Size - Used && !Grow(bytes)))
     {
         Truncated = true;
         return nullptr;
@@ -121,8 +202,35 @@ u8* Stream::GetBlock(int bytes)
     u8* data = Front + Used;
 
     // Update used count
-    Used = newUsed;
+    Used += bytes;
 
     // Return start of the region
     return data;
 }
+
+u8* Stream::GetSegment(int index, int& bytes) const
+{
+    if (index >= 0 && index < (int)Chain.size())
+    {
+        bytes = Chain[index].Used;
+        return Chain[index].Data;
+    }
+    if (index == (int)Chain.size())
+    {
+        bytes = Used;
+        return Front;
+    }
+
+    bytes = 0;
+    return nullptr;
+}
+
+void Stream::CopyTo(u8* dest) const
+{
+    for (const Segment& segment : Chain)
+    {
+        memcpy(dest, segment.Data, segment.Used);
+        dest += segment.Used;
+    }
+    memcpy(dest, Front, Used);
+}
@@ -6,12 +6,161 @@
 #include <cstring>
 #include <memory>
 #include <vector>
+#include <ostream>
+
+
+//-----------------------------------------------------------------------------
+// vector_view<T>
+//
+// Looks like a vector, none of the safety or memory management. Does not own
+// the buffer it is pointed at.
+//
+// Goes on the wire like std::vector<T>, so either side of an RPC can use it.
+// When used as an RPC parameter, it points into the receive buffer and is
+// only valid until the handler returns: Copy it (e.g. into a ViewArena) to
+// keep it.  Elements are not aligned, so prefer byte types like const u8.
+
+template<typename T>
+struct vector_view {
+public:
+#ifndef ANDROID
+    static_assert(std::is_trivially_copyable<T>::value, "vector_view can only be used with trivially copyable types.");
+#endif
+    vector_view() : buffer(nullptr), count(0) {}
+    vector_view(T* buffer, size_t count) : buffer(buffer), count(count) {}
+    vector_view(const std::vector<typename std::remove_const<T>::type>& vec)
+        : buffer(vec.data()), count(vec.size())
+    {
+    }
+
+    T* data() const
+    {
+        return buffer;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    T* begin() const
+    {
+        return buffer;
+    }
+
+    T* end() const
+    {
+        return buffer + count;
+    }
+
+    T& operator[](size_t i) const
+    {
+        return buffer[i];
+    }
+
+    T* buffer;
+    size_t count;
+};
+
+
+//-----------------------------------------------------------------------------
+// string_view
+//
+// Read-only view of characters that goes on the wire like std::string.
+// Converts from std::string and C strings, so senders can pass either.
+//
+// When used as an RPC parameter, it points into the receive buffer and is
+// only valid until the handler returns: Call str() or copy it into a
+// ViewArena to keep it.  Not null-terminated.
+
+struct string_view
+{
+    string_view() : buffer(nullptr), count(0) {}
+    string_view(const char* buffer, size_t count) : buffer(buffer), count(count) {}
+    string_view(const char* str) : buffer(str), count(strlen(str)) {}
+    string_view(const std::string& str) : buffer(str.data()), count(str.size()) {}
+
+    const char* data() const
+    {
+        return buffer;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    const char* begin() const
+    {
+        return buffer;
+    }
+
+    const char* end() const
+    {
+        return buffer + count;
+    }
+
+    // Owning copy
+    std::string str() const
+    {
+        return std::string(buffer, count);
+    }
+
+    bool operator==(const string_view& other) const
+    {
+        return count == other.count && (count == 0 || memcmp(buffer, other.buffer, count) == 0);
+    }
+    bool operator!=(const string_view& other) const
+    {
+        return !(*this == other);
+    }
+
+    const char* buffer;
+    size_t count;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const string_view& str)
+{
+    return os.write(str.data(), str.size());
+}
+
+
+//-----------------------------------------------------------------------------
+// StreamAllocator
+//
+// Provides the memory a Stream grows into once it is written past the end of
+// its wrapped buffer.  Streams without one use new[] and delete[].
+
+class StreamAllocator
+{
+public:
+    virtual ~StreamAllocator() {}
+
+    // Returns nullptr on failure
+    virtual u8* AllocateBuffer(size_t bytes) = 0;
+    virtual void FreeBuffer(u8* data, size_t bytes) = 0;
+};
 
 
 //-----------------------------------------------------------------------------
 // Stream
 //
 // Wraps a fixed-length buffer for reading/writing.
+//
+// Writing past the end of the buffer grows it: By default into a larger
+// copy, or with SetSegmentBytes() into a chain of segments so nothing that
+// was written gets copied again.  A chained stream is not contiguous: Read
+// it back with GetSegment() or CopyTo() instead of GetFront().
 class Stream
 {
 public:
@@ -39,14 +188,29 @@ public:
 
     void WrapBuffer(void* buffer, int size, bool writing);
 
+    // Memory to grow into, or nullptr for the heap.  Must outlive the stream
+    void SetAllocator(StreamAllocator* allocator) { Allocator = allocator; }
+
+    // Grow by chaining segments of at least this many bytes, or 0 to grow
+    // by copying into a larger buffer
+    void SetSegmentBytes(int bytes) { SegmentBytes = bytes; }
+
     // Getters
     bool IsWriting() const { return Writing; }
     bool Good() const { return !Truncated; }
-    int GetUsed() const { return Used; }
+    int GetUsed() const { return ChainedUsed + Used; }
     int GetBufferSize() const { return Size; }
     int GetRemaining() const { return Size - Used; }
-    u8* GetFront() const { return Front; }
-    bool IsDynamic() const { return Dynamic != nullptr; }
+    u8* GetFront() const { return Chain.empty() ? Front : Chain[0].Data; }
+    bool IsDynamic() const { return Dynamic != nullptr || !Chain.empty(); }
+
+    // Segments, in order.  Only the last one can be partially filled
+    bool IsContiguous() const { return Chain.empty(); }
+    int GetSegmentCount() const { return (int)Chain.size() + 1; }
+    u8* GetSegment(int index, int& bytes) const;
+
+    // Copy all written bytes to a buffer of at least GetUsed() bytes
+    void CopyTo(u8* dest) const;
 
     bool UsedWholeBuffer() const { return Size == Used; }
 
@@ -76,29 +240,9 @@ public:
         return SerializeVec(vec);
     }
 
-    // Looks like a vector, none of the safety or memory management. Does not own the buffer it is pointed at.
+    // See ::vector_view<T> above
     template<typename T>
-    struct vector_view {
-    public:
-#ifndef ANDROID
-        static_assert(std::is_trivially_copyable<T>::value, "vector_view can only be used with trivially copyable types.");
-#endif
-        vector_view() : buffer(nullptr), count(0) {}
-        vector_view(T* buffer, size_t count) : buffer(buffer), count(count) {}
-
-        T* data() const
-        {
-            return buffer;
-        }
-
-        size_t size() const
-        {
-            return count;
-        }
-
-        T* buffer;
-        size_t count;
-    };
+    using vector_view = ::vector_view<T>;
 
     template<typename T>
     inline bool Serialize(vector_view<T>& vec)
@@ -125,6 +269,12 @@ public:
     template<typename RealType, typename SerializeType>
         inline bool SerializeAs(const RealType& var);
 
+    // Serialize an unsigned integer in 7-bit groups, low bits first.
+    // The high bit of each byte is set if more bytes follow, so values below
+    // 128 take a single byte.
+    template<typename T>
+        inline bool SerializeVarInt(T& var);
+
 private:
     // Writing = true: Serialize() will write to the buffer and fail when it runs out of space.
     // Writing = false: Serialize() will read from the buffer and fail on truncation.
@@ -136,10 +286,29 @@ private:
 
     // Dynamic buffer implementation:
     u8* Dynamic;        // Buffer allocated dynamically to store data
+    StreamAllocator* Allocator = nullptr;
+    int SegmentBytes = 0;
 
-    // Grow the buffer dynamically. Returns false on any failure.
+    // Segments filled before the current one at Front
+    struct Segment
+    {
+        u8* Data;
+        int Size;
+        int Used;
+        bool Owned;
+    };
+    std::vector<Segment> Chain;
+    int ChainedUsed = 0;
+
+    // Grow the buffer dynamically to fit another block. Returns false on any failure.
     // This will always fail during reading.  During writing, it may allocate a dynamic buffer.
-    bool Grow(int newUsed);
+    bool Grow(int bytes);
+
+    u8* AllocateBuffer(int bytes);
+    void FreeBuffer(u8* data, int bytes);
+
+    // Free everything that was allocated, leaving Front on the first segment
+    void FreeDynamic();
 
     // Internal vector serializing methods.
     template<typename T>
@@ -171,6 +340,8 @@ template<> inline bool Stream::Serialize(const bool& var);
 template<> inline bool Stream::Serialize(std::string& var);
 template<> inline bool Stream::Serialize(const std::string& var);
 template<> inline bool Stream::Serialize(const char*& var);
+template<> inline bool Stream::Serialize(string_view& var);
+template<> inline bool Stream::Serialize(const string_view& var);
 
 
 //-----------------------------------------------------------------------------
@@ -195,15 +366,15 @@ inline bool Stream::Serialize(T& var)
     if (Truncated)
         return false;
 
-    int newUsed = Used + (int)sizeof(T);
-
     // If truncated,
-    if (newUsed > Size && !Grow(newUsed))
+    if (Used + (int)sizeof(T) > Size && !Grow((int)sizeof(T)))
     {
         Truncated = true;
         return false;
     }
 
+    const int newUsed = Used + (int)sizeof(T);
+
 #ifdef ANDROID
     u8* ptr = Front + newUsed - sizeof(T);
     if (Writing)
@@ -296,6 +467,74 @@ inline bool Stream::SerializeAs(const RealType& var)
 }
 
 
+// Serialize an unsigned integer in 7-bit groups, low bits first.
+template<typename T>
+inline bool Stream::SerializeVarInt(T& var)
+{
+    static_assert(std::is_unsigned<T>::value, "SerializeVarInt can only take unsigned types.");
+
+    static const int kMaxBytes = (sizeof(T) * 8 + 6) / 7;
+
+    // Bits of T left for the last of kMaxBytes bytes
+    static const int kLastByteBits = (int)sizeof(T) * 8 - 7 * (kMaxBytes - 1);
+
+    if (IsWriting())
+    {
+        u8 bytes[kMaxBytes];
+        int count = 0;
+        T value = var;
+        do
+        {
+            u8 b = (u8)(value & 0x7f);
+            value = (T)(value >> 7);
+            if (value != 0)
+                b |= 0x80;
+            bytes[count++] = b;
+        } while (value != 0);
+
+        u8* block = GetBlock(count);
+        if (!block)
+            return false;
+
+        memcpy(block, bytes, count);
+    }
+    else
+    {
+        T value = 0;
+        for (int i = 0; i < kMaxBytes; ++i)
+        {
+            u8 b = 0;
+            if (!Serialize(b))
+                return false;
+
+            value |= (T)((T)(b & 0x7f) << (7 * i));
+
+            if ((b & 0x80) == 0)
+            {
+                // Reject bits that do not fit in T, and a final zero group
+                // that the writer never emits, so each value has exactly one
+                // encoding
+                if ((i == kMaxBytes - 1 && (b >> kLastByteBits) != 0) ||
+                    (b == 0 && i > 0))
+                {
+                    Truncate();
+                    return false;
+                }
+
+                var = value;
+                return true;
+            }
+        }
+
+        // Too many bytes for the type
+        Truncate();
+        return false;
+    }
+
+    return true;
+}
+
+
 //-----------------------------------------------------------------------------
 // Common serialization functions
 
@@ -421,6 +660,50 @@ template<> inline bool Stream::Serialize(const char*& var)
     return true;
 }
 
+template<> inline bool Stream::Serialize(string_view& var)
+{
+    if (IsWriting())
+        return Serialize((const string_view&)var);
+
+    int len = 0;
+    if (!Serialize(len) || len < 0)
+        return false;
+
+    u8* block = GetBlock(len);
+    if (!block)
+        return false;
+
+    // Points into the read buffer: No copy
+    var.buffer = (const char*)block;
+    var.count = len;
+
+    return true;
+}
+
+template<> inline bool Stream::Serialize(const string_view& var)
+{
+    if (!IsWriting())
+    {
+        Truncate();
+        return false;
+    }
+
+    int len = (int)var.size();
+    if (len < 0 || (size_t)len != var.size())
+        return false;
+
+    if (!Serialize(len))
+        return false;
+
+    u8* block = GetBlock(len);
+    if (!block)
+        return false;
+
+    memcpy(block, var.data(), len);
+
+    return true;
+}
+
 template<typename T>
 inline bool Stream::SerializeVec(std::vector<T>& vec)
 {
@@ -448,7 +731,7 @@ inline bool Stream::SerializeVec(std::vector<T>& vec)
             return false;
         }
 
-        char* block = GetBlock(len);
+        u8* block = GetBlock(len);
         if (!block)
         {
             return false;
@@ -494,7 +777,7 @@ inline bool Stream::SerializeVec(const std::vector<T>& vec)
         return false;
     }
 
-    char* block = GetBlock(len);
+    u8* block = GetBlock(len);
     if (!block)
     {
         return false;
@@ -532,7 +815,7 @@ inline bool Stream::SerializeVecView(vector_view<T>& vec)
             return false;
         }
 
-        char* block = GetBlock(len);
+        u8* block = GetBlock(len);
         if (!block)
         {
             return false;
@@ -578,7 +861,7 @@ inline bool Stream::SerializeVecView(const vector_view<T>& vec)
         return false;
     }
 
-    char* block = GetBlock(len);
+    u8* block = GetBlock(len);
     if (!block)
     {
         return false;
@@ -590,6 +873,30 @@ inline bool Stream::SerializeVecView(const vector_view<T>& vec)
 }
 
 
+//-----------------------------------------------------------------------------
+// VarInt<T>
+//
+// Unsigned integer that goes on the wire via Stream::SerializeVarInt().
+// Converts to and from T, so it can be used as an RPC parameter type in place
+// of T to let small values take fewer bytes.
+
+template<typename T>
+struct VarInt
+{
+    T Value = 0;
+
+    VarInt() {}
+    VarInt(T value) : Value(value) {}
+
+    operator T() const { return Value; }
+
+    bool Serialize(Stream& stream)
+    {
+        return stream.SerializeVarInt(Value);
+    }
+};
+
+
 //-----------------------------------------------------------------------------
 // Serialize() free function
 //
@@ -0,0 +1,83 @@
+#include "TimingWheel.h"
+
+
+//-----------------------------------------------------------------------------
+// TimingWheel
+
+TimingWheel::TimingWheel()
+{
+    for (auto& level : Slots)
+    {
+        for (auto& head : level)
+        {
+            head.Next = head.Prev = &head;
+        }
+    }
+}
+
+void TimingWheel::Schedule(TimerNode* node, u64 expireTick)
+{
+    Cancel(node);
+
+    // Nodes scheduled for now or the past expire on the next tick
+    if ((s64)(expireTick - CurrentTick) <= 0)
+        expireTick = CurrentTick + 1;
+
+    node->ExpireTick = expireTick;
+    insert(node);
+    ++Count;
+}
+
+void TimingWheel::Cancel(TimerNode* node)
+{
+    if (!node->IsScheduled())
+        return;
+
+    node->Prev->Next = node->Next;
+    node->Next->Prev = node->Prev;
+    node->Next = node->Prev = nullptr;
+    --Count;
+}
+
+void TimingWheel::insert(TimerNode* node)
+{
+    u64 delta = node->ExpireTick - CurrentTick;
+
+    // Clamp to the range of the top level
+    const u64 kMaxDelta = ((u64)1 << (kSlotBits * kLevelCount)) - 1;
+    if (delta > kMaxDelta)
+    {
+        delta = kMaxDelta;
+        node->ExpireTick = CurrentTick + kMaxDelta;
+    }
+
+    // Pick the lowest level that can hold the delay
+    int level = 0;
+    while (level < kLevelCount - 1 && delta >= ((u64)1 << (kSlotBits * (level + 1))))
+        ++level;
+
+    const unsigned slot = (unsigned)(node->ExpireTick >> (kSlotBits * level)) & kSlotMask;
+    TimerNode* head = &Slots[level][slot];
+
+    // Append to the slot list
+    node->Next = head;
+    node->Prev = head->Prev;
+    head->Prev->Next = node;
+    head->Prev = node;
+}
+
+void TimingWheel::cascade(int level, unsigned slot)
+{
+    TimerNode* head = &Slots[level][slot];
+
+    TimerNode* node = head->Next;
+    head->Next = head->Prev = head;
+
+    // Re-insert each node, which moves it to a lower level
+    while (node != head)
+    {
+        TimerNode* next = node->Next;
+        insert(node);
+        node = next;
+    }
+}
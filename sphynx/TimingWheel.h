@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Tools.h"
+
+
+//-----------------------------------------------------------------------------
+// TimerNode
+//
+// Intrusive list node for TimingWheel.  Embed one in each object that needs
+// to be scheduled and point Context back at the object.
+
+struct TimerNode
+{
+    TimerNode* Next = nullptr;
+    TimerNode* Prev = nullptr;
+
+    // Wheel tick at which the node expires
+    u64 ExpireTick = 0;
+
+    // Owner of the node
+    void* Context = nullptr;
+
+    bool IsScheduled() const
+    {
+        return Next != nullptr;
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+// TimingWheel
+//
+// Hierarchical timing wheel: Four levels of 256 slots, where each slot on a
+// level spans all the slots of the level below.  Scheduling and cancelling
+// are O(1), and advancing by one tick only touches the nodes that expire on
+// that tick plus, once every 256 ticks, the nodes cascading down from the
+// next level.  So timers that are not due cost nothing per tick.
+//
+// Not thread-safe: Meant to be owned and driven by a single worker thread.
+
+class TimingWheel
+{
+public:
+    TimingWheel();
+
+    // No copies, please.
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    u64 GetCurrentTick() const
+    {
+        return CurrentTick;
+    }
+
+    int GetCount() const
+    {
+        return Count;
+    }
+
+    // Schedule a node to expire on the given tick.  Ticks that are not in the
+    // future expire on the next call to Advance().  Reschedules the node if it
+    // is already scheduled
+    void Schedule(TimerNode* node, u64 expireTick);
+
+    // Unschedule a node.  Safe to call on nodes that are not scheduled
+    void Cancel(TimerNode* node);
+
+    // Advance the wheel by one tick and call expired(TimerNode*) for each node
+    // that expires.  Nodes are unscheduled before the callback, so the callback
+    // may reschedule them
+    template<typename F>
+    void Advance(F&& expired)
+    {
+        ++CurrentTick;
+
+        // Cascade higher levels down when the lower level wraps around
+        for (int level = 1; level < kLevelCount; ++level)
+        {
+            const unsigned shift = kSlotBits * level;
+            if (((CurrentTick >> (shift - kSlotBits)) & kSlotMask) != 0)
+                break;
+            cascade(level, (unsigned)(CurrentTick >> shift) & kSlotMask);
+        }
+
+        TimerNode* head = &Slots[0][CurrentTick & kSlotMask];
+
+        // Detach the whole slot first so callbacks can reschedule safely
+        TimerNode* node = head->Next;
+        head->Next = head->Prev = head;
+
+        while (node != head)
+        {
+            TimerNode* next = node->Next;
+            node->Next = node->Prev = nullptr;
+            --Count;
+            expired(node);
+            node = next;
+        }
+    }
+
+protected:
+    static const unsigned kSlotBits = 8;
+    static const unsigned kSlotCount = 1 << kSlotBits;
+    static const unsigned kSlotMask = kSlotCount - 1;
+    static const int kLevelCount = 4;
+
+    u64 CurrentTick = 0;
+    int Count = 0;
+
+    // Circular list heads
+    TimerNode Slots[kLevelCount][kSlotCount];
+
+    void insert(TimerNode* node);
+    void cascade(int level, unsigned slot);
+};
@@ -1,9 +1,11 @@
 #include "Tools.h"
 
+#include <cstdlib>
+
 #ifndef _WIN32
 #include <pthread.h>
 #include <unistd.h>
-#include <sys/time.h> // gettimeofday
+#include <time.h> // clock_gettime
 #endif
 
 #ifdef _WIN32
@@ -101,9 +103,9 @@ u64 GetTimeUsec()
     }
     return (u64)(PerfFrequencyInverse * timeStamp.QuadPart);
 #else
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    return 1000000 * tv.tv_sec + tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000 * (u64)ts.tv_sec + (u64)ts.tv_nsec / 1000;
 #endif // _WIN32
 }
 
@@ -123,9 +125,9 @@ u64 GetTimeMsec()
     }
     return (u64)(PerfFrequencyInverse * timeStamp.QuadPart);
 #else
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    return 1000 * tv.tv_sec + tv.tv_usec / 1000;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000 * (u64)ts.tv_sec + (u64)ts.tv_nsec / 1000000;
 #endif // _WIN32
 }
 
@@ -133,7 +135,50 @@ u64 GetSloppyMsec()
 {
 #ifdef _WIN32
     return ::GetTickCount64();
+#elif defined(CLOCK_MONOTONIC_COARSE)
+    // Served from the last timer interrupt without touching the hardware
+    // clock.  Same time base as CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return 1000 * (u64)ts.tv_sec + (u64)ts.tv_nsec / 1000000;
 #else
     return GetTimeMsec();
 #endif // _WIN32
 }
+
+thread_local u64 CachedTimeUsec = 0;
+
+u64 UpdateCachedTime()
+{
+    const u64 nowUsec = GetTimeUsec();
+    CachedTimeUsec = nowUsec;
+    return nowUsec;
+}
+
+//// Counted allocation
+
+// Size is kept in front of the allocation for CountedFree()
+static const size_t kCountedHeaderBytes = 16;
+
+void* CountedAlloc(std::atomic<u64>* counter, size_t size)
+{
+    u8* block = (u8*)malloc(size + kCountedHeaderBytes);
+    if (!block)
+        return nullptr;
+    *(size_t*)block = size;
+
+    if (counter)
+        *counter += size;
+    return block + kCountedHeaderBytes;
+}
+
+void CountedFree(std::atomic<u64>* counter, void* address)
+{
+    if (!address)
+        return;
+    u8* block = (u8*)address - kCountedHeaderBytes;
+
+    if (counter)
+        *counter -= *(size_t*)block;
+    free(block);
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <new>
 #include <thread>
+#include <type_traits>
 
 #ifdef _WIN32
     #define WIN32_LEAN_AND_MEAN
@@ -116,10 +120,35 @@ private:
     Lock* TheLock;
 };
 
+// Monotonic clock: Never steps when the system time is set, so timeouts and
+// timestamp reconstruction survive NTP adjustments.  Counts from an arbitrary
+// point, so times are only comparable within one machine
 u64 GetTimeUsec();
 u64 GetTimeMsec();
+
+// Coarse monotonic clock that is cheaper to read, at a resolution of a few
+// milliseconds.  For deadlines that do not need better
 u64 GetSloppyMsec();
 
+// Time cached for the calling thread, so that hot paths read the clock once
+// per loop iteration instead of once per packet.  Worker ticks and socket
+// handlers call UpdateCachedTime() on entry, and code running under them
+// calls GetCachedMsec().  Threads that never update read the clock instead
+extern thread_local u64 CachedTimeUsec;
+
+// Read the clock into the calling thread's cached time.  Returns it in usec
+u64 UpdateCachedTime();
+
+FORCE_INLINE u64 GetCachedUsec()
+{
+    const u64 cachedUsec = CachedTimeUsec;
+    return cachedUsec != 0 ? cachedUsec : GetTimeUsec();
+}
+FORCE_INLINE u64 GetCachedMsec()
+{
+    return GetCachedUsec() / 1000;
+}
+
 // When counters are in milliseconds, this is 32 seconds ahead and behind
 FORCE_INLINE u64 ReconstructCounter16(u64 center_count, u16 sixteen_bits)
 {
@@ -224,6 +253,107 @@ public:
 #define ALIGNED_TYPE(t,x) typedef t CAT_ALIGNED(x)
 
 
+//-----------------------------------------------------------------------------
+// Counted allocation
+//
+// malloc() and free() that keep the bytes in use in a counter, so that memory
+// stats are measured rather than estimated.  A null counter counts nothing.
+// The counter must outlive the allocations.
+
+void* CountedAlloc(std::atomic<u64>* counter, size_t size);
+void CountedFree(std::atomic<u64>* counter, void* address);
+
+// Deleter for CountedPtr.  Arrays must be of trivially destructible types
+template<typename T>
+struct CountedDeleter
+{
+    std::atomic<u64>* Counter = nullptr;
+
+    void operator()(T* object) const
+    {
+        object->~T();
+        CountedFree(Counter, object);
+    }
+};
+template<typename T>
+struct CountedDeleter<T[]>
+{
+    std::atomic<u64>* Counter = nullptr;
+
+    void operator()(T* objects) const
+    {
+        CountedFree(Counter, objects);
+    }
+};
+
+template<typename T>
+using CountedPtr = std::unique_ptr<T, CountedDeleter<T>>;
+
+template<typename T, typename... Args>
+CountedPtr<T> MakeCounted(std::atomic<u64>* counter, Args&&... args)
+{
+    void* address = CountedAlloc(counter, sizeof(T));
+    if (!address)
+        throw std::bad_alloc();
+    return CountedPtr<T>(new (address) T(std::forward<Args>(args)...), CountedDeleter<T>{ counter });
+}
+
+// Uninitialized array
+template<typename T>
+CountedPtr<T[]> MakeCountedArray(std::atomic<u64>* counter, size_t count)
+{
+    static_assert(std::is_trivially_destructible<T>::value, "Counted arrays are not destroyed.");
+    void* address = CountedAlloc(counter, count * sizeof(T));
+    if (!address)
+        throw std::bad_alloc();
+    return CountedPtr<T[]>(static_cast<T*>(address), CountedDeleter<T[]>{ counter });
+}
+
+// Allocator for std::allocate_shared() that counts.  The object holds on to
+// the counter until its memory is freed
+template<typename T>
+class CountingAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit CountingAllocator(const std::shared_ptr<std::atomic<u64>>& counter)
+        : Counter(counter)
+    {
+    }
+    template<typename U>
+    CountingAllocator(const CountingAllocator<U>& other)
+        : Counter(other.Counter)
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        void* address = CountedAlloc(Counter.get(), count * sizeof(T));
+        if (!address)
+            throw std::bad_alloc();
+        return static_cast<T*>(address);
+    }
+    void deallocate(T* address, size_t)
+    {
+        CountedFree(Counter.get(), address);
+    }
+
+    template<typename U>
+    bool operator==(const CountingAllocator<U>& other) const
+    {
+        return Counter == other.Counter;
+    }
+    template<typename U>
+    bool operator!=(const CountingAllocator<U>& other) const
+    {
+        return Counter != other.Counter;
+    }
+
+    std::shared_ptr<std::atomic<u64>> Counter;
+};
+
+
 //-----------------------------------------------------------------------------
 // Read/Write Lock
 
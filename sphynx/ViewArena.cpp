@@ -0,0 +1,98 @@
+#include "ViewArena.h"
+
+#include <new> // std::nothrow
+
+
+//-----------------------------------------------------------------------------
+// ViewArena
+
+ViewArena::ViewArena(size_t blockBytes)
+    : BlockBytes(blockBytes > 0 ? blockBytes : kDefaultBlockBytes)
+{
+}
+
+u8* ViewArena::Allocate(size_t bytes, size_t alignment)
+{
+    // Zero-length copies still get a unique, valid pointer
+    if (bytes == 0)
+        bytes = 1;
+
+    size_t padding = (alignment - ((uintptr_t)Next & (alignment - 1))) & (alignment - 1);
+
+    if (!Next || padding + bytes > Remaining)
+    {
+        // Oversized requests get a block of their own
+        const size_t blockBytes = bytes + alignment > BlockBytes ? bytes + alignment : BlockBytes;
+
+        u8* block = new (std::nothrow) u8[blockBytes];
+        if (!block)
+            return nullptr;
+
+        Blocks.emplace_back(block);
+        if (Blocks.size() == 1)
+            FirstBlockBytes = blockBytes;
+        AllocatedBytes += blockBytes;
+
+        Next = block;
+        Remaining = blockBytes;
+        padding = (alignment - ((uintptr_t)Next & (alignment - 1))) & (alignment - 1);
+    }
+
+    u8* data = Next + padding;
+    Next += padding + bytes;
+    Remaining -= padding + bytes;
+    return data;
+}
+
+string_view ViewArena::Copy(string_view str)
+{
+    u8* copy = Allocate(str.size());
+    if (!copy)
+        return string_view();
+
+    if (!str.empty())
+        memcpy(copy, str.data(), str.size());
+    return string_view((const char*)copy, str.size());
+}
+
+void ViewArena::Reset()
+{
+    if (Blocks.empty())
+        return;
+
+    Blocks.resize(1);
+    AllocatedBytes = FirstBlockBytes;
+
+    Next = Blocks[0].get();
+    Remaining = FirstBlockBytes;
+}
+
+
+//-----------------------------------------------------------------------------
+// StreamArena
+
+u8* StreamArena::AllocateBuffer(size_t bytes)
+{
+    u8* data = Arena.Allocate(bytes, 8);
+    if (data)
+        ++Outstanding;
+    return data;
+}
+
+void StreamArena::FreeBuffer(u8* data, size_t bytes)
+{
+    if (!data || Outstanding <= 0)
+    {
+        DEBUG_BREAK; return;
+    }
+
+    if (--Outstanding == 0)
+        Arena.Reset();
+}
+
+static thread_local StreamArena ThreadStreamArena;
+
+StreamArena& GetThreadStreamArena()
+{
+    return ThreadStreamArena;
+}
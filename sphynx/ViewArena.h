@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Stream.h"
+#include <memory>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// ViewArena
+//
+// Owning storage for data that arrived as string_view or vector_view RPC
+// parameters.  Copies are bump-allocated from large blocks and stay valid
+// until Reset() or destruction, so a handler can keep many small strings
+// without one heap allocation each.
+//
+// Memory is only given back by Reset(), so give an arena the lifetime of
+// the data: For example one per connection for login details.
+//
+// Not thread-safe.
+
+class ViewArena
+{
+public:
+    static const size_t kDefaultBlockBytes = 4096;
+
+    explicit ViewArena(size_t blockBytes = kDefaultBlockBytes);
+
+    // No copies, please.
+    ViewArena(const ViewArena&) = delete;
+    ViewArena& operator=(const ViewArena&) = delete;
+
+    // Returns nullptr if out of memory
+    u8* Allocate(size_t bytes, size_t alignment = 1);
+
+    // Returns an empty view if out of memory
+    string_view Copy(string_view str);
+
+    template<typename T>
+    vector_view<const T> Copy(vector_view<T> vec)
+    {
+        const size_t bytes = vec.size() * sizeof(T);
+        u8* copy = Allocate(bytes, alignof(T));
+        if (!copy)
+            return vector_view<const T>();
+
+        if (bytes > 0)
+            memcpy(copy, vec.data(), bytes);
+        return vector_view<const T>(reinterpret_cast<const T*>(copy), vec.size());
+    }
+
+    // Invalidate all copies.  Keeps the first block for reuse
+    void Reset();
+
+    // Bytes held in blocks, including unused space at the end of each
+    size_t GetAllocatedBytes() const
+    {
+        return AllocatedBytes;
+    }
+
+protected:
+    size_t BlockBytes;
+
+    std::vector<std::unique_ptr<u8[]>> Blocks;
+    size_t FirstBlockBytes = 0;
+    size_t AllocatedBytes = 0;
+
+    // Bump pointer in the last block
+    u8* Next = nullptr;
+    size_t Remaining = 0;
+};
+
+
+//-----------------------------------------------------------------------------
+// StreamArena
+//
+// StreamAllocator that bump-allocates from a ViewArena.  Frees are only
+// counted: Once every buffer handed out has been freed again, the arena
+// rewinds to its first block.  Streams that are built and sent within one
+// call therefore grow without touching the heap after the first time.
+//
+// Not thread-safe: Each thread has its own in GetThreadStreamArena().
+
+class StreamArena : public StreamAllocator
+{
+public:
+    static const size_t kBlockBytes = 65536;
+
+    StreamArena()
+        : Arena(kBlockBytes)
+    {
+    }
+
+    u8* AllocateBuffer(size_t bytes) override;
+    void FreeBuffer(u8* data, size_t bytes) override;
+
+    size_t GetAllocatedBytes() const
+    {
+        return Arena.GetAllocatedBytes();
+    }
+
+protected:
+    ViewArena Arena;
+
+    // Buffers handed out and not yet freed
+    size_t Outstanding = 0;
+};
+
+// Arena for the calling thread
+StreamArena& GetThreadStreamArena();
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "Tools.h"
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+
+//-----------------------------------------------------------------------------
+// BenchTools
+//
+// Helpers shared by the benchmark programs
+
+// xorshift32: The same sequence on every run, so inputs are comparable
+// across runs and builds.  State must not be 0
+inline u32 NextRandom(u32& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Raise the open file limit to the hard limit, since every client and
+// connection holds sockets.  Returns false if it could not be raised
+inline bool RaiseOpenFileLimit()
+{
+#if !defined(_WIN32)
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return false;
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            return false;
+    }
+#endif
+    return true;
+}
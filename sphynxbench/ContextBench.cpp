@@ -0,0 +1,181 @@
+#include "SphynxCommon.h"
+#include "BenchTools.h"
+
+static logging::Channel Logger("ContextBench");
+
+
+//-----------------------------------------------------------------------------
+// ContextBench
+//
+// Compares private and shared zstd contexts: Every simulated connection
+// holds TCP send and receive states from a TCPStatePool, and each round
+// compresses one flush per connection and decompresses it again, in
+// round-robin order like a worker tick does.
+
+// Defaults, overridden by: ContextBench [connections] [rounds] [flushBytes]
+static const int kDefaultConnectionCount = 2000;
+static const int kDefaultRoundCount = 20;
+static const int kDefaultFlushBytes = 1000;
+
+// Build a flush that looks like packed RPCs: Position updates that change a
+// little each time, with some chat text mixed in
+static void FillPayload(u8* data, int bytes, u32 seed)
+{
+    static const char* kChat = "hello there, anyone up for another round in arena 2?";
+    const int chatBytes = (int)strlen(kChat);
+
+    u32 state = seed | 1;
+    int offset = 0;
+    u16 x = (u16)NextRandom(state), y = (u16)NextRandom(state);
+
+    while (offset < bytes)
+    {
+        u8 message[64];
+        int messageBytes;
+
+        if (NextRandom(state) % 16 == 0)
+        {
+            message[0] = 10; // Chat
+            messageBytes = 1 + chatBytes;
+            memcpy(message + 1, kChat, chatBytes);
+        }
+        else
+        {
+            x += (u16)(NextRandom(state) % 8);
+            y += (u16)(NextRandom(state) % 8);
+            message[0] = 11; // Position
+            message[1] = (u8)(NextRandom(state) % 200); // Player id
+            memcpy(message + 2, &x, 2);
+            memcpy(message + 4, &y, 2);
+            messageBytes = 6;
+        }
+
+        if (messageBytes > bytes - offset)
+            messageBytes = bytes - offset;
+        memcpy(data + offset, message, messageBytes);
+        offset += messageBytes;
+    }
+}
+
+struct BenchResult
+{
+    double Seconds = 0.;
+    u64 Flushes = 0;
+    u64 InputBytes = 0;
+    u64 CompressedBytes = 0;
+    TCPStateStats Stats;
+};
+
+static bool RunMode(bool sharedContexts, int connectionCount, int roundCount, int flushBytes, BenchResult& result)
+{
+    TCPStatePool pool(sharedContexts);
+
+    std::vector<std::unique_ptr<TCPSendState>> sendStates(connectionCount);
+    std::vector<std::unique_ptr<TCPReceiveState>> receiveStates(connectionCount);
+    for (int i = 0; i < connectionCount; ++i)
+    {
+        sendStates[i] = pool.AcquireSend();
+        receiveStates[i] = pool.AcquireReceive();
+        if (!sendStates[i] || !receiveStates[i])
+            return false;
+    }
+
+    std::vector<u8> payload(flushBytes);
+    std::vector<u8> frame;
+    u64 deliveredBytes = 0;
+    bool valid = true;
+
+    // Round 0 warms up the contexts and is not timed
+    u64 t0 = 0;
+    for (int round = 0; round <= roundCount; ++round)
+    {
+        if (round == 1)
+            t0 = GetTimeUsec();
+
+        for (int i = 0; i < connectionCount; ++i)
+        {
+            FillPayload(&payload[0], flushBytes, (u32)(i * 7919 + round));
+            memcpy(sendStates[i]->OutBuffer, &payload[0], flushBytes);
+
+            frame.clear();
+            valid &= CompressTCPFrame(sendStates[i]->GetContext(),
+                sendStates[i]->CompressionBuffer, sendStates[i]->CompressionBufferSize,
+                sendStates[i]->OutBuffer, flushBytes, [&frame](const u8* data, int bytes)
+            {
+                frame.insert(frame.end(), data, data + bytes);
+            });
+
+            TCPReceiveState* receive = receiveStates[i].get();
+            const int used = DecompressTCPFrames(receive->GetContext(),
+                receive->DecompressedBuffer, receive->DecompressedBufferSize,
+                &frame[0], frame.size(), [&](Stream& stream)
+            {
+                if (stream.GetBufferSize() != flushBytes ||
+                    memcmp(stream.GetFront(), &payload[0], flushBytes) != 0)
+                {
+                    valid = false;
+                }
+                deliveredBytes += stream.GetBufferSize();
+            });
+            valid &= (used == (int)frame.size());
+
+            if (round > 0)
+            {
+                ++result.Flushes;
+                result.InputBytes += flushBytes;
+                result.CompressedBytes += frame.size();
+            }
+        }
+    }
+    result.Seconds = (GetTimeUsec() - t0) / 1000000.;
+
+    pool.GetStats(result.Stats);
+
+    for (int i = 0; i < connectionCount; ++i)
+    {
+        pool.Release(std::move(sendStates[i]));
+        pool.Release(std::move(receiveStates[i]));
+    }
+
+    return valid && deliveredBytes == (u64)flushBytes * connectionCount * (roundCount + 1);
+}
+
+int main(int argc, char* argv[])
+{
+    SetThreadName("Main");
+
+    const int connectionCount = argc > 1 ? atoi(argv[1]) : kDefaultConnectionCount;
+    const int roundCount = argc > 2 ? atoi(argv[2]) : kDefaultRoundCount;
+    const int flushBytes = argc > 3 ? atoi(argv[3]) : kDefaultFlushBytes;
+
+    if (connectionCount <= 0 || roundCount <= 0 || flushBytes <= 0 || flushBytes > kTCPPackingBufferSizeBytes)
+    {
+        Logger.Error("Usage: ContextBench [connections] [rounds] [flushBytes <= ", kTCPPackingBufferSizeBytes, "]");
+        return 1;
+    }
+
+    Logger.Info("ContextBench: ", connectionCount, " connections, ", roundCount, " rounds, ",
+        flushBytes, " byte flushes, compression level ", kCompressionLevel);
+
+    // Private first, so the thread contexts of shared mode do not show up
+    for (int shared = 0; shared <= 1; ++shared)
+    {
+        BenchResult result;
+        if (!RunMode(shared != 0, connectionCount, roundCount, flushBytes, result))
+        {
+            Logger.Error("Round trip failed");
+            return 1;
+        }
+
+        const u64 stateBytes = result.Stats.AllocatedBytes + result.Stats.SharedContextBytes;
+
+        Logger.Info(shared ? "shared " : "private",
+            ": ", (u64)(result.Flushes / result.Seconds), " flushes/sec, ",
+            (u64)(result.InputBytes / result.Seconds / 1000000.), " MB/sec, ratio ",
+            (float)result.InputBytes / result.CompressedBytes, ", memory ",
+            stateBytes / 1024, " KB = ", stateBytes / connectionCount, " bytes/connection (thread contexts ",
+            result.Stats.SharedContextBytes / 1024, " KB)");
+    }
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include "SphynxClient.h"
+#include "../sphynxdemo/DemoProtocol.h"
+#include "BenchTools.h"
+#include <cmath>
+
+static logging::Channel Logger("LoadClient");
+
+
+//-----------------------------------------------------------------------------
+// LoadClient
+//
+// Headless load generator for the demo server.  Thousands of clients share a
+// ClientThreadPool, log in, then fly in circles in clusters of
+// kBotsPerCluster so the server has neighbors to rebroadcast to.  Connect
+// time, one-way delay of the position updates coming back and throughput are
+// reported at the end.
+//
+// Usage: LoadClient [clients] [seconds] [threads] [host] [port]
+//   Defaults: 1000 clients for 10 seconds on one thread per core, against
+//   127.0.0.1 : 5060.  Each client uses two sockets, so the server may need a
+//   higher open file limit too (ulimit -n)
+
+// Bots close enough to see each other, well within the 100 unit broadcast
+// distance of the demo server
+static const int kBotsPerCluster = 16;
+
+// Clusters are laid out on a grid far enough apart not to see each other
+static const int kClusterSpacing = 400;
+static const int kClusterColumns = 64;
+
+// Radius of the circle each bot flies
+static const int kOrbitRadius = 30;
+
+// Clients started per second, so the server is not hit by every handshake at
+// once.  Suggested: 500
+static const int kConnectsPerSecond = 500;
+
+// Time to let the last updates arrive after the bots stop sending
+static const int kDrainMsec = 500; // 0.5 seconds
+
+
+//-----------------------------------------------------------------------------
+// Report
+
+struct LoadReport
+{
+    MetricHistogram ConnectUsec;
+    MetricHistogram OneWayDelayMsec;
+
+    MetricCounter Connected;
+    MetricCounter ConnectFailed;
+    MetricCounter Disconnected;
+    MetricCounter LoggedIn;
+    MetricCounter PositionsSent;
+    MetricCounter PositionsReceived;
+};
+
+static LoadReport Report;
+
+// Bots only send positions while this is set
+static std::atomic<bool> Sending{ false };
+
+
+//-----------------------------------------------------------------------------
+// LoadBot
+
+class LoadBot : public ClientInterface
+{
+public:
+    explicit LoadBot(int index)
+        : Index(index)
+    {
+    }
+
+    void Start(const std::shared_ptr<ClientSettings>& settings)
+    {
+        StartUsec = GetTimeUsec();
+        Client.Start(settings);
+    }
+    void Stop()
+    {
+        Client.Stop();
+    }
+
+    void OnConnectFail(SphynxClient* client) override
+    {
+        Report.ConnectFailed.Add();
+    }
+
+    void OnConnect(SphynxClient* client) override
+    {
+        Report.Connected.Add();
+        Report.ConnectUsec.Record(GetTimeUsec() - StartUsec);
+
+        TCPLogin.CallSender = client->TCPCallSender;
+        UDPPositionUpdate.CallSender = client->UDPCallSender;
+
+        // Every call the server sends needs a handler, or routing stops at it
+        client->Router.Set<S2CSetPlayerIdT>(S2CSetPlayerIdID, [](playerid_t pid)
+        {
+            Report.LoggedIn.Add();
+        });
+        client->Router.Set<S2CPlayerAddT>(S2CAddPlayerID, [](playerid_t pid, string_view name)
+        {
+        });
+        client->Router.Set<S2CPlayerRemoveT>(S2CRemovePlayerID, [](playerid_t pid)
+        {
+        });
+        client->Router.Set<S2CPlayerUpdatePositionT>(S2CPositionUpdateID, [client](playerid_t pid, u16 timestamp, PlayerPosition position)
+        {
+            if (!Sending)
+                return;
+
+            const u64 nowMsec = GetTimeMsec();
+            const u64 localTimeWhenSentMsec = client->FromServerTime15(nowMsec, timestamp);
+            const s64 delayMsec = (s64)nowMsec - (s64)localTimeWhenSentMsec;
+
+            Report.PositionsReceived.Add();
+            Report.OneWayDelayMsec.Record(delayMsec > 0 ? (u64)delayMsec : 0);
+        });
+
+        TCPLogin(std::string("bot") + std::to_string(Index));
+    }
+
+    void OnTick(SphynxClient* client, u64 nowMsec) override
+    {
+        if (!Sending)
+            return;
+
+        UDPPositionUpdate(client->ToServerTime15(nowMsec), GetPosition(nowMsec));
+        Report.PositionsSent.Add();
+    }
+
+    void OnDisconnect(SphynxClient* client) override
+    {
+        Report.Disconnected.Add();
+    }
+
+protected:
+    SphynxClient Client;
+    const int Index;
+    u64 StartUsec = 0;
+
+    CallSerializer<C2SLoginID, C2SLoginT> TCPLogin;
+    CallSerializer<C2SPositionUpdateID, C2SPositionUpdateT> UDPPositionUpdate;
+
+    // Scripted movement: A circle around the cluster center, one lap every
+    // few seconds, with bots spread around it
+    PlayerPosition GetPosition(u64 nowMsec) const
+    {
+        const int cluster = (Index / kBotsPerCluster) % (kClusterColumns * kClusterColumns);
+        const int centerX = (cluster % kClusterColumns) * kClusterSpacing + kClusterSpacing / 2;
+        const int centerY = (cluster / kClusterColumns) * kClusterSpacing + kClusterSpacing / 2;
+
+        const double kTwoPi = 6.283185307179586;
+        const double phase = (Index % kBotsPerCluster) * kTwoPi / kBotsPerCluster;
+        const double angle = phase + (nowMsec % 4000) * kTwoPi / 4000.;
+
+        PlayerPosition position;
+        position.x = (int16_t)(centerX + kOrbitRadius * std::cos(angle));
+        position.y = (int16_t)(centerY + kOrbitRadius * std::sin(angle));
+        position.vx = (int16_t)(-kOrbitRadius * std::sin(angle));
+        position.vy = (int16_t)(kOrbitRadius * std::cos(angle));
+        position.angle = (uint8_t)(angle * 256. / kTwoPi);
+        return position;
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+// Entrypoint
+
+static void LogHistogram(const char* name, const MetricHistogram& histogram, const char* unit)
+{
+    MetricHistogramSummary summary;
+    histogram.Read(summary);
+
+    Logger.Info(name, ": count=", summary.Count, " avg=", summary.Count > 0 ? summary.Sum / summary.Count : 0,
+        " p50=", summary.P50, " p90=", summary.P90, " p99=", summary.P99, " max=", summary.Max, " ", unit);
+}
+
+int main(int argc, char* argv[])
+{
+    SetThreadName("Main");
+
+    const int clientCount = argc > 1 ? atoi(argv[1]) : 1000;
+    const int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    const int threadCount = argc > 3 ? atoi(argv[3]) : 0;
+    const std::string host = argc > 4 ? argv[4] : "127.0.0.1";
+    const int port = argc > 5 ? atoi(argv[5]) : 5060;
+
+    if (clientCount <= 0 || seconds <= 0 || threadCount < 0 || port <= 0 || port > 65535)
+    {
+        Logger.Error("Usage: LoadClient [clients] [seconds] [threads] [host] [port]");
+        return 1;
+    }
+
+    // Thousands of clients repeat the same connect and disconnect lines
+    logging::SetChannelMinLevel("SphynxClient", logging::Level::Warning);
+    logging::SetChannelMinLevel("SphynxCommon", logging::Level::Warning);
+
+    if (!RaiseOpenFileLimit())
+        Logger.Warning("Unable to raise the open file limit");
+
+    ClientThreadPool pool;
+    pool.Start((unsigned)threadCount);
+
+    Logger.Info("LoadClient: ", clientCount, " clients for ", seconds, " seconds against ", host, " : ", port);
+
+    std::vector<std::unique_ptr<LoadBot>> bots;
+    bots.reserve(clientCount);
+
+    // Stagger the connects
+    const u64 rampStartUsec = GetTimeUsec();
+    for (int i = 0; i < clientCount; ++i)
+    {
+        const u64 dueUsec = rampStartUsec + (u64)i * 1000000 / kConnectsPerSecond;
+        const s64 waitUsec = (s64)(dueUsec - GetTimeUsec());
+        if (waitUsec > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(waitUsec));
+
+        auto settings = std::make_shared<ClientSettings>();
+        settings->Host = host;
+        settings->TCPPort = (unsigned short)port;
+        settings->Context = pool.GetNextContext();
+
+        bots.emplace_back(new LoadBot(i));
+        settings->Interface = bots.back().get();
+        bots.back()->Start(settings);
+
+        if (i == 0)
+            Sending = true;
+    }
+
+    Logger.Info("All clients started in ", (GetTimeUsec() - rampStartUsec) / 1000, " msec");
+
+    // Throughput is measured after the ramp, once everyone is flying
+    const u64 sentBefore = Report.PositionsSent.Read();
+    const u64 receivedBefore = Report.PositionsReceived.Read();
+    const u64 t0 = GetTimeUsec();
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    const double measuredSeconds = (GetTimeUsec() - t0) / 1000000.;
+    const u64 sent = Report.PositionsSent.Read() - sentBefore;
+    const u64 received = Report.PositionsReceived.Read() - receivedBefore;
+
+    Sending = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(kDrainMsec));
+
+    // Stop the threads first, so the clients can be stopped from here
+    pool.Stop();
+    for (auto& bot : bots)
+        bot->Stop();
+    bots.clear();
+
+    Logger.Info("Clients: ", Report.Connected.Read(), " connected, ", Report.ConnectFailed.Read(), " failed, ",
+        Report.LoggedIn.Read(), " logged in, ", Report.Disconnected.Read(), " disconnected early");
+    LogHistogram("Connect time", Report.ConnectUsec, "usec");
+    Logger.Info("Positions: ", (u64)(sent / measuredSeconds), " sent/sec, ",
+        (u64)(received / measuredSeconds), " received/sec over ", measuredSeconds, " seconds");
+    LogHistogram("One-way delay", Report.OneWayDelayMsec, "msec");
+
+    return 0;
+}
@@ -0,0 +1,458 @@
+#include "SphynxServer.h"
+#include "SphynxClient.h"
+#include "BenchTools.h"
+#include <cstdio>
+#include <sstream>
+
+static logging::Channel Logger("LoopbackBench");
+
+
+//-----------------------------------------------------------------------------
+// LoopbackBench
+//
+// End-to-end benchmark over loopback in one process: A Server and N
+// SphynxClients on a ClientThreadPool.  Every client tick each client sends
+// messages to the server, some over UDP and the rest over TCP, and the
+// server echoes each one back on the same transport.  Both sides stamp
+// messages with the 15-bit time-sync timestamps, so one-way delays are
+// measured the way the protocol itself sees them, in milliseconds.
+//
+// Runs once for every combination of worker count, connection count and
+// message size, and writes one JSON object per line to stdout:
+//
+//   {"workers":2,"connections":500,"message_bytes":64,"tcp_percent":20,
+//    "connected":500,"msgs_per_sec":33012,"bytes_per_sec":2112768,
+//    "c2s_p50_msec":15,...,"cpu_usec_per_msg":12.41}
+//
+// Messages and bytes count both directions.  CPU time is for the whole
+// process, clients included, so compare it between runs rather than read it
+// as server cost alone.
+//
+// Usage: LoopbackBench [workers] [connections] [message bytes] [seconds]
+//                      [tcp percent] [messages per tick]
+//   The first three are comma-separated lists to sweep, for example
+//   "LoopbackBench 1,2,4,8 1000 64,256".  Defaults: 1,2,4 workers, 100,500
+//   connections, 64,256 bytes, 3 seconds, 20% TCP, 1 message per tick
+
+// Threads running the clients
+static const int kClientThreadCount = 2;
+
+// Each run listens on its own ports, starting here
+static const unsigned short kBasePort = 5070;
+
+// UDP messages must fit a datagram with room for the headers, so larger
+// messages all go over TCP
+static const int kUDPPayloadLimitBytes = 400;
+
+// Time allowed for every client to connect
+static const int kConnectTimeoutMsec = 10000; // 10 seconds
+
+// Time for time sync to settle before measuring
+static const int kWarmupMsec = 1500; // 1.5 seconds
+
+// Time to let the last messages arrive after the clients stop sending
+static const int kDrainMsec = 200; // 0.2 seconds
+
+
+//-----------------------------------------------------------------------------
+// Protocol
+
+// Same call on both transports, with an id for each so that the server can
+// echo on the transport it came in on
+typedef void BenchMessageT(u16 timestamp, vector_view<const u8> payload);
+
+static const int C2SBenchUDPMessageID = 0;
+static const int C2SBenchTCPMessageID = 1;
+static const int S2CBenchUDPMessageID = 0;
+static const int S2CBenchTCPMessageID = 1;
+
+
+//-----------------------------------------------------------------------------
+// Run statistics
+
+struct RunStats
+{
+    MetricCounter C2SSent;
+    MetricCounter C2SReceived;
+    MetricCounter S2CReceived;
+    MetricCounter Bytes;
+
+    MetricHistogram C2SDelayMsec;
+    MetricHistogram S2CDelayMsec;
+
+    MetricCounter Connected;
+    MetricCounter ConnectFailed;
+
+    // Metrics must be allocated aligned to cache lines
+    static void* operator new(size_t bytes)
+    {
+        return AllocateMetric(bytes);
+    }
+    static void operator delete(void* address)
+    {
+        FreeMetric(address);
+    }
+};
+
+// Set for the length of a run, before any threads start
+static RunStats* Stats = nullptr;
+
+// Clients send while this is set
+static std::atomic<bool> Sending{ false };
+
+// Messages are only counted while this is set
+static std::atomic<bool> Measuring{ false };
+
+static void RecordDelay(MetricHistogram& histogram, u64 nowMsec, u64 sentMsec)
+{
+    const s64 delayMsec = (s64)nowMsec - (s64)sentMsec;
+    histogram.Record(delayMsec > 0 ? (u64)delayMsec : 0);
+}
+
+static u64 GetProcessCPUUsec()
+{
+#if defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (u64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        (u64)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// Server side
+
+class EchoConnection : public ConnectionInterface
+{
+public:
+    void OnConnect(Connection* connection) override
+    {
+        UDPEcho.CallSender = connection->UDPCallSender;
+        TCPEcho.CallSender = connection->TCPCallSender;
+
+        connection->Router.Set<BenchMessageT>(C2SBenchUDPMessageID, [this](u16 timestamp, vector_view<const u8> payload)
+        {
+            if (OnMessage(timestamp, payload))
+                UDPEcho((u16)(GetTimeMsec() & 0x7fff), payload);
+        });
+        connection->Router.Set<BenchMessageT>(C2SBenchTCPMessageID, [this](u16 timestamp, vector_view<const u8> payload)
+        {
+            if (OnMessage(timestamp, payload))
+                TCPEcho((u16)(GetTimeMsec() & 0x7fff), payload);
+        });
+    }
+
+    void OnTick(Connection* connection, u64 nowMsec) override
+    {
+    }
+
+    void OnDisconnect(Connection* connection) override
+    {
+    }
+
+protected:
+    CallSerializer<S2CBenchUDPMessageID, BenchMessageT> UDPEcho;
+    CallSerializer<S2CBenchTCPMessageID, BenchMessageT> TCPEcho;
+
+    // Returns true to echo the message
+    bool OnMessage(u16 timestamp, vector_view<const u8> payload)
+    {
+        if (!Sending)
+            return false;
+
+        if (Measuring)
+        {
+            const u64 nowMsec = GetTimeMsec();
+            Stats->C2SReceived.Add();
+            Stats->Bytes.Add(payload.size());
+            RecordDelay(Stats->C2SDelayMsec, nowMsec, ReconstructMsec(nowMsec, timestamp));
+        }
+
+        return true;
+    }
+};
+
+class EchoServer : public ServerInterface
+{
+public:
+    ConnectionInterface* CreateConnection(Connection* connection) override
+    {
+        return new EchoConnection;
+    }
+
+    void DestroyConnection(ConnectionInterface* iface, Connection* connection) override
+    {
+        delete iface;
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+// Client side
+
+class BenchClient : public ClientInterface
+{
+public:
+    BenchClient(int messageBytes, int tcpPercent, int messagesPerTick)
+        : Payload(messageBytes, 0x5a)
+        , TCPPercent(messageBytes > kUDPPayloadLimitBytes ? 100 : tcpPercent)
+        , MessagesPerTick(messagesPerTick)
+    {
+    }
+
+    void Start(const std::shared_ptr<ClientSettings>& settings)
+    {
+        Client.Start(settings);
+    }
+    void Stop()
+    {
+        Client.Stop();
+    }
+
+    void OnConnectFail(SphynxClient* client) override
+    {
+        Stats->ConnectFailed.Add();
+    }
+
+    void OnConnect(SphynxClient* client) override
+    {
+        UDPMessage.CallSender = client->UDPCallSender;
+        TCPMessage.CallSender = client->TCPCallSender;
+
+        auto onEcho = [client](u16 timestamp, vector_view<const u8> payload)
+        {
+            if (!Measuring)
+                return;
+
+            const u64 nowMsec = GetTimeMsec();
+            Stats->S2CReceived.Add();
+            Stats->Bytes.Add(payload.size());
+            RecordDelay(Stats->S2CDelayMsec, nowMsec, client->FromServerTime15(nowMsec, timestamp));
+        };
+        client->Router.Set<BenchMessageT>(S2CBenchUDPMessageID, onEcho);
+        client->Router.Set<BenchMessageT>(S2CBenchTCPMessageID, onEcho);
+
+        Stats->Connected.Add();
+    }
+
+    void OnTick(SphynxClient* client, u64 nowMsec) override
+    {
+        if (!Sending)
+            return;
+
+        const vector_view<const u8> payload(Payload.data(), Payload.size());
+        const u16 timestamp = client->ToServerTime15(nowMsec);
+
+        for (int i = 0; i < MessagesPerTick; ++i)
+        {
+            if ((int)(Sequence++ % 100) < TCPPercent)
+                TCPMessage(timestamp, payload);
+            else
+                UDPMessage(timestamp, payload);
+
+            if (Measuring)
+                Stats->C2SSent.Add();
+        }
+    }
+
+    void OnDisconnect(SphynxClient* client) override
+    {
+    }
+
+protected:
+    SphynxClient Client;
+
+    const std::vector<u8> Payload;
+    const int TCPPercent;
+    const int MessagesPerTick;
+    u32 Sequence = 0;
+
+    CallSerializer<C2SBenchUDPMessageID, BenchMessageT> UDPMessage;
+    CallSerializer<C2SBenchTCPMessageID, BenchMessageT> TCPMessage;
+};
+
+
+//-----------------------------------------------------------------------------
+// Run
+
+struct RunConfig
+{
+    unsigned WorkerCount = 1;
+    int ConnectionCount = 100;
+    int MessageBytes = 64;
+    int Seconds = 3;
+    int TCPPercent = 20;
+    int MessagesPerTick = 1;
+    unsigned short Port = kBasePort;
+};
+
+static void Run(const RunConfig& config)
+{
+    std::unique_ptr<RunStats> stats(new RunStats);
+    Stats = stats.get();
+
+    EchoServer echoServer;
+    auto settings = std::make_shared<ServerSettings>();
+    settings->WorkerCount = config.WorkerCount;
+    settings->MainTCPPort = config.Port;
+    settings->StartUDPPort = config.Port;
+    settings->StopUDPPort = config.Port + 1;
+    settings->SlowTickMsec = 0;
+    settings->Interface = &echoServer;
+
+    Server server;
+    server.Start(settings);
+
+    ClientThreadPool pool;
+    pool.Start(kClientThreadCount);
+
+    std::vector<std::unique_ptr<BenchClient>> clients;
+    for (int i = 0; i < config.ConnectionCount; ++i)
+    {
+        auto clientSettings = std::make_shared<ClientSettings>();
+        clientSettings->Host = "127.0.0.1";
+        clientSettings->TCPPort = config.Port;
+        clientSettings->Context = pool.GetNextContext();
+
+        clients.emplace_back(new BenchClient(config.MessageBytes, config.TCPPercent, config.MessagesPerTick));
+        clientSettings->Interface = clients.back().get();
+        clients.back()->Start(clientSettings);
+    }
+
+    const u64 connectStartMsec = GetTimeMsec();
+    while ((int)(Stats->Connected.Read() + Stats->ConnectFailed.Read()) < config.ConnectionCount &&
+        GetTimeMsec() - connectStartMsec < (u64)kConnectTimeoutMsec)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    Sending = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(kWarmupMsec));
+
+    const u64 cpuStartUsec = GetProcessCPUUsec();
+    const u64 t0 = GetTimeUsec();
+    Measuring = true;
+
+    std::this_thread::sleep_for(std::chrono::seconds(config.Seconds));
+
+    Measuring = false;
+    const double seconds = (GetTimeUsec() - t0) / 1000000.;
+    const u64 cpuUsec = GetProcessCPUUsec() - cpuStartUsec;
+
+    Sending = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(kDrainMsec));
+
+    // Stop the threads first, so the clients can be stopped from here
+    pool.Stop();
+    for (auto& client : clients)
+        client->Stop();
+    clients.clear();
+    server.Stop();
+
+    const u64 c2sReceived = Stats->C2SReceived.Read();
+    const u64 s2cReceived = Stats->S2CReceived.Read();
+    const u64 messages = c2sReceived + s2cReceived;
+
+    MetricHistogramSummary c2s, s2c;
+    Stats->C2SDelayMsec.Read(c2s);
+    Stats->S2CDelayMsec.Read(s2c);
+
+    printf("{\"workers\":%u,\"connections\":%d,\"message_bytes\":%d,\"tcp_percent\":%d,\"messages_per_tick\":%d,"
+        "\"connected\":%llu,\"seconds\":%.2f,\"c2s_sent\":%llu,\"c2s_received\":%llu,\"s2c_received\":%llu,"
+        "\"msgs_per_sec\":%.0f,\"bytes_per_sec\":%.0f,"
+        "\"c2s_p50_msec\":%llu,\"c2s_p99_msec\":%llu,\"c2s_p999_msec\":%llu,"
+        "\"s2c_p50_msec\":%llu,\"s2c_p99_msec\":%llu,\"s2c_p999_msec\":%llu,"
+        "\"cpu_usec_per_msg\":%.2f}\n",
+        config.WorkerCount, config.ConnectionCount, config.MessageBytes,
+        config.MessageBytes > kUDPPayloadLimitBytes ? 100 : config.TCPPercent, config.MessagesPerTick,
+        (unsigned long long)Stats->Connected.Read(), seconds,
+        (unsigned long long)Stats->C2SSent.Read(), (unsigned long long)c2sReceived, (unsigned long long)s2cReceived,
+        messages / seconds, Stats->Bytes.Read() / seconds,
+        (unsigned long long)c2s.P50, (unsigned long long)c2s.P99, (unsigned long long)c2s.P999,
+        (unsigned long long)s2c.P50, (unsigned long long)s2c.P99, (unsigned long long)s2c.P999,
+        messages > 0 ? (double)cpuUsec / messages : 0.);
+    fflush(stdout);
+
+    Stats = nullptr;
+}
+
+
+//-----------------------------------------------------------------------------
+// Entrypoint
+
+static bool ParseList(const char* text, std::vector<int>& values)
+{
+    values.clear();
+
+    std::istringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        const int value = atoi(item.c_str());
+        if (value <= 0)
+            return false;
+        values.push_back(value);
+    }
+
+    return !values.empty();
+}
+
+int main(int argc, char* argv[])
+{
+    SetThreadName("Main");
+
+    std::vector<int> workerCounts, connectionCounts, messageSizes;
+    RunConfig config;
+
+    bool good = ParseList(argc > 1 ? argv[1] : "1,2,4", workerCounts) &&
+        ParseList(argc > 2 ? argv[2] : "100,500", connectionCounts) &&
+        ParseList(argc > 3 ? argv[3] : "64,256", messageSizes);
+    if (argc > 4)
+        config.Seconds = atoi(argv[4]);
+    if (argc > 5)
+        config.TCPPercent = atoi(argv[5]);
+    if (argc > 6)
+        config.MessagesPerTick = atoi(argv[6]);
+
+    for (int size : messageSizes)
+        if (size > kTCPMessageMaxBytes / 2)
+            good = false;
+
+    if (!good || config.Seconds <= 0 || config.TCPPercent < 0 || config.TCPPercent > 100 || config.MessagesPerTick <= 0)
+    {
+        Logger.Error("Usage: LoopbackBench [workers] [connections] [message bytes] [seconds] [tcp percent] [messages per tick]");
+        return 1;
+    }
+
+    // Hundreds of connections repeat the same connect and disconnect lines,
+    // and every connection ends with disconnect warnings at the end of a run
+    logging::SetChannelMinLevel("SphynxClient", logging::Level::Warning);
+    logging::SetChannelMinLevel("SphynxServer", logging::Level::Error);
+    logging::SetChannelMinLevel("SphynxCommon", logging::Level::Error);
+
+    if (!RaiseOpenFileLimit())
+        Logger.Warning("Unable to raise the open file limit");
+
+    for (int workerCount : workerCounts)
+    {
+        for (int connectionCount : connectionCounts)
+        {
+            for (int messageBytes : messageSizes)
+            {
+                config.WorkerCount = (unsigned)workerCount;
+                config.ConnectionCount = connectionCount;
+                config.MessageBytes = messageBytes;
+
+                Run(config);
+
+                config.Port += 2;
+            }
+        }
+    }
+
+    return 0;
+}
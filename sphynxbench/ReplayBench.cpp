@@ -0,0 +1,161 @@
+#include "Capture.h"
+#include "../sphynxdemo/DemoProtocol.h"
+#include <unordered_map>
+
+static logging::Channel Logger("ReplayBench");
+
+
+//-----------------------------------------------------------------------------
+// ReplayBench
+//
+// Feeds a capture taken with "UDPServer <capture file>" back through the demo
+// protocol, with one ReplayPeer per captured connection and no sockets.  The
+// handlers answer like the demo server does, so replies are serialized,
+// packed and compressed too, and each peer is flushed every worker tick of
+// capture time.
+//
+// Usage: ReplayBench <capture file> [speed] [rounds]
+//   speed 0 = As fast as possible (default), 1 = recorded timing, 2 = twice
+//   as fast and so on.  Rounds replay the capture again for steadier timing
+
+struct ReplayRecord
+{
+    CaptureRecord Record;
+    size_t Offset = 0;
+};
+
+struct BenchConnection
+{
+    ReplayPeer Peer;
+    u64 NextFlushUsec = 0;
+
+    CallSerializer<S2CSetPlayerIdID, S2CSetPlayerIdT> TCPSetPlayerId;
+    CallSerializer<S2CAddPlayerID, S2CPlayerAddT> TCPAddPlayer;
+    CallSerializer<S2CPositionUpdateID, S2CPlayerUpdatePositionT> UDPPositionUpdate;
+
+    u64 Logins = 0;
+    u64 Positions = 0;
+
+    BenchConnection(u32 source)
+    {
+        TCPSetPlayerId.CallSender = Peer.TCPCallSender;
+        TCPAddPlayer.CallSender = Peer.TCPCallSender;
+        UDPPositionUpdate.CallSender = Peer.UDPCallSender;
+
+        const playerid_t id = (playerid_t)source;
+
+        Peer.Router.Set<C2SHeartbeatT>(C2SHeartbeatID, [](u16 sentTimeMsec)
+        {
+        });
+        Peer.Router.Set<C2SLoginT>(C2SLoginID, [this, id](string_view name)
+        {
+            ++Logins;
+            TCPSetPlayerId(id);
+            TCPAddPlayer(id, name);
+        });
+        Peer.Router.Set<C2SPositionUpdateT>(C2SPositionUpdateID, [this, id](u16 timestamp, PlayerPosition position)
+        {
+            ++Positions;
+            UDPPositionUpdate(id, timestamp, position);
+        });
+    }
+};
+
+static bool LoadCapture(const char* path, std::vector<ReplayRecord>& records, std::vector<u8>& data)
+{
+    CaptureReader reader;
+    if (!reader.Open(path))
+        return false;
+
+    CaptureRecord record;
+    while (reader.Read(record))
+    {
+        ReplayRecord replay;
+        replay.Record = record;
+        replay.Offset = data.size();
+        data.insert(data.end(), record.Data, record.Data + record.Bytes);
+        records.push_back(replay);
+    }
+
+    return !records.empty();
+}
+
+int main(int argc, char* argv[])
+{
+    SetThreadName("Main");
+
+    const double speed = argc > 2 ? atof(argv[2]) : 0.;
+    const int roundCount = argc > 3 ? atoi(argv[3]) : 1;
+
+    if (argc < 2 || speed < 0. || roundCount <= 0)
+    {
+        Logger.Error("Usage: ReplayBench <capture file> [speed] [rounds]");
+        return 1;
+    }
+
+    std::vector<ReplayRecord> records;
+    std::vector<u8> data;
+    if (!LoadCapture(argv[1], records, data))
+    {
+        Logger.Error("No records in ", argv[1]);
+        return 1;
+    }
+
+    const u64 captureUsec = records.back().Record.TimeUsec;
+    Logger.Info("ReplayBench: ", records.size(), " records, ", data.size(), " bytes over ",
+        captureUsec / 1000, " msec, speed ", speed, ", ", roundCount, " rounds");
+
+    std::unordered_map<u32, std::unique_ptr<BenchConnection>> connections;
+    const u64 baseMsec = GetTimeMsec();
+
+    const u64 t0 = GetTimeUsec();
+    for (int round = 0; round < roundCount; ++round)
+    {
+        const u64 roundStartUsec = GetTimeUsec();
+
+        for (ReplayRecord& replay : records)
+        {
+            CaptureRecord& record = replay.Record;
+            record.Data = data.data() + replay.Offset;
+
+            if (speed > 0.)
+            {
+                const u64 dueUsec = roundStartUsec + (u64)(record.TimeUsec / speed);
+                const s64 waitUsec = (s64)(dueUsec - GetTimeUsec());
+                if (waitUsec > 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(waitUsec));
+            }
+
+            std::unique_ptr<BenchConnection>& connection = connections[record.Source];
+            if (!connection)
+                connection = std::make_unique<BenchConnection>(record.Source);
+
+            // Capture time keeps the peer's clock consistent at any speed
+            const u64 captureUsecNow = round * (captureUsec + 1) + record.TimeUsec;
+            connection->Peer.Replay(baseMsec + captureUsecNow / 1000, record);
+
+            // Flush on the worker tick schedule, as the server would
+            if (captureUsecNow >= connection->NextFlushUsec)
+            {
+                connection->Peer.Flush();
+                connection->NextFlushUsec = captureUsecNow + kServerWorkerTimerIntervalMsec * 1000;
+            }
+        }
+    }
+    const double seconds = (GetTimeUsec() - t0) / 1000000.;
+
+    u64 logins = 0, positions = 0;
+    for (auto& connection : connections)
+    {
+        connection.second->Peer.Flush();
+        logins += connection.second->Logins;
+        positions += connection.second->Positions;
+    }
+
+    const u64 replayed = (u64)records.size() * roundCount;
+    Logger.Info("Replayed ", replayed, " records for ", connections.size(), " connections in ",
+        seconds * 1000., " msec: ", (u64)(replayed / seconds), " records/sec, ",
+        (u64)(seconds * 1000000000. / replayed), " nsec/record (", logins, " logins, ", positions, " positions)");
+
+    return 0;
+}
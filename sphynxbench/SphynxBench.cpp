@@ -0,0 +1,741 @@
+#include "SphynxServer.h"
+#include "../sphynxdemo/DemoProtocol.h"
+#include "BenchTools.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+static logging::Channel Logger("SphynxBench");
+
+
+//-----------------------------------------------------------------------------
+// SphynxBench
+//
+// Microbenchmarks for the per-message hot paths: Stream serialization, call
+// serialization and routing, encryption, TCP frame compression, endpoint
+// hashing, clocks, counter reconstruction and neighbor tracking.
+//
+// Each benchmark is calibrated to run for about kRepetitionMsec per
+// repetition and repeated kRepetitions times.  Inputs come from fixed seeds,
+// so runs are comparable across builds.  Results are written to stdout as
+// one JSON object per line:
+//
+//   {"name":"rpc.route.position","iterations":2000000,"ns_per_op":41.20,
+//    "ns_per_op_min":40.87,"mb_per_sec":291.3}
+//
+// ns_per_op is the median of the repetitions.  mb_per_sec is given for
+// benchmarks that process a buffer, and ratio for compression.  Compare
+// Release builds (-DCMAKE_BUILD_TYPE=Release) on the same machine.
+//
+// Usage: SphynxBench [name filter] [msec per repetition]
+
+static const int kRepetitions = 5;
+static const int kDefaultRepetitionMsec = 50;
+
+static const char* Filter = nullptr;
+static int RepetitionMsec = kDefaultRepetitionMsec;
+
+// Results are added here so the compiler cannot drop the work
+static volatile u64 Sink = 0;
+
+static u64 GetBenchNsec()
+{
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//-----------------------------------------------------------------------------
+// Harness
+
+struct BenchOptions
+{
+    // Bytes processed by each operation, for mb_per_sec, or 0
+    u64 BytesPerOp = 0;
+
+    // Output / input bytes, for compression, or 0
+    double Ratio = 0.;
+};
+
+// op(count) runs the operation count times
+template<typename F>
+static void RunBench(const std::string& name, F op, const BenchOptions& options = BenchOptions())
+{
+    if (Filter && name.find(Filter) == std::string::npos)
+        return;
+
+    const u64 targetNsec = (u64)RepetitionMsec * 1000000;
+
+    // Warm up and find how many operations fill a repetition
+    u64 count = 1;
+    u64 elapsedNsec = 0;
+    for (;;)
+    {
+        const u64 t0 = GetBenchNsec();
+        op(count);
+        elapsedNsec = GetBenchNsec() - t0;
+
+        if (elapsedNsec >= targetNsec / 8 || count >= ((u64)1 << 40))
+            break;
+        count *= 2;
+    }
+    count = std::max<u64>(1, (u64)((double)count * targetNsec / std::max<u64>(1, elapsedNsec)));
+
+    double samples[kRepetitions];
+    for (double& sample : samples)
+    {
+        const u64 t0 = GetBenchNsec();
+        op(count);
+        sample = (double)(GetBenchNsec() - t0) / count;
+    }
+    std::sort(samples, samples + kRepetitions);
+
+    const double median = samples[kRepetitions / 2];
+
+    printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,\"ns_per_op_min\":%.2f",
+        name.c_str(), (unsigned long long)(count * kRepetitions), median, samples[0]);
+    if (options.BytesPerOp > 0)
+        printf(",\"mb_per_sec\":%.1f", options.BytesPerOp * 1000. / median);
+    if (options.Ratio > 0.)
+        printf(",\"ratio\":%.4f", options.Ratio);
+    printf("}\n");
+    fflush(stdout);
+}
+
+
+//-----------------------------------------------------------------------------
+// Stream
+
+static void BenchStream()
+{
+    u8 buffer[4096];
+
+    RunBench("stream.scalars.write", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapWrite(buffer, sizeof(buffer));
+            stream.Serialize((u8)i);
+            stream.Serialize((u16)i);
+            stream.Serialize((u32)i);
+            stream.Serialize((u64)i);
+            stream.Serialize((float)i);
+            Sink += stream.GetUsed();
+        }
+    });
+
+    RunBench("stream.scalars.read", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(buffer, 19);
+            u8 a = 0; u16 b = 0; u32 c = 0; u64 d = 0; float e = 0.0f;
+            stream.Serialize(a);
+            stream.Serialize(b);
+            stream.Serialize(c);
+            stream.Serialize(d);
+            stream.Serialize(e);
+            Sink += a + b + c + d;
+        }
+    });
+
+    RunBench("stream.varint.write", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapWrite(buffer, sizeof(buffer));
+            u32 value = (u32)(i * 2654435761u) >> (i & 31);
+            stream.SerializeVarInt(value);
+            Sink += stream.GetUsed();
+        }
+    });
+
+    const std::string name = "guest1234567890-arena-two";
+
+    RunBench("stream.string.write", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapWrite(buffer, sizeof(buffer));
+            stream.Serialize(name);
+            Sink += stream.GetUsed();
+        }
+    });
+
+    {
+        Stream stream;
+        stream.WrapWrite(buffer, sizeof(buffer));
+        stream.Serialize(name);
+    }
+
+    RunBench("stream.string.read", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(buffer, sizeof(buffer));
+            std::string value;
+            stream.Serialize(value);
+            Sink += value.size();
+        }
+    });
+
+    RunBench("stream.string_view.read", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(buffer, sizeof(buffer));
+            string_view value;
+            stream.Serialize(value);
+            Sink += value.size();
+        }
+    });
+
+    const std::vector<u16> vec(256, 0x1234);
+    BenchOptions vecOptions;
+    vecOptions.BytesPerOp = vec.size() * sizeof(u16);
+
+    RunBench("stream.vector.write", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapWrite(buffer, sizeof(buffer));
+            stream.Serialize(vec);
+            Sink += stream.GetUsed();
+        }
+    }, vecOptions);
+
+    {
+        Stream stream;
+        stream.WrapWrite(buffer, sizeof(buffer));
+        stream.Serialize(vec);
+    }
+
+    RunBench("stream.vector.read", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(buffer, sizeof(buffer));
+            std::vector<u16> value;
+            stream.Serialize(value);
+            Sink += value.size();
+        }
+    }, vecOptions);
+
+    RunBench("stream.vector_view.read", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(buffer, sizeof(buffer));
+            vector_view<const u16> value;
+            stream.Serialize(value);
+            Sink += value.size();
+        }
+    }, vecOptions);
+}
+
+
+//-----------------------------------------------------------------------------
+// RPC
+
+static PlayerPosition MakePosition(u32& state)
+{
+    PlayerPosition position;
+    position.x = (int16_t)(NextRandom(state) % 2000);
+    position.y = (int16_t)(NextRandom(state) % 2000);
+    position.vx = (int16_t)(NextRandom(state) % 64) - 32;
+    position.vy = (int16_t)(NextRandom(state) % 64) - 32;
+    position.angle = (uint8_t)NextRandom(state);
+    position.distance = (uint8_t)NextRandom(state);
+    return position;
+}
+
+static void BenchRPC()
+{
+    u32 state = 1;
+    const PlayerPosition position = MakePosition(state);
+
+    std::vector<u8> encoded;
+
+    CallSerializer<S2CPositionUpdateID, S2CPlayerUpdatePositionT> positionUpdate;
+    positionUpdate.CallSender = [&encoded](Stream& stream)
+    {
+        encoded.resize(stream.GetUsed());
+        stream.CopyTo(encoded.data());
+    };
+
+    CallSerializer<S2CAddPlayerID, S2CPlayerAddT> addPlayer;
+    addPlayer.CallSender = positionUpdate.CallSender;
+
+    RunBench("rpc.serialize.position", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+            positionUpdate((playerid_t)(i & 1023), (u16)i, position);
+        Sink += encoded.size();
+    });
+
+    RunBench("rpc.serialize.add_player", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+            addPlayer((playerid_t)(i & 1023), "guest1234567890");
+        Sink += encoded.size();
+    });
+
+    CallRouter router;
+    router.Set<S2CPlayerUpdatePositionT>(S2CPositionUpdateID, [](playerid_t pid, u16 timestamp, PlayerPosition position)
+    {
+        Sink += pid + timestamp + position.x;
+    });
+    router.Set<S2CPlayerAddT>(S2CAddPlayerID, [](playerid_t pid, string_view name)
+    {
+        Sink += pid + name.size();
+    });
+
+    positionUpdate(1000, 12345, position);
+    const std::vector<u8> positionCall = encoded;
+    addPlayer(1000, "guest1234567890");
+    const std::vector<u8> addCall = encoded;
+
+    BenchOptions positionOptions;
+    positionOptions.BytesPerOp = positionCall.size();
+
+    RunBench("rpc.route.position", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(positionCall.data(), positionCall.size());
+            router.Call(stream);
+        }
+    }, positionOptions);
+
+    RunBench("rpc.route.add_player", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(addCall.data(), addCall.size());
+            router.Call(stream);
+        }
+    });
+
+    CallStats stats;
+    RunBench("rpc.route.position_with_stats", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Stream stream;
+            stream.WrapRead(positionCall.data(), positionCall.size());
+            router.Call(stream, &stats, CallTransport::UDP);
+        }
+    }, positionOptions);
+}
+
+
+//-----------------------------------------------------------------------------
+// Encryption
+
+static void BenchEncryption()
+{
+    static const int kTCPBytes = kTCPPackingBufferSizeBytes;
+    static const int kUDPBytes = 500;
+
+    std::vector<u8> plaintext(kTCPBytes), ciphertext(kTCPBytes);
+    u32 state = 2;
+    for (u8& b : plaintext)
+        b = (u8)NextRandom(state);
+
+    Encryptor cipher;
+    cipher.InitializeEncryption(0x12345678, EncryptionRole::Server);
+
+    BenchOptions tcpOptions;
+    tcpOptions.BytesPerOp = kTCPBytes;
+    BenchOptions udpOptions;
+    udpOptions.BytesPerOp = kUDPBytes;
+
+    RunBench("crypto.tcp.encrypt", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+            cipher.EncryptTCP(plaintext.data(), ciphertext.data(), kTCPBytes);
+        Sink += ciphertext[0];
+    }, tcpOptions);
+
+    RunBench("crypto.tcp.decrypt", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+            cipher.DecryptTCP(ciphertext.data(), plaintext.data(), kTCPBytes);
+        Sink += plaintext[0];
+    }, tcpOptions);
+
+    RunBench("crypto.udp.encrypt", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+            cipher.EncryptUDP(plaintext.data(), ciphertext.data(), kUDPBytes);
+        Sink += ciphertext[0];
+    }, udpOptions);
+
+    RunBench("crypto.udp.decrypt", [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+            cipher.DecryptUDP(ciphertext.data(), plaintext.data(), kUDPBytes);
+        Sink += plaintext[0];
+    }, udpOptions);
+}
+
+
+//-----------------------------------------------------------------------------
+// Compression
+
+// A flush as the demo server packs it: Position updates with now and then a
+// player joining
+static void BuildFlush(std::vector<u8>& flush, int bytes)
+{
+    flush.clear();
+
+    auto append = [&flush](Stream& stream)
+    {
+        const size_t offset = flush.size();
+        flush.resize(offset + stream.GetUsed());
+        stream.CopyTo(&flush[offset]);
+    };
+
+    CallSerializer<S2CPositionUpdateID, S2CPlayerUpdatePositionT> positionUpdate;
+    positionUpdate.CallSender = append;
+    CallSerializer<S2CAddPlayerID, S2CPlayerAddT> addPlayer;
+    addPlayer.CallSender = append;
+
+    u32 state = 3;
+    u16 timestamp = 1000;
+    while ((int)flush.size() < bytes)
+    {
+        const playerid_t pid = (playerid_t)(NextRandom(state) % 200);
+        if (NextRandom(state) % 32 == 0)
+            addPlayer(pid, std::string("guest") + std::to_string(pid));
+        else
+            positionUpdate(pid, timestamp, MakePosition(state));
+        timestamp += (u16)(NextRandom(state) % 4);
+    }
+
+    flush.resize(bytes);
+}
+
+static void BenchCompression()
+{
+    static const int kFlushBytes[] = { 200, 2000, kTCPPackingBufferSizeBytes };
+    static const int kLevels[] = { 1, 3, kCompressionLevel };
+
+    ZBUFF_CCtx* compressor = ZBUFF_createCCtx();
+    ZSTD_DCtx* decompressor = ZSTD_createDCtx();
+    if (!compressor || !decompressor)
+    {
+        Logger.Error("Out of memory for compression contexts");
+        ZBUFF_freeCCtx(compressor);
+        ZSTD_freeDCtx(decompressor);
+        return;
+    }
+
+    const size_t bufferSize = ZSTD_compressBound(kTCPPackingBufferSizeBytes);
+    std::vector<u8> buffer(bufferSize);
+    std::vector<u8> decompressed(kTCPPackingBufferSizeBytes);
+    std::vector<u8> flush, frame;
+
+    for (int flushBytes : kFlushBytes)
+    {
+        BuildFlush(flush, flushBytes);
+
+        BenchOptions options;
+        options.BytesPerOp = flushBytes;
+
+        for (int level : kLevels)
+        {
+            frame.clear();
+            CompressTCPFrame(compressor, buffer.data(), bufferSize, flush.data(), flush.size(),
+                [&frame](const u8* data, int bytes)
+            {
+                frame.insert(frame.end(), data, data + bytes);
+            }, level);
+            options.Ratio = (double)frame.size() / flushBytes;
+
+            RunBench("tcp.compress.level" + std::to_string(level) + "." + std::to_string(flushBytes), [&](u64 count)
+            {
+                for (u64 i = 0; i < count; ++i)
+                {
+                    CompressTCPFrame(compressor, buffer.data(), bufferSize, flush.data(), flush.size(),
+                        [](const u8* data, int bytes)
+                    {
+                        Sink += bytes;
+                    }, level);
+                }
+            }, options);
+
+            RunBench("tcp.decompress.level" + std::to_string(level) + "." + std::to_string(flushBytes), [&](u64 count)
+            {
+                for (u64 i = 0; i < count; ++i)
+                {
+                    const int used = DecompressTCPFrames(decompressor, decompressed.data(), decompressed.size(),
+                        frame.data(), frame.size(), [](Stream& stream)
+                    {
+                        Sink += stream.GetBufferSize();
+                    });
+                    if (used != (int)frame.size())
+                    {
+                        DEBUG_BREAK; return;
+                    }
+                }
+            }, options);
+        }
+    }
+
+    ZBUFF_freeCCtx(compressor);
+    ZSTD_freeDCtx(decompressor);
+}
+
+
+//-----------------------------------------------------------------------------
+// Tools
+
+static void BenchTools()
+{
+    static const int kEndpointCount = 256;
+
+    std::vector<asio::ip::udp::endpoint> v4, v6;
+    u32 state = 4;
+    for (int i = 0; i < kEndpointCount; ++i)
+    {
+        asio::ip::address_v4::bytes_type v4bytes;
+        for (auto& b : v4bytes)
+            b = (u8)NextRandom(state);
+        v4.emplace_back(asio::ip::address_v4(v4bytes), (unsigned short)NextRandom(state));
+
+        asio::ip::address_v6::bytes_type v6bytes;
+        for (auto& b : v6bytes)
+            b = (u8)NextRandom(state);
+        v6.emplace_back(asio::ip::address_v6(v6bytes), (unsigned short)NextRandom(state));
+    }
+
+    RunBench("hash_ip_addr.v4", [&](u64 count)
+    {
+        u32 hash = 0;
+        for (u64 i = 0; i < count; ++i)
+            hash += hash_ip_addr(v4[i % kEndpointCount]);
+        Sink += hash;
+    });
+
+    RunBench("hash_ip_addr.v6", [&](u64 count)
+    {
+        u32 hash = 0;
+        for (u64 i = 0; i < count; ++i)
+            hash += hash_ip_addr(v6[i % kEndpointCount]);
+        Sink += hash;
+    });
+
+    RunBench("clock.GetTimeUsec", [&](u64 count)
+    {
+        u64 total = 0;
+        for (u64 i = 0; i < count; ++i)
+            total += GetTimeUsec();
+        Sink += total;
+    });
+
+    RunBench("clock.GetSloppyMsec", [&](u64 count)
+    {
+        u64 total = 0;
+        for (u64 i = 0; i < count; ++i)
+            total += GetSloppyMsec();
+        Sink += total;
+    });
+
+    UpdateCachedTime();
+    RunBench("clock.GetCachedMsec", [&](u64 count)
+    {
+        u64 total = 0;
+        for (u64 i = 0; i < count; ++i)
+            total += GetCachedMsec();
+        Sink += total;
+    });
+
+    RunBench("ReconstructCounter16", [&](u64 count)
+    {
+        u64 total = 0;
+        u64 center = 0x123456789;
+        for (u64 i = 0; i < count; ++i)
+        {
+            // Values a little ahead and behind, as reordered packets arrive
+            const u16 bits = (u16)(center + (i & 63) - 32);
+            total += ReconstructCounter16(center, bits);
+            center += i & 1;
+        }
+        Sink += total;
+    });
+
+    RunBench("ReconstructMsec", [&](u64 count)
+    {
+        u64 total = 0;
+        u64 center = 0x123456789;
+        for (u64 i = 0; i < count; ++i)
+        {
+            const u16 bits = (u16)(center + (i & 63) - 32) & 0x7fff;
+            total += ReconstructMsec(center, bits);
+            center += i & 1;
+        }
+        Sink += total;
+    });
+}
+
+
+//-----------------------------------------------------------------------------
+// Neighbor tracking
+
+struct ListPlayer
+{
+    NeighborInfo<ListPlayer> Neighbor;
+    int x = 0, y = 0;
+};
+
+struct GridPlayer
+{
+    GridNeighborInfo<GridPlayer> Neighbor;
+    int x = 0, y = 0;
+};
+
+// Players are spread so each has about 10 others within the query distance
+static const int kNeighborDistance = 100;
+static const int kNeighborsPerPlayer = 10;
+
+template<class Player>
+static void PlacePlayers(std::vector<Player>& players, int worldSize, u32& state)
+{
+    for (Player& player : players)
+    {
+        player.x = (int)(NextRandom(state) % worldSize);
+        player.y = (int)(NextRandom(state) % worldSize);
+    }
+}
+
+// Random walk that stays in the world
+template<class Player>
+static void MovePlayer(Player& player, int worldSize, u32& state)
+{
+    const u32 r = NextRandom(state);
+    player.x = std::min(worldSize - 1, std::max(0, player.x + (int)(r % 9) - 4));
+    player.y = std::min(worldSize - 1, std::max(0, player.y + (int)((r >> 8) % 9) - 4));
+}
+
+template<class Player, class Tracker>
+static void BenchTracker(const char* kind, Tracker& tracker, int playerCount)
+{
+    const int worldSize = (int)std::sqrt(3.14159 * kNeighborDistance * kNeighborDistance * playerCount / kNeighborsPerPlayer);
+    const std::string suffix = "." + std::to_string(playerCount);
+
+    std::vector<Player> players(playerCount);
+    u32 state = 5;
+    PlacePlayers(players, worldSize, state);
+    for (Player& player : players)
+        tracker.Update(&player, player.x, player.y);
+
+    RunBench(std::string("neighbor.") + kind + ".update" + suffix, [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            Player& player = players[i % playerCount];
+            MovePlayer(player, worldSize, state);
+            tracker.Update(&player, player.x, player.y);
+        }
+    });
+
+    std::vector<Player*> neighbors;
+    RunBench(std::string("neighbor.") + kind + ".query" + suffix, [&](u64 count)
+    {
+        for (u64 i = 0; i < count; ++i)
+        {
+            ReadLocker locker;
+            tracker.GetNeighbors(&players[i % playerCount], kNeighborDistance, neighbors, locker);
+            Sink += neighbors.size();
+        }
+    });
+
+    for (Player& player : players)
+        tracker.Remove(&player);
+}
+
+static void BenchNeighbors()
+{
+    static const int kPlayerCounts[] = { 100, 1000, 5000 };
+
+    for (int playerCount : kPlayerCounts)
+    {
+        NeighborTracker<ListPlayer> listTracker;
+        BenchTracker<ListPlayer>("list", listTracker, playerCount);
+
+        GridNeighborTracker<GridPlayer> gridTracker(kNeighborDistance);
+        BenchTracker<GridPlayer>("grid", gridTracker, playerCount);
+
+        // Snapshot of every neighbor set, as the demo server builds once per
+        // tick.  Reported per build
+        std::vector<GridPlayer> players(playerCount);
+        const int worldSize = (int)std::sqrt(3.14159 * kNeighborDistance * kNeighborDistance * playerCount / kNeighborsPerPlayer);
+        u32 state = 6;
+        PlacePlayers(players, worldSize, state);
+        for (GridPlayer& player : players)
+            gridTracker.Update(&player, player.x, player.y);
+
+        NeighborSnapshot<GridPlayer> snapshot;
+        RunBench("neighbor.snapshot.build." + std::to_string(playerCount), [&](u64 count)
+        {
+            for (u64 i = 0; i < count; ++i)
+                snapshot.Build(gridTracker, kNeighborDistance);
+            Sink += snapshot.GetObjectCount();
+        });
+
+        snapshot.Build(gridTracker, kNeighborDistance);
+        RunBench("neighbor.snapshot.query." + std::to_string(playerCount), [&](u64 count)
+        {
+            NeighborSnapshot<GridPlayer>::NeighborList neighbors;
+            for (u64 i = 0; i < count; ++i)
+            {
+                snapshot.GetNeighbors(&players[i % playerCount], neighbors);
+                Sink += neighbors.size();
+            }
+        });
+
+        for (GridPlayer& player : players)
+            gridTracker.Remove(&player);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char* argv[])
+{
+    SetThreadName("Main");
+
+    if (argc > 1 && argv[1][0] != '\0')
+        Filter = argv[1];
+    if (argc > 2)
+        RepetitionMsec = atoi(argv[2]);
+
+    if (RepetitionMsec <= 0)
+    {
+        Logger.Error("Usage: SphynxBench [name filter] [msec per repetition]");
+        return 1;
+    }
+
+    BenchStream();
+    BenchRPC();
+    BenchEncryption();
+    BenchCompression();
+    BenchTools();
+    BenchNeighbors();
+
+    return 0;
+}
@@ -27,29 +27,33 @@ struct PlayerPosition
     }
 };
 
-typedef u8 playerid_t;
+// Player ids are unique within an arena
+typedef u16 playerid_t;
+
+// Ids go on the wire as varints so ids below 128 take one byte
+typedef VarInt<playerid_t> wire_playerid_t;
 
 
 //-----------------------------------------------------------------------------
 // S2C Protocol
 
-typedef void S2CSetPlayerIdT(playerid_t pid);
+typedef void S2CSetPlayerIdT(wire_playerid_t pid);
 static const int S2CSetPlayerIdID = 0;
 
-typedef void S2CPlayerAddT(playerid_t pid, std::string name);
+typedef void S2CPlayerAddT(wire_playerid_t pid, string_view name);
 static const int S2CAddPlayerID = 1;
 
-typedef void S2CPlayerRemoveT(playerid_t pid);
+typedef void S2CPlayerRemoveT(wire_playerid_t pid);
 static const int S2CRemovePlayerID = 2;
 
-typedef void S2CPlayerUpdatePositionT(playerid_t pid, u16 timestamp, PlayerPosition position);
+typedef void S2CPlayerUpdatePositionT(wire_playerid_t pid, u16 timestamp, PlayerPosition position);
 static const int S2CPositionUpdateID = 3;
 
 
 //-----------------------------------------------------------------------------
 // C2S Protocol
 
-typedef void C2SLoginT(std::string name);
+typedef void C2SLoginT(string_view name);
 static const int C2SLoginID = 0;
 
 typedef void C2SPositionUpdateT(u16 timestamp, PlayerPosition position);
@@ -2,6 +2,9 @@
 
 #include <vector>
 #include <cmath>
+#include <atomic>
+#include <algorithm> // std::swap, std::sort, std::lower_bound, std::unique
+#include <utility> // std::pair
 
 
 //-----------------------------------------------------------------------------
@@ -275,3 +278,460 @@ bool NeighborTracker<Object>::racyInsertion(Object* node, int x, int y)
 
     return true;
 }
+
+
+//-----------------------------------------------------------------------------
+// GridNeighborInfo
+//
+// Alternative to NeighborInfo for objects tracked by GridNeighborTracker.
+// This should be attached to each object as a member named Neighbor
+template<class Object> class GridNeighborTracker;
+template<class Object> class NeighborSnapshot;
+
+template<class Object> class GridNeighborInfo
+{
+protected:
+    friend class GridNeighborTracker<Object>;
+
+    // Update these via GridNeighborTracker::Update()
+
+    // Bucket holding the object, or -1 if not in the grid.
+    // Read without a lock and re-checked under the bucket lock
+    std::atomic<int> BucketIndex{ -1 };
+
+    // Offset into the bucket arrays. Protected by the bucket lock
+    int SlotIndex = 0;
+};
+
+
+//-----------------------------------------------------------------------------
+// GridNeighborTracker
+//
+// Spatial hash of square cells, meant to be sized to the query distance so
+// that a neighbor query only has to visit the 3x3 block of cells around the
+// object.  Each bucket keeps positions in parallel arrays so queries scan
+// contiguous memory, and buckets are guarded by a striped set of locks so
+// that updates in different parts of the map do not contend.
+//
+// Same interface as NeighborTracker.
+
+template<class Object> class GridNeighborTracker
+{
+public:
+    explicit GridNeighborTracker(int cellSize = 100);
+
+    void Remove(Object* node);
+    void Update(Object* node, int x, int y);
+
+    // Note: Returns a held Locker that should be released when done reading the neighbors
+    //
+    // Best effort: Buckets are read one stripe lock at a time, so an object
+    // that moves to another bucket during the query can be missed.  It may
+    // also be seen in both buckets; duplicates are removed
+    void GetNeighbors(Object* node, int distance, std::vector<Object*>& neighbors, ReadLocker& locker) const;
+
+protected:
+    friend class NeighborSnapshot<Object>;
+
+    static const int kBucketCount = 4096; // power of two
+    static const int kStripeCount = 64; // power of two
+
+    struct Bucket
+    {
+        std::vector<int> X, Y;
+        std::vector<Object*> Objects;
+    };
+
+    const int CellSize;
+
+    // Held for write by Remove() so that objects returned by GetNeighbors()
+    // are not removed while the caller is still reading them
+    mutable RWLock RemovalLock;
+
+    mutable RWLock StripeLocks[kStripeCount];
+    std::vector<Bucket> Buckets;
+
+    int toCell(int coord) const
+    {
+        // Round towards negative infinity
+        return coord >= 0 ? coord / CellSize : -((-coord - 1) / CellSize) - 1;
+    }
+    static int hashCell(int cx, int cy)
+    {
+        u32 h = (u32)cx * 73856093u ^ (u32)cy * 19349663u;
+        return (int)((h ^ (h >> 16)) & (kBucketCount - 1));
+    }
+    static int stripeOf(int bucket)
+    {
+        return bucket & (kStripeCount - 1);
+    }
+
+    // Note: Must be called with the stripe lock for the bucket held for write
+    void insertSlot(Object* node, int bucket, int x, int y);
+    void eraseSlot(Object* node, int bucket);
+};
+
+
+//-----------------------------------------------------------------------------
+// GridNeighborTracker
+
+template<class Object>
+GridNeighborTracker<Object>::GridNeighborTracker(int cellSize)
+    : CellSize(cellSize > 0 ? cellSize : 1)
+    , Buckets(kBucketCount)
+{
+}
+
+template<class Object>
+void GridNeighborTracker<Object>::insertSlot(Object* node, int bucket, int x, int y)
+{
+    Bucket& b = Buckets[bucket];
+    node->Neighbor.SlotIndex = (int)b.Objects.size();
+    b.X.push_back(x);
+    b.Y.push_back(y);
+    b.Objects.push_back(node);
+    node->Neighbor.BucketIndex = bucket;
+}
+
+template<class Object>
+void GridNeighborTracker<Object>::eraseSlot(Object* node, int bucket)
+{
+    Bucket& b = Buckets[bucket];
+    const int slot = node->Neighbor.SlotIndex;
+    const int last = (int)b.Objects.size() - 1;
+
+    // Swap the last object into the hole
+    if (slot != last)
+    {
+        Object* moved = b.Objects[last];
+        b.X[slot] = b.X[last];
+        b.Y[slot] = b.Y[last];
+        b.Objects[slot] = moved;
+        moved->Neighbor.SlotIndex = slot;
+    }
+
+    b.X.pop_back();
+    b.Y.pop_back();
+    b.Objects.pop_back();
+    node->Neighbor.BucketIndex = -1;
+}
+
+template<class Object>
+void GridNeighborTracker<Object>::Remove(Object* node)
+{
+    WriteLocker heavyLocker(RemovalLock);
+
+    for (;;)
+    {
+        const int bucket = node->Neighbor.BucketIndex;
+
+        // If already removed:
+        if (bucket < 0)
+            return;
+
+        WriteLocker locker(StripeLocks[stripeOf(bucket)]);
+
+        // If an Update() moved the object before we got the lock, try again:
+        if (node->Neighbor.BucketIndex != bucket)
+            continue;
+
+        eraseSlot(node, bucket);
+        return;
+    }
+}
+
+template<class Object>
+void GridNeighborTracker<Object>::Update(Object* node, int x, int y)
+{
+    const int newBucket = hashCell(toCell(x), toCell(y));
+
+    for (;;)
+    {
+        const int oldBucket = node->Neighbor.BucketIndex;
+
+        // Take the stripe locks for both buckets in a consistent order
+        int stripeA = stripeOf(newBucket), stripeB = -1;
+        if (oldBucket >= 0)
+        {
+            stripeB = stripeOf(oldBucket);
+            if (stripeB == stripeA)
+                stripeB = -1;
+            else if (stripeB < stripeA)
+                std::swap(stripeA, stripeB);
+        }
+
+        WriteLocker lockerA(StripeLocks[stripeA]);
+        WriteLocker lockerB;
+        if (stripeB >= 0)
+            lockerB.Set(StripeLocks[stripeB]);
+
+        // If we lost a race with another Update() or Remove(), try again:
+        if (node->Neighbor.BucketIndex != oldBucket)
+            continue;
+
+        // Update in place (common case):
+        if (oldBucket == newBucket)
+        {
+            Bucket& b = Buckets[newBucket];
+            const int slot = node->Neighbor.SlotIndex;
+            b.X[slot] = x;
+            b.Y[slot] = y;
+            return;
+        }
+
+        if (oldBucket >= 0)
+            eraseSlot(node, oldBucket);
+        insertSlot(node, newBucket, x, y);
+        return;
+    }
+}
+
+template<class Object>
+void GridNeighborTracker<Object>::GetNeighbors(Object* node, int distance, std::vector<Object*>& neighbors, ReadLocker& locker) const
+{
+    neighbors.clear();
+
+    locker.Set(RemovalLock);
+
+    // Look up our own position
+    int x, y, bucket;
+    for (;;)
+    {
+        bucket = node->Neighbor.BucketIndex;
+        if (bucket < 0)
+        {
+            locker.Clear();
+            return; // Not in the grid
+        }
+
+        ReadLocker stripeLocker(StripeLocks[stripeOf(bucket)]);
+        if (node->Neighbor.BucketIndex != bucket)
+            continue;
+
+        const Bucket& b = Buckets[bucket];
+        x = b.X[node->Neighbor.SlotIndex];
+        y = b.Y[node->Neighbor.SlotIndex];
+        break;
+    }
+
+    // Collect the distinct buckets covering the query square.
+    // Hash collisions may map several cells to the same bucket
+    const int cx0 = toCell(x - distance), cx1 = toCell(x + distance);
+    const int cy0 = toCell(y - distance), cy1 = toCell(y + distance);
+
+    static const int kMaxQueryBuckets = 64;
+    int queryBuckets[kMaxQueryBuckets];
+    int queryCount = 0;
+
+    // If the query is much larger than a cell, just scan every bucket
+    const bool scanAll = (s64)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > kMaxQueryBuckets;
+
+    for (int cy = cy0; !scanAll && cy <= cy1; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1; ++cx)
+        {
+            const int b = hashCell(cx, cy);
+            bool seen = false;
+            for (int i = 0; i < queryCount; ++i)
+            {
+                if (queryBuckets[i] == b)
+                {
+                    seen = true;
+                    break;
+                }
+            }
+            if (!seen)
+                queryBuckets[queryCount++] = b;
+        }
+    }
+    if (scanAll)
+        queryCount = kBucketCount;
+
+    for (int i = 0; i < queryCount; ++i)
+    {
+        const int b = scanAll ? i : queryBuckets[i];
+
+        ReadLocker stripeLocker(StripeLocks[stripeOf(b)]);
+
+        const Bucket& cell = Buckets[b];
+        const int* xs = cell.X.data();
+        const int* ys = cell.Y.data();
+        const int count = (int)cell.Objects.size();
+
+        for (int j = 0; j < count; ++j)
+        {
+            if (std::abs(xs[j] - x) <= distance &&
+                std::abs(ys[j] - y) <= distance &&
+                cell.Objects[j] != node)
+            {
+                neighbors.push_back(cell.Objects[j]);
+            }
+        }
+    }
+
+    // An object that moved between two of the buckets above shows up twice
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+}
+
+
+//-----------------------------------------------------------------------------
+// NeighborSnapshot
+//
+// Neighbor sets for every object in a GridNeighborTracker, computed together
+// in one pass.  Build() copies all positions into flat arrays, then runs
+// every query against those arrays without taking any locks, so each
+// connection can just read its precomputed list during its tick.
+//
+// Note: Object pointers are not kept alive by the snapshot.  Objects must
+// outlive any snapshot that was built while they were in the tracker.
+
+template<class Object> class NeighborSnapshot
+{
+public:
+    struct NeighborList
+    {
+        Object* const* Data = nullptr;
+        int Count = 0;
+
+        int size() const { return Count; }
+        Object* operator[](int i) const { return Data[i]; }
+    };
+
+    void Build(const GridNeighborTracker<Object>& tracker, int distance);
+
+    // Returns false if the object was not in the tracker when the snapshot was built
+    bool GetNeighbors(const Object* node, NeighborList& neighbors) const;
+
+    int GetObjectCount() const
+    {
+        return static_cast<int>(Objects.size());
+    }
+
+protected:
+    typedef GridNeighborTracker<Object> TrackerT;
+
+    // Object positions, grouped by bucket
+    std::vector<int> X, Y;
+    std::vector<Object*> Objects;
+    std::vector<int> BucketStart, BucketCount;
+
+    // Neighbors of Objects[i] are Neighbors[NeighborStart[i]] .. Neighbors[NeighborStart[i + 1] - 1]
+    std::vector<int> NeighborStart;
+    std::vector<Object*> Neighbors;
+
+    // Objects sorted by address for GetNeighbors()
+    std::vector<std::pair<const Object*, int>> Lookup;
+};
+
+
+//-----------------------------------------------------------------------------
+// NeighborSnapshot
+
+template<class Object>
+void NeighborSnapshot<Object>::Build(const TrackerT& tracker, int distance)
+{
+    X.clear();
+    Y.clear();
+    Objects.clear();
+    BucketStart.resize(TrackerT::kBucketCount);
+    BucketCount.resize(TrackerT::kBucketCount);
+
+    // Copy positions out one lock stripe at a time
+    for (int stripe = 0; stripe < TrackerT::kStripeCount; ++stripe)
+    {
+        ReadLocker locker(tracker.StripeLocks[stripe]);
+
+        for (int b = stripe; b < TrackerT::kBucketCount; b += TrackerT::kStripeCount)
+        {
+            const auto& bucket = tracker.Buckets[b];
+            BucketStart[b] = static_cast<int>(Objects.size());
+            BucketCount[b] = static_cast<int>(bucket.Objects.size());
+            X.insert(X.end(), bucket.X.begin(), bucket.X.end());
+            Y.insert(Y.end(), bucket.Y.begin(), bucket.Y.end());
+            Objects.insert(Objects.end(), bucket.Objects.begin(), bucket.Objects.end());
+        }
+    }
+
+    const int objectCount = static_cast<int>(Objects.size());
+
+    Lookup.resize(objectCount);
+    for (int i = 0; i < objectCount; ++i)
+        Lookup[i] = std::make_pair((const Object*)Objects[i], i);
+    std::sort(Lookup.begin(), Lookup.end());
+
+    NeighborStart.resize(objectCount + 1);
+    Neighbors.clear();
+
+    static const int kMaxQueryBuckets = 64;
+    int queryBuckets[kMaxQueryBuckets];
+
+    for (int i = 0; i < objectCount; ++i)
+    {
+        NeighborStart[i] = static_cast<int>(Neighbors.size());
+
+        const int x = X[i], y = Y[i];
+        const int cx0 = tracker.toCell(x - distance), cx1 = tracker.toCell(x + distance);
+        const int cy0 = tracker.toCell(y - distance), cy1 = tracker.toCell(y + distance);
+
+        int queryCount = 0;
+        const bool scanAll = (s64)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > kMaxQueryBuckets;
+
+        for (int cy = cy0; !scanAll && cy <= cy1; ++cy)
+        {
+            for (int cx = cx0; cx <= cx1; ++cx)
+            {
+                const int b = TrackerT::hashCell(cx, cy);
+                bool seen = false;
+                for (int k = 0; k < queryCount; ++k)
+                {
+                    if (queryBuckets[k] == b)
+                    {
+                        seen = true;
+                        break;
+                    }
+                }
+                if (!seen)
+                    queryBuckets[queryCount++] = b;
+            }
+        }
+        if (scanAll)
+            queryCount = TrackerT::kBucketCount;
+
+        for (int k = 0; k < queryCount; ++k)
+        {
+            const int b = scanAll ? k : queryBuckets[k];
+            const int start = BucketStart[b];
+            const int end = start + BucketCount[b];
+            const int* xs = X.data();
+            const int* ys = Y.data();
+
+            for (int j = start; j < end; ++j)
+            {
+                if (std::abs(xs[j] - x) <= distance &&
+                    std::abs(ys[j] - y) <= distance &&
+                    j != i)
+                {
+                    Neighbors.push_back(Objects[j]);
+                }
+            }
+        }
+    }
+
+    NeighborStart[objectCount] = static_cast<int>(Neighbors.size());
+}
+
+template<class Object>
+bool NeighborSnapshot<Object>::GetNeighbors(const Object* node, NeighborList& neighbors) const
+{
+    neighbors = NeighborList();
+
+    auto iter = std::lower_bound(Lookup.begin(), Lookup.end(), std::make_pair(node, 0));
+    if (iter == Lookup.end() || iter->first != node)
+        return false; // Not in the snapshot
+
+    const int i = iter->second;
+    neighbors.Data = Neighbors.data() + NeighborStart[i];
+    neighbors.Count = NeighborStart[i + 1] - NeighborStart[i];
+    return true;
+}
@@ -22,9 +22,9 @@ void MyClient::OnConnect(SphynxClient* client)
 
         Id = pid;
     });
-    client->Router.Set<S2CPlayerAddT>(S2CAddPlayerID, [this](playerid_t pid, std::string name)
+    client->Router.Set<S2CPlayerAddT>(S2CAddPlayerID, [this](playerid_t pid, string_view name)
     {
-        bool success = Players.insert(PlayerMap::value_type(pid, name)).second;
+        bool success = Players.insert(PlayerMap::value_type(pid, name.str())).second;
         if (!success)
         {
             Logger.Warning("Player ", (int)pid, " added twice!");
@@ -57,7 +57,7 @@ void MyClient::OnConnect(SphynxClient* client)
         {
             auto& player = iter->second;
 
-            const u64 nowMsec = GetTimeMsec();
+            const u64 nowMsec = GetCachedMsec();
             const u64 localTimeWhenSentMsec = Client->FromServerTime15(nowMsec, timestamp);
             const int delayMsec = (int)((s64)nowMsec - (s64)localTimeWhenSentMsec);
 
@@ -1,12 +1,11 @@
 #include "SphynxServer.h"
 #include "DemoProtocol.h"
+#include "EpochBuffer.h"
 #include <iostream>
+#include <list>
 
 static logging::Channel Logger("MyServer");
 
-// FIXME: This needs to support multiple arenas of up to 256 players since we have
-// a limited number of Ids to give out.
-
 
 /*
     Player Position Rebroadcasting:
@@ -31,43 +30,11 @@ static const int kBroadcastPlayerLimit = 15;
 // Do not rebroadcast data older than 2 seconds
 static const int kBroadcastTimeLimitMsec = 2000; // 2 seconds
 
+// Players per arena.  Player ids are only unique within an arena
+static const int kArenaPlayerLimit = 1000;
 
-//-----------------------------------------------------------------------------
-// PidAssigner
-//
-// Tool to keep track of available pids
-class PidAssigner
-{
-public:
-    static_assert(sizeof(playerid_t) == sizeof(u8), "PidAssigner would need to be rewritten");
-
-    PidAssigner()
-    {
-        for (int i = 0; i < 256; ++i)
-        {
-            Pids[i] = (u8)i;
-        }
-    }
-
-    bool Acquire(u8& pid)
-    {
-        Locker locker(PidLock);
-        if (PidLine <= 0)
-            return false;
-        pid = Pids[--PidLine];
-        return true;
-    }
-    void Release(u8 pid)
-    {
-        Locker locker(PidLock);
-        Pids[PidLine++] = pid;
-    }
-
-protected:
-    Lock PidLock;
-    u8 Pids[256];
-    int PidLine = 256;
-};
+// Arenas are created as needed up to this limit
+static const int kArenaLimit = 64;
 
 
 //-----------------------------------------------------------------------------
@@ -87,17 +54,24 @@ struct PlayerPositionData
 };
 
 struct MyServer;
+struct MyArena;
 
 struct MyConnection : ConnectionInterface
 {
     MyServer* Server = nullptr;
 
+    // Arena the player joined, or nullptr if every arena was full
+    MyArena* CurrentArena = nullptr;
+
     // Player info
     playerid_t Id = 0;
 
     mutable Lock PlayerDataLock;
     std::string Name;
-    PlayerPositionData PositionData;
+
+    // Published by the position update handler and read without locks by
+    // the OnTick() of every neighbor
+    EpochBuffer<PlayerPositionData> PositionState;
 
     std::string GetName() const
     {
@@ -105,10 +79,12 @@ struct MyConnection : ConnectionInterface
         return Name;
     }
 
-    PlayerPositionData GetPosition() const
+    // Returns the position as of the start of the given MyArena::PositionEpoch
+    PlayerPositionData GetPosition(u64 epoch) const
     {
-        Locker locker(PlayerDataLock);
-        return PositionData;
+        PlayerPositionData data;
+        PositionState.Read(data, epoch);
+        return data;
     }
 
     // Persistent data local to OnTick():
@@ -116,7 +92,7 @@ struct MyConnection : ConnectionInterface
     // Next neighbor array index to start broadcasting from
     int LastBroadcastIndex = 0;
 
-    NeighborInfo<MyConnection> Neighbor;
+    GridNeighborInfo<MyConnection> Neighbor;
 
     MyConnection(MyServer* server)
     {
@@ -136,15 +112,44 @@ struct MyConnection : ConnectionInterface
 
 
 //-----------------------------------------------------------------------------
-// MyServer
+// MyArena
 
 typedef std::list<MyConnection*> ConnectionListT;
+typedef NeighborSnapshot<MyConnection> NeighborSnapshotT;
 
-struct MyServer : ServerInterface
+// Snapshots hold raw pointers to connections, so a connection that leaves
+// the arena is kept alive by every snapshot that existed when it left.  A
+// snapshot lets go of them when it is rebuilt, which only happens once no
+// reader holds it
+struct ArenaSnapshot : NeighborSnapshotT
 {
-    NeighborTracker<MyConnection> BroadcastTracker;
+    std::vector<std::shared_ptr<MyConnection>> Retired;
+};
+
+struct MyArena : Arena
+{
+    GridNeighborTracker<MyConnection> BroadcastTracker;
+
+    // Neighbor sets for all players, rebuilt at most once per tick.
+    // Workers share one io_context, so players tick on any worker thread:
+    // The first to find it out of date rebuilds it, and the others keep
+    // reading the current one instead of waiting
+    Lock SnapshotBuildLock;
+    std::atomic<u64> SnapshotMsec;
+    std::shared_ptr<ArenaSnapshot> CurrentSnapshot;
+
+    // Every snapshot built so far, current included.  Uses SnapshotBuildLock
+    std::vector<std::shared_ptr<ArenaSnapshot>> Snapshots;
+
+    std::shared_ptr<const NeighborSnapshotT> GetNeighborSnapshot(u64 nowMsec);
 
-    PidAssigner Pids;
+    // Delete a connection that has left the arena once no snapshot can
+    // reach it
+    void RetireConnection(MyConnection* connection);
+
+    // Advanced along with each snapshot rebuild, so that every OnTick() during
+    // a tick reads the same version of each player's position
+    StateEpoch PositionEpoch;
 
     mutable RWLock ConnectionsLock;
     ConnectionListT Connections;
@@ -167,7 +172,7 @@ struct MyServer : ServerInterface
         return Connections;
     }
 
-    // Broadcast a message to all connections
+    // Broadcast a message to all connections in the arena
     template<typename T, typename... Args>
     void Broadcast(MyConnection* excluded, T MyConnection::*pFunction, Args... args)
     {
@@ -178,37 +183,108 @@ struct MyServer : ServerInterface
         {
             if (connection != excluded)
             {
-                Logger.Debug("Broadcasting from ", (int)excluded->Id, " to ", (int)connection->Id);
+                SPHYNX_DEBUG(Logger, "Broadcasting from ", (int)excluded->Id, " to ", (int)connection->Id);
 
                 (connection->*pFunction)(args...);
             }
         }
     }
 
+    explicit MyArena(unsigned arenaIndex)
+        : Arena(arenaIndex, kArenaPlayerLimit)
+        , BroadcastTracker(kBroadcastDistance)
+    {
+        SnapshotMsec = 0;
+        CurrentSnapshot = std::make_shared<ArenaSnapshot>();
+        Snapshots.push_back(CurrentSnapshot);
+    }
+    virtual ~MyArena() {}
+
+    void OnDisconnect(playerid_t pid, MyConnection* connection);
+};
+
+
+//-----------------------------------------------------------------------------
+// MyServer
+
+struct MyServer : ServerInterface
+{
+    mutable Lock ArenasLock;
+    std::vector<std::unique_ptr<MyArena>> Arenas;
+
+    // Returns the arena the player joined, or nullptr if all arenas are full
+    MyArena* JoinArena(Connection* connection, playerid_t& pid);
+
     MyServer() {}
     virtual ~MyServer() {}
 
     ConnectionInterface* CreateConnection(Connection* connection) override;
     void DestroyConnection(ConnectionInterface* iface, Connection* connection) override;
-
-    void OnDisconnect(playerid_t pid, MyConnection* connection);
 };
 
 
 //-----------------------------------------------------------------------------
-// MyServer
+// MyArena
 
-ConnectionInterface* MyServer::CreateConnection(Connection* connection)
+std::shared_ptr<const NeighborSnapshotT> MyArena::GetNeighborSnapshot(u64 nowMsec)
 {
-    return new MyConnection(this);
+    if ((s64)(nowMsec - SnapshotMsec) >= kServerWorkerTimerIntervalMsec &&
+        SnapshotBuildLock.TryEnter())
+    {
+        // If another worker did not rebuild it while we were waiting:
+        if ((s64)(nowMsec - SnapshotMsec) >= kServerWorkerTimerIntervalMsec)
+        {
+            // Reuse an old snapshot that no reader holds.  The current one
+            // is also held by CurrentSnapshot, so it is never picked
+            std::shared_ptr<ArenaSnapshot> snapshot;
+            for (auto& old : Snapshots)
+            {
+                if (old.use_count() == 1)
+                {
+                    snapshot = old;
+                    break;
+                }
+            }
+            if (!snapshot)
+            {
+                snapshot = std::make_shared<ArenaSnapshot>();
+                Snapshots.push_back(snapshot);
+            }
+
+            // Connections that left before this build are not in it
+            snapshot->Retired.clear();
+
+            PositionEpoch.Advance();
+            snapshot->Build(BroadcastTracker, kBroadcastDistance);
+
+            std::atomic_store(&CurrentSnapshot, snapshot);
+            SnapshotMsec = nowMsec;
+        }
+
+        SnapshotBuildLock.Leave();
+    }
+
+    return std::atomic_load(&CurrentSnapshot);
 }
 
-void MyServer::DestroyConnection(ConnectionInterface* iface, Connection* connection)
+void MyArena::RetireConnection(MyConnection* connection)
 {
-    delete iface;
+    // OnDisconnect() normally did this already, but not if the server
+    // stopped first.  Both are safe to repeat
+    BroadcastTracker.Remove(connection);
+    RemoveConnection(connection);
+
+    std::shared_ptr<MyConnection> retired(connection);
+
+    // Snapshots that are neither current nor held by a reader will be
+    // rebuilt before anyone reads them again
+    Locker locker(SnapshotBuildLock);
+    for (auto& snapshot : Snapshots)
+        if (snapshot.use_count() > 1)
+            snapshot->Retired.push_back(retired);
 }
 
-void MyServer::OnDisconnect(playerid_t pid, MyConnection* connection)
+void MyArena::OnDisconnect(playerid_t pid, MyConnection* connection)
 {
     BroadcastTracker.Remove(connection);
 
@@ -217,7 +293,56 @@ void MyServer::OnDisconnect(playerid_t pid, MyConnection* connection)
     Broadcast(connection, &MyConnection::TCPRemovePlayer,
         pid);
 
-    Pids.Release(pid);
+    Leave(pid);
+}
+
+
+//-----------------------------------------------------------------------------
+// MyServer
+
+ConnectionInterface* MyServer::CreateConnection(Connection* connection)
+{
+    return new MyConnection(this);
+}
+
+void MyServer::DestroyConnection(ConnectionInterface* iface, Connection* connection)
+{
+    MyConnection* myConnection = static_cast<MyConnection*>(iface);
+
+    // Neighbor snapshots may still point at it
+    if (myConnection->CurrentArena)
+        myConnection->CurrentArena->RetireConnection(myConnection);
+    else
+        delete myConnection;
+}
+
+MyArena* MyServer::JoinArena(Connection* connection, playerid_t& pid)
+{
+    Locker locker(ArenasLock);
+
+    u32 id = 0;
+    for (auto& arena : Arenas)
+    {
+        if (arena->Join(connection, id))
+        {
+            pid = static_cast<playerid_t>(id);
+            return arena.get();
+        }
+    }
+
+    if (static_cast<int>(Arenas.size()) >= kArenaLimit)
+        return nullptr;
+
+    const unsigned arenaIndex = static_cast<unsigned>(Arenas.size());
+    Logger.Info("Opening arena ", arenaIndex);
+
+    Arenas.emplace_back(new MyArena(arenaIndex));
+    MyArena* arena = Arenas.back().get();
+    if (!arena->Join(connection, id))
+        return nullptr;
+
+    pid = static_cast<playerid_t>(id);
+    return arena;
 }
 
 
@@ -226,36 +351,39 @@ void MyServer::OnDisconnect(playerid_t pid, MyConnection* connection)
 
 void MyConnection::OnConnect(Connection* connection)
 {
-    if (!Server->Pids.Acquire(Id))
+    CurrentArena = Server->JoinArena(connection, Id);
+    if (!CurrentArena)
     {
-        Logger.Warning("FIXME: Too many players not handled");
+        Logger.Warning("All arenas are full: Disconnecting player");
+        connection->Disconnect();
+        return;
     }
 
-    Logger.Info((int)Id, ": Connect");
+    Logger.Info((int)Id, ": Connect to arena ", CurrentArena->GetIndex());
 
     TCPSetPlayerId.CallSender = connection->TCPCallSender;
     TCPAddPlayer.CallSender = connection->TCPCallSender;
     TCPRemovePlayer.CallSender = connection->TCPCallSender;
     UDPPositionUpdate.CallSender = connection->UDPCallSender;
 
-    connection->Router.Set<C2SLoginT>(C2SLoginID, [connection, this](std::string name)
+    connection->Router.Set<C2SLoginT>(C2SLoginID, [connection, this](string_view name)
     {
         Logger.Info((int)Id, ": User login '", name, "'");
 
         {
             Locker locker(PlayerDataLock);
-            Name = name;
+            Name = name.str();
         }
 
-        this->Server->InsertConnection(this);
+        CurrentArena->InsertConnection(this);
 
-        this->Server->Broadcast(this, &MyConnection::TCPAddPlayer,
+        CurrentArena->Broadcast(this, &MyConnection::TCPAddPlayer,
             Id, name);
 
         // Send them the whole player list
         {
             ReadLocker locker;
-            const auto& connections = this->Server->GetConnections(locker);
+            const auto& connections = CurrentArena->GetConnections(locker);
 
             for (auto& connection : connections)
                 TCPAddPlayer(connection->Id, connection->GetName());
@@ -263,25 +391,27 @@ void MyConnection::OnConnect(Connection* connection)
 
         connection->Router.Set<C2SPositionUpdateT>(C2SPositionUpdateID, [this](u16 timestamp, PlayerPosition position)
         {
-            Locker locker(PlayerDataLock);
-            if (!PositionData.HasPosition)
+            PlayerPositionData data;
+            if (!PositionState.ReadLatest(data))
             {
                 Logger.Info((int)Id, ": Received player position for the first time");
-                PositionData.HasPosition = true;
+                data.HasPosition = true;
             }
 
-            const u64 nowMsec = GetTimeMsec();
+            const u64 nowMsec = GetCachedMsec();
             const u64 localSentTimeMsec = ReconstructMsec(nowMsec, timestamp);
             int delayMsec = (int)((s64)nowMsec - (s64)localSentTimeMsec);
             // This data is used to avoid rebroadcasting data after a given timeout
 
-            PositionData.Position = position;
-            PositionData.PositionTimestamp15 = timestamp;
-            PositionData.PositionMsec = localSentTimeMsec;
+            data.Position = position;
+            data.PositionTimestamp15 = timestamp;
+            data.PositionMsec = localSentTimeMsec;
+
+            PositionState.Publish(data, CurrentArena->PositionEpoch.Get());
 
             Logger.Info((int)Id, ": Received player position with one-way-delay=", delayMsec);
 
-            this->Server->BroadcastTracker.Update(this, position.x, position.y);
+            CurrentArena->BroadcastTracker.Update(this, position.x, position.y);
         });
     });
 
@@ -290,27 +420,29 @@ void MyConnection::OnConnect(Connection* connection)
 
 void MyConnection::OnTick(Connection* connection, u64 nowMsec)
 {
-    PlayerPositionData currentPlayerData = GetPosition();
+    // Neighbor sets for all players are computed together once per tick
+    auto snapshot = CurrentArena->GetNeighborSnapshot(nowMsec);
+    const u64 epoch = CurrentArena->PositionEpoch.Get();
+
+    PlayerPositionData currentPlayerData = GetPosition(epoch);
 
     if (currentPlayerData.ShouldBroadcast(nowMsec))
     {
-        ReadLocker locker;
-        std::vector<MyConnection*> neighbors;
-
-        Server->BroadcastTracker.GetNeighbors(this, kBroadcastDistance, neighbors, locker);
+        NeighborSnapshotT::NeighborList neighbors;
+        snapshot->GetNeighbors(this, neighbors);
 
-        const int neighborCount = static_cast<int>(neighbors.size());
+        const int neighborCount = neighbors.size();
         if (neighborCount > 0)
         {
             int broadcastIndex = LastBroadcastIndex; // Start from last index
 
-            for (int neighborUpdateCount = 0; neighborUpdateCount < neighborCount && neighborUpdateCount < kBroadcastPlayerLimit; ++neighborUpdateCount);
+            for (int neighborUpdateCount = 0; neighborUpdateCount < neighborCount && neighborUpdateCount < kBroadcastPlayerLimit; ++neighborUpdateCount)
             {
                 if (++broadcastIndex >= neighborCount)
                     broadcastIndex = 0;
 
                 MyConnection* neighbor = neighbors[broadcastIndex];
-                PlayerPositionData neighborData = neighbor->GetPosition();
+                PlayerPositionData neighborData = neighbor->GetPosition(epoch);
 
                 if (neighborData.ShouldBroadcast(nowMsec))
                 {
@@ -327,12 +459,14 @@ void MyConnection::OnDisconnect(Connection* connection)
 {
     Logger.Info((int)Id, ": Disconnected");
 
-    Server->OnDisconnect(Id, this);
+    if (CurrentArena)
+        CurrentArena->OnDisconnect(Id, this);
 }
 
 
 
-int main()
+// Usage: UDPServer [capture file]
+int main(int argc, char* argv[])
 {
     SetThreadName("Main");
 
@@ -346,12 +480,43 @@ int main()
     settings->StartUDPPort = 5060;
     settings->StopUDPPort = 5061;
     settings->Interface = &myserver;
+    settings->CollectCallStats = true;
+    if (argc > 1)
+        settings->CaptureFile = argv[1];
 
     Server server;
     server.Start(settings);
-    for (;;)
+    for (unsigned seconds = 1;; ++seconds)
     {
         std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        if (seconds % 10 == 0)
+        {
+            ServerMemoryStats stats;
+            server.GetMemoryStats(stats);
+
+            Logger.Info("Memory: ", stats.ConnectionCount, " connections in ", stats.ConnectionBytes,
+                " bytes (", stats.IdleConnectionBytes, " each when idle), TCP state ",
+                stats.TCPState.AllocatedBytes, " bytes (",
+                stats.TCPState.SendStatesInUse, " send and ", stats.TCPState.ReceiveStatesInUse,
+                " receive in use, ", stats.TCPState.PooledStates, " pooled), shared contexts ",
+                stats.TCPState.SharedContextBytes, " bytes");
+
+            ServerTickStats ticks;
+            server.GetTickStats(ticks);
+            for (size_t i = 0; i < ticks.Workers.size(); ++i)
+            {
+                Logger.Info("Worker ", i, ": Peak tick ", ticks.Workers[i].PeakTickUsec, " usec, peak lag ",
+                    ticks.Workers[i].PeakLagUsec, " usec, ", ticks.Workers[i].SlowTicks, " slow ticks");
+            }
+
+            MetricsSnapshot metrics;
+            GetMetrics().GetSnapshot(metrics);
+            Logger.Info("Metrics:\n", metrics.FormatText());
+
+            if (server.GetCallStats())
+                Logger.Info("Calls:\n", server.GetCallStats()->FormatText());
+        }
     }
     server.Stop();
 
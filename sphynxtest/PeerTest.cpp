@@ -0,0 +1,311 @@
+#include "SphynxClient.h"
+#include "SphynxServer.h"
+
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static logging::Channel Logger("PeerTest");
+
+
+//-----------------------------------------------------------------------------
+// TestClient
+
+// Bytes past the end of the datagram buffer that must never be written
+static const int kGuardBytes = 64;
+static const u8 kGuardValue = 0xCD;
+
+// Client peer with no sockets, so flushes are dropped.  Its datagram buffer
+// is followed by guard bytes to catch writes past the end
+class TestClient : public SphynxClient
+{
+public:
+    TestClient()
+    {
+        UDPOutBuffer = MakeCountedArray<u8>(nullptr, UDPOutBufferSize + kGuardBytes);
+        memset(&UDPOutBuffer[0], kGuardValue, UDPOutBufferSize + kGuardBytes);
+    }
+
+    int GetUDPMessageMaxBytes() const
+    {
+        return (int)(UDPOutBufferSize - UDPOutReserved);
+    }
+
+    void PackUDPBytes(int bytes)
+    {
+        std::vector<u8> message(bytes, 0x11);
+        Stream stream;
+        stream.WrapWrite(message.data(), message.size());
+        stream.GetBlock(bytes);
+        PackUDP(stream);
+    }
+
+    bool IsUDPBufferFull() const
+    {
+        return UDPOutUsed == UDPOutBufferSize;
+    }
+    bool IsUDPBufferEmpty() const
+    {
+        return UDPOutUsed == UDPOutReserved;
+    }
+
+    bool GuardIntact() const
+    {
+        for (int i = 0; i < kGuardBytes; ++i)
+            if (UDPOutBuffer[UDPOutBufferSize + i] != kGuardValue)
+                return false;
+        return true;
+    }
+
+    void FlushUDPBuffer()
+    {
+        FlushUDP();
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+// Loopback server and client
+
+// Ports for the tests that run a server
+static const unsigned short kTestPort = 5090;
+
+// Time allowed for the client to connect, and for the server to handle a
+// datagram
+static const int kTestTimeoutMsec = 5000; // 5 seconds
+
+class NullConnection : public ConnectionInterface
+{
+public:
+    void OnConnect(Connection* connection) override {}
+    void OnTick(Connection* connection, u64 nowMsec) override {}
+    void OnDisconnect(Connection* connection) override {}
+};
+
+class NullServer : public ServerInterface
+{
+public:
+    ConnectionInterface* CreateConnection(Connection* connection) override
+    {
+        return new NullConnection;
+    }
+
+    void DestroyConnection(ConnectionInterface* iface, Connection* connection) override
+    {
+        delete iface;
+    }
+};
+
+class LoopbackClient : public SphynxClient, public ClientInterface
+{
+public:
+    std::atomic_bool Connected{ false };
+
+    u64 GetConnectionCookie() const
+    {
+        return ConnectionCookie;
+    }
+
+    void OnConnectFail(SphynxClient* client) override {}
+    void OnConnect(SphynxClient* client) override
+    {
+        Connected = true;
+    }
+    void OnTick(SphynxClient* client, u64 nowMsec) override {}
+    void OnDisconnect(SphynxClient* client) override {}
+};
+
+// Client datagram carrying a heartbeat, exactly as a client would have sent
+// it at the given time.  Datagrams carry no other state, so this is also
+// what a datagram captured at that time looks like
+static std::vector<u8> MakeClientDatagram(u64 cookie, u64 sentMsec)
+{
+    std::vector<u8> plaintext(2);
+    const u16 partialTime = (u16)sentMsec;
+    memcpy(plaintext.data(), &partialTime, 2);
+
+    CallSerializer<C2SHeartbeatID, C2SHeartbeatT> heartbeat;
+    heartbeat.CallSender = [&plaintext](Stream& stream)
+    {
+        plaintext.insert(plaintext.end(), stream.GetFront(), stream.GetFront() + stream.GetUsed());
+    };
+    heartbeat((u16)(sentMsec & 0x7fff));
+
+    Encryptor cipher;
+    cipher.InitializeEncryption(0, EncryptionRole::Client);
+
+    std::vector<u8> datagram(kC2SUDPHeaderMaxBytes + plaintext.size());
+    datagram[0] = kC2SUDPFlagConnectionId;
+    memcpy(&datagram[1], &cookie, 8);
+    cipher.EncryptUDP(plaintext.data(), &datagram[kC2SUDPHeaderMaxBytes], (int)plaintext.size());
+    return datagram;
+}
+
+// Wait for a counter to reach a value.  Returns false on timeout
+static bool WaitForCount(const MetricCounter& counter, u64 count)
+{
+    const u64 startMsec = GetTimeMsec();
+    while (counter.Read() < count)
+    {
+        if (GetTimeMsec() - startMsec > (u64)kTestTimeoutMsec)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Tests
+
+#define TEST_CHECK(cond) do { if (!(cond)) { \
+    Logger.Error("Failed: ", #cond, " at line ", __LINE__); return false; } } while(false);
+
+// The largest message a client can pack fills its buffer exactly, leaving
+// room for the datagram header in front of it
+static bool TestPackUDPMaxMessage()
+{
+    TestClient client;
+    const int maxBytes = client.GetUDPMessageMaxBytes();
+    TEST_CHECK(maxBytes > 0);
+
+    client.PackUDPBytes(maxBytes);
+    TEST_CHECK(client.IsUDPBufferFull());
+    TEST_CHECK(client.GuardIntact());
+
+    // The next message flushes the full buffer first
+    client.PackUDPBytes(1);
+    TEST_CHECK(!client.IsUDPBufferFull());
+    TEST_CHECK(client.GuardIntact());
+
+    client.FlushUDPBuffer();
+    TEST_CHECK(client.IsUDPBufferEmpty());
+
+    // Pack the largest message again after smaller ones
+    client.PackUDPBytes(100);
+    client.PackUDPBytes(maxBytes);
+    TEST_CHECK(client.IsUDPBufferFull());
+    TEST_CHECK(client.GuardIntact());
+    return true;
+}
+
+// One byte more than the largest message is dropped.  Dropping also hits
+// DEBUG_BREAK, so this runs in a child process and expects it to trap
+static bool TestPackUDPTooLong()
+{
+#if !defined(_WIN32)
+    const pid_t child = fork();
+    TEST_CHECK(child >= 0);
+
+    if (child == 0)
+    {
+        TestClient client;
+        client.PackUDPBytes(client.GetUDPMessageMaxBytes() + 1);
+        _exit(client.GuardIntact() ? 0 : 1);
+    }
+
+    int status = 0;
+    TEST_CHECK(waitpid(child, &status, 0) == child);
+    TEST_CHECK(WIFSIGNALED(status));
+#endif
+    return true;
+}
+
+
+// Datagrams replayed from a new address must not move the connection there,
+// including old ones whose 16-bit timestamp wraps around to look newer than
+// the last one received.  A fresh datagram from a new address moves it
+static bool CheckUDPMigrationReplay(LoopbackClient& client)
+{
+    const MetricCounter& migrations = GetMetrics().GetCounter("udp.migrations");
+    const MetricCounter& refused = GetMetrics().GetCounter("udp.migrations_refused");
+
+    const u64 startMsec = GetTimeMsec();
+    while (!client.Connected && GetTimeMsec() - startMsec < (u64)kTestTimeoutMsec)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    TEST_CHECK(client.Connected);
+
+    // Let the client heartbeat for longer than the migrate interval
+    std::this_thread::sleep_for(std::chrono::milliseconds(2 * kS2CUDPMigrateIntervalMsec));
+
+    asio::io_context context;
+    const asio::ip::udp::endpoint serverAddr(asio::ip::address_v4::loopback(), kTestPort);
+    asio::ip::udp::socket socket(context, asio::ip::udp::endpoint(asio::ip::udp::v4(), 0));
+
+    const u64 cookie = client.GetConnectionCookie();
+    const u64 migrationsBefore = migrations.Read();
+    const u64 refusedBefore = refused.Read();
+
+    // Sent before the client's last heartbeat
+    const u64 nowMsec = GetTimeMsec();
+    socket.send_to(asio::buffer(MakeClientDatagram(cookie, nowMsec - 1500)), serverAddr);
+    TEST_CHECK(WaitForCount(refused, refusedBefore + 1));
+
+    // Captured 40 seconds ago, so it looks 25.5 seconds newer than the last
+    socket.send_to(asio::buffer(MakeClientDatagram(cookie, nowMsec - 40000)), serverAddr);
+    TEST_CHECK(WaitForCount(refused, refusedBefore + 2));
+    TEST_CHECK(migrations.Read() == migrationsBefore);
+
+    socket.send_to(asio::buffer(MakeClientDatagram(cookie, GetTimeMsec())), serverAddr);
+    TEST_CHECK(WaitForCount(migrations, migrationsBefore + 1));
+    return true;
+}
+
+static bool TestUDPMigrationReplay()
+{
+    NullServer nullServer;
+    auto settings = std::make_shared<ServerSettings>();
+    settings->WorkerCount = 1;
+    settings->MainTCPPort = kTestPort;
+    settings->StartUDPPort = kTestPort;
+    settings->StopUDPPort = kTestPort;
+    settings->SlowTickMsec = 0;
+    settings->Interface = &nullServer;
+
+    Server server;
+    server.Start(settings);
+
+    LoopbackClient client;
+    auto clientSettings = std::make_shared<ClientSettings>();
+    clientSettings->Host = "127.0.0.1";
+    clientSettings->TCPPort = kTestPort;
+    clientSettings->Interface = &client;
+    client.Start(clientSettings);
+
+    const bool success = CheckUDPMigrationReplay(client);
+
+    client.Stop();
+    server.Stop();
+    return success;
+}
+
+
+//-----------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetThreadName("Main");
+
+    // The drop warning is expected
+    logging::SetChannelMinLevel("SphynxCommon", logging::Level::Error);
+
+    int failures = 0;
+
+    if (!TestPackUDPMaxMessage())
+        ++failures;
+    if (!TestPackUDPTooLong())
+        ++failures;
+    if (!TestUDPMigrationReplay())
+        ++failures;
+
+    if (failures > 0)
+    {
+        Logger.Error(failures, " tests failed");
+        return 1;
+    }
+
+    Logger.Info("All tests passed");
+    return 0;
+}